@@ -0,0 +1,575 @@
+/*
+ * ar-archive.cpp
+ *
+ * Copyright 2020-2025 Kerry Shetline <kerry@shetline.com>
+ *
+ * MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "ar-archive.h"
+
+#include <cstring>
+
+#if !defined(WIN32) && !defined(WINDOWS)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#define ARTHSM ArTemperatureHumiditySignalMonitor
+
+static const uint64_t KEY_MASK = ArPackedReading::CHANNEL_MASK | ArPackedReading::SENSOR_ID_MASK;
+static const uint64_t OTHER_MASK = ~(KEY_MASK | ArPackedReading::HUMIDITY_MASK | ArPackedReading::RAW_TEMP_MASK);
+static const int PAGE_SIZE_ESTIMATE = 4096;
+static const int SLOT_BITS = 0x07;
+
+static inline void put32(uint8_t *p, uint32_t value) {
+  p[0] = value; p[1] = value >> 8; p[2] = value >> 16; p[3] = value >> 24;
+}
+
+static inline uint32_t get32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint8_t *putVarint(uint8_t *p, uint64_t value) {
+  while (value >= 0x80) {
+    *p++ = (uint8_t) (value | 0x80);
+    value >>= 7;
+  }
+
+  *p++ = (uint8_t) value;
+
+  return p;
+}
+
+static inline uint64_t zigzag(int64_t value) {
+  return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value) {
+  return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+static inline int humidityOf(const ArPackedReading &reading) {
+  return (int) ((reading.fields & ArPackedReading::HUMIDITY_MASK) >> ArPackedReading::HUMIDITY_SHIFT);
+}
+
+static inline int rawTempOf(const ArPackedReading &reading) {
+  return (int) ((reading.fields & ArPackedReading::RAW_TEMP_MASK) >> ArPackedReading::RAW_TEMP_SHIFT);
+}
+
+uint32_t ArArchive::crc32(const uint8_t *data, size_t length, uint32_t crc) {
+  static const struct Table {
+    uint32_t entries[256];
+
+    Table() {
+      for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+
+        for (int k = 0; k < 8; ++k)
+          c = (c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1);
+
+        entries[i] = c;
+      }
+    }
+  } table;
+
+  crc = ~crc;
+
+  for (size_t i = 0; i < length; ++i)
+    crc = table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+  return ~crc;
+}
+
+#if defined(WIN32) || defined(WINDOWS)
+ArArchive::Writer::Writer(const string &path, int blockSize, int64_t commitInterval, int64_t syncInterval) {
+  throw "Archive writing is not supported on this platform";
+}
+
+ArArchive::Writer::~Writer() {
+}
+
+void ArArchive::Writer::commit() {
+}
+
+void ArArchive::Writer::sync() {
+}
+#else
+ArArchive::Writer::Writer(const string &path, int blockSize, int64_t commitInterval, int64_t syncInterval) :
+    blockSize(blockSize), commitInterval(commitInterval), syncInterval(syncInterval) {
+  if (blockSize < BLOCK_HEADER_SIZE + MAX_ENCODED_SIZE || blockSize > MAX_BLOCK_SIZE)
+    throw "Invalid archive block size";
+
+  uint64_t validLength = 0;
+  struct stat status;
+
+  if (stat(path.c_str(), &status) == 0 && status.st_size > 0) {
+    Reader reader(path);
+    ArPackedReading reading;
+
+    while (reader.next(reading)) {}
+
+    validLength = reader.validLength();
+  }
+
+  fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+
+  if (fd < 0)
+    throw "Unable to open archive file";
+
+  if (validLength == 0) {
+    uint8_t header[FILE_HEADER_SIZE] = {};
+
+    put32(header, MAGIC);
+    put32(header + 4, VERSION);
+
+    if (ftruncate(fd, 0) != 0 || write(fd, header, FILE_HEADER_SIZE) != FILE_HEADER_SIZE) {
+      close(fd);
+      throw "Unable to write archive file";
+    }
+
+    validLength = FILE_HEADER_SIZE;
+  }
+  else if (ftruncate(fd, validLength) != 0 || lseek(fd, validLength, SEEK_SET) < 0) {
+    close(fd);
+    throw "Unable to recover archive file";
+  }
+
+  fileSize = validLength;
+  block.resize(blockSize);
+  queue.resize(QUEUE_SIZE);
+  writerThread = new thread([this]() { writerLoop(); });
+}
+
+ArArchive::Writer::~Writer() {
+  {
+    lock_guard<mutex> queueGuard(queueLock);
+    writerExit = true;
+  }
+
+  queueReady.notify_one();
+  writerThread->join();
+  delete writerThread;
+  flush();
+  close(fd);
+}
+
+// The whole block, header and payload, goes out in a single write.
+void ArArchive::Writer::commit() {
+  if (blockReadings == 0)
+    return;
+
+  uint8_t *header = block.data();
+
+  put32(header, BLOCK_MAGIC);
+  put32(header + 4, used - BLOCK_HEADER_SIZE);
+  put32(header + 8, blockReadings);
+  put32(header + 12, crc32(header + BLOCK_HEADER_SIZE, used - BLOCK_HEADER_SIZE, crc32(header, 12)));
+
+  if (write(fd, header, used) == (ssize_t) used) {
+    stats.pagesWritten += (fileSize + used - 1) / PAGE_SIZE_ESTIMATE - fileSize / PAGE_SIZE_ESTIMATE + 1;
+    stats.bytes += used;
+    stats.readings += blockReadings;
+    ++stats.blocks;
+    fileSize += used;
+  }
+  else {
+    ++stats.writeErrors;
+
+    if (ftruncate(fd, fileSize) != 0 || lseek(fd, fileSize, SEEK_SET) < 0)
+      ++stats.writeErrors;
+  }
+
+  for (auto &slot : slots)
+    slot.active = false;
+
+  blockReadings = 0;
+  nextSlot = 0;
+  used = BLOCK_HEADER_SIZE;
+}
+
+void ArArchive::Writer::sync() {
+  fsync(fd);
+  ++stats.syncs;
+}
+#endif
+
+bool ArArchive::Writer::append(const ARTHSM::SensorData &sd) {
+  ArPackedReading reading = ArPackedReading::encode(sd);
+
+  {
+    lock_guard<mutex> queueGuard(queueLock);
+
+    if (queueLength == QUEUE_SIZE) {
+      ++droppedCount;
+      return false;
+    }
+
+    queue[(queueStart + queueLength++) % QUEUE_SIZE] = reading;
+  }
+
+  queueReady.notify_one();
+
+  return true;
+}
+
+// Must be called with lock held.
+void ArArchive::Writer::store(const ArPackedReading &reading) {
+  int64_t time = reading.collectionTime();
+
+  if (blockReadings > 0 && (used + MAX_ENCODED_SIZE > (size_t) blockSize || time - blockStart >= commitInterval)) {
+    commit();
+
+    if (time - lastSync >= syncInterval) {
+      sync();
+      lastSync = time;
+    }
+  }
+
+  if (blockReadings == 0)
+    blockStart = time;
+
+  if (lastSync == 0)
+    lastSync = time;
+
+  encode(reading);
+  ++blockReadings;
+}
+
+void ArArchive::Writer::encode(const ArPackedReading &reading) {
+  uint64_t key = reading.fields & KEY_MASK;
+  int64_t time = reading.collectionTime();
+  int humidity = humidityOf(reading);
+  int rawTemp = rawTempOf(reading);
+  uint64_t other = reading.fields & OTHER_MASK;
+  int repeats = reading.repeatsCaptured();
+  uint8_t *start = block.data() + used;
+  uint8_t *p = start + 1;
+  int slotIndex = 0;
+
+  while (slotIndex < SENSOR_SLOTS && !(slots[slotIndex].active && slots[slotIndex].key == key))
+    ++slotIndex;
+
+  if (slotIndex == SENSOR_SLOTS) {
+    slotIndex = nextSlot;
+    nextSlot = (nextSlot + 1) % SENSOR_SLOTS;
+    *start = (uint8_t) (slotIndex | NEW_SENSOR);
+    p = putVarint(p, (key & ArPackedReading::CHANNEL_MASK) | (key >> ArPackedReading::SENSOR_ID_SHIFT) << 3);
+    p = putVarint(p, zigzag(time));
+    p = putVarint(p, humidity);
+    p = putVarint(p, rawTemp);
+    p = putVarint(p, other);
+    p = putVarint(p, repeats);
+    slots[slotIndex].interval = 0;
+  }
+  else {
+    SensorSlot &slot = slots[slotIndex];
+    int64_t interval = time - slot.time;
+    int tempChange = rawTemp - slot.rawTemp;
+    int humidityChange = humidity - slot.humidity;
+    uint8_t tag = (uint8_t) slotIndex;
+
+    p = putVarint(p, zigzag(interval - slot.interval));
+
+    if (tempChange >= -8 && tempChange <= 7 && humidityChange >= -8 && humidityChange <= 7) {
+      tag |= SMALL_DELTAS;
+      *p++ = (uint8_t) ((tempChange & 0x0F) << 4 | (humidityChange & 0x0F));
+    }
+    else {
+      p = putVarint(p, zigzag(tempChange));
+      p = putVarint(p, zigzag(humidityChange));
+    }
+
+    if (other != slot.other) {
+      tag |= OTHER_CHANGED;
+      p = putVarint(p, other);
+    }
+
+    if (repeats != slot.repeats) {
+      tag |= REPEATS_CHANGED;
+      p = putVarint(p, repeats);
+    }
+
+    *start = tag;
+    slot.interval = interval;
+  }
+
+  SensorSlot &slot = slots[slotIndex];
+
+  slot.active = true;
+  slot.humidity = humidity;
+  slot.key = key;
+  slot.other = other;
+  slot.rawTemp = rawTemp;
+  slot.repeats = repeats;
+  slot.time = time;
+  used = p - block.data();
+}
+
+void ArArchive::Writer::flush() {
+  waitUntilDrained();
+
+  lock_guard<mutex> guard(lock);
+
+  commit();
+  sync();
+}
+
+ArArchive::Stats ArArchive::Writer::getStats() {
+  lock_guard<mutex> guard(lock);
+  Stats result = stats;
+  lock_guard<mutex> queueGuard(queueLock);
+
+  result.dropped = droppedCount;
+
+  return result;
+}
+
+void ArArchive::Writer::waitUntilDrained() {
+  unique_lock<mutex> queueGuard(queueLock);
+
+  queueDrained.wait(queueGuard, [this]() { return writerExit || (queueLength == 0 && !writerBusy); });
+}
+
+// Exits only once the queue is empty, so nothing appended before destruction is lost.
+void ArArchive::Writer::writerLoop() {
+  unique_lock<mutex> queueGuard(queueLock);
+
+  while (true) {
+    queueReady.wait(queueGuard, [this]() { return queueLength > 0 || writerExit; });
+
+    if (queueLength == 0)
+      break;
+
+    ArPackedReading reading = queue[queueStart];
+
+    queueStart = (queueStart + 1) % QUEUE_SIZE;
+    --queueLength;
+    writerBusy = true;
+    queueGuard.unlock();
+
+    {
+      lock_guard<mutex> guard(lock);
+      store(reading);
+    }
+
+    queueGuard.lock();
+    writerBusy = false;
+
+    if (queueLength == 0)
+      queueDrained.notify_all();
+  }
+
+  queueDrained.notify_all();
+}
+
+ArArchive::Reader::Reader(const string &path) {
+  uint8_t header[FILE_HEADER_SIZE];
+
+  file = fopen(path.c_str(), "rb");
+
+  if (!file)
+    throw "Unable to open archive file";
+
+  setvbuf(file, nullptr, _IOFBF, MAX_BLOCK_SIZE);
+
+  if (fread(header, 1, FILE_HEADER_SIZE, file) != FILE_HEADER_SIZE || get32(header) != MAGIC) {
+    fclose(file);
+    throw "Not an archive file";
+  }
+
+  if (get32(header + 4) != VERSION) {
+    fclose(file);
+    throw "Unsupported archive version";
+  }
+
+  payload.reserve(MAX_BLOCK_SIZE);
+}
+
+ArArchive::Reader::~Reader() {
+  fclose(file);
+}
+
+// Positions the file at the first BLOCK_MAGIC at or after offset from, if there is one.
+bool ArArchive::Reader::findBlock(long from) {
+  uint8_t buffer[4096];
+  uint8_t magic[4];
+
+  put32(magic, BLOCK_MAGIC);
+
+  while (fseek(file, from, SEEK_SET) == 0) {
+    size_t length = fread(buffer, 1, sizeof(buffer), file);
+
+    if (length < sizeof(magic))
+      return false;
+
+    for (size_t i = 0; i + sizeof(magic) <= length; ++i) {
+      if (memcmp(buffer + i, magic, sizeof(magic)) == 0)
+        return fseek(file, from + (long) i, SEEK_SET) == 0;
+    }
+
+    from += (long) (length - sizeof(magic) + 1);
+  }
+
+  return false;
+}
+
+// A damaged block is skipped by scanning forward for the next block which passes its CRC check.
+bool ArArchive::Reader::nextBlock() {
+  while (true) {
+    long start = ftell(file);
+    uint8_t header[BLOCK_HEADER_SIZE];
+    size_t headerRead = fread(header, 1, BLOCK_HEADER_SIZE, file);
+
+    if (headerRead == 0 && feof(file))
+      return false;
+
+    uint32_t size = get32(header + 4);
+
+    if (headerRead == BLOCK_HEADER_SIZE && get32(header) == BLOCK_MAGIC && size <= MAX_BLOCK_SIZE) {
+      payload.resize(size);
+
+      if (fread(payload.data(), 1, size, file) == size &&
+          crc32(payload.data(), size, crc32(header, 12)) == get32(header + 12)) {
+        blockReadings = get32(header + 8);
+        goodLength = start + BLOCK_HEADER_SIZE + size;
+        position = 0;
+
+        for (auto &slot : slots)
+          slot.active = false;
+
+        return true;
+      }
+    }
+
+    damaged = true;
+
+    if (start < 0 || !findBlock(start + 1))
+      return false;
+  }
+}
+
+bool ArArchive::Reader::decode(ArPackedReading &reading) {
+  const uint8_t *p = payload.data() + position;
+  const uint8_t *end = payload.data() + payload.size();
+  bool overrun = false;
+  auto varint = [&p, end, &overrun]() {
+    uint64_t value = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (p == end) {
+        overrun = true;
+        break;
+      }
+
+      uint8_t byte = *p++;
+
+      value |= (uint64_t) (byte & 0x7F) << shift;
+
+      if (!(byte & 0x80))
+        break;
+    }
+
+    return value;
+  };
+
+  if (p == end)
+    return false;
+
+  uint8_t tag = *p++;
+  SensorSlot &slot = slots[tag & SLOT_BITS];
+
+  if (tag & NEW_SENSOR) {
+    uint64_t key = varint();
+
+    slot.key = (key & ArPackedReading::CHANNEL_MASK) | (key >> 3) << ArPackedReading::SENSOR_ID_SHIFT;
+    slot.time = unzigzag(varint());
+    slot.humidity = (int) varint();
+    slot.rawTemp = (int) varint();
+    slot.other = varint();
+    slot.repeats = (int) varint();
+    slot.interval = 0;
+    slot.active = true;
+  }
+  else if (slot.active) {
+    slot.interval += unzigzag(varint());
+    slot.time += slot.interval;
+
+    if (tag & SMALL_DELTAS) {
+      if (p == end)
+        return false;
+
+      slot.rawTemp += (int8_t) (*p & 0xF0) >> 4;
+      slot.humidity += (int8_t) (*p++ << 4) >> 4;
+    }
+    else {
+      slot.rawTemp += (int) unzigzag(varint());
+      slot.humidity += (int) unzigzag(varint());
+    }
+
+    if (tag & OTHER_CHANGED)
+      slot.other = varint();
+
+    if (tag & REPEATS_CHANGED)
+      slot.repeats = (int) varint();
+  }
+  else
+    return false;
+
+  if (overrun)
+    return false;
+
+  reading.time = ((uint64_t) slot.time & ((1ULL << 56) - 1)) | (uint64_t) slot.repeats << 56;
+  reading.fields = slot.key | slot.other | (uint64_t) slot.humidity << ArPackedReading::HUMIDITY_SHIFT |
+    (uint64_t) slot.rawTemp << ArPackedReading::RAW_TEMP_SHIFT;
+  position = p - payload.data();
+
+  return true;
+}
+
+bool ArArchive::Reader::next(ArPackedReading &reading) {
+  while (true) {
+    while (blockReadings == 0) {
+      if (!nextBlock())
+        return false;
+    }
+
+    if (decode(reading)) {
+      --blockReadings;
+      return true;
+    }
+
+    // A block which passed its CRC check but doesn't decode was written by something else.
+    damaged = true;
+    blockReadings = 0;
+  }
+}
+
+bool ArArchive::Reader::next(ARTHSM::SensorData &sd) {
+  ArPackedReading reading;
+
+  if (!next(reading))
+    return false;
+
+  sd = ArPackedReading::decode(reading);
+
+  return true;
+}
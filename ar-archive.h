@@ -0,0 +1,164 @@
+#ifndef AR_ARCHIVE
+#define AR_ARCHIVE
+
+#include <cstdint>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ar-packed-reading.h"
+
+namespace std {
+
+// A compact append-only archive of readings, for keeping years of data on flash storage.
+//
+// The file starts with a 16-byte header (MAGIC, VERSION, reserved), followed by blocks. Each block has a
+// 16-byte header (BLOCK_MAGIC, payload size, reading count, CRC-32 of the first 12 header bytes and the
+// payload), all little-endian, followed by its payload of encoded readings.
+//
+// Readings are encoded from their ArPackedReading form, against the previous reading of the same sensor
+// (channel and miscData1) in the same block. Each reading starts with a tag byte: bits 0-2 are the sensor's
+// slot, one of SENSOR_SLOTS per block, and the other bits are TagFlags. A reading for a NEW_SENSOR is
+// followed by unsigned LEB128 varints of channel code | miscData1 << 3, zigzag time, humidity, rawTemp,
+// other fields, and repeats. Otherwise the tag is followed by a zigzag varint of the change in the
+// interval between the sensor's readings, then either one byte of SMALL_DELTAS (4-bit signed temperature
+// change, then 4-bit signed humidity change), or zigzag varints of each, then the other fields if
+// OTHER_CHANGED, and repeats if REPEATS_CHANGED. Other fields are the packed fields without the channel,
+// miscData1, humidity, and rawTemp.
+//
+// Every block can be decoded on its own, so a block torn by a crash or power loss only loses itself: readers
+// skip a damaged block by scanning forward for the next BLOCK_MAGIC which starts a block passing its CRC check.
+class ArArchive {
+  public:
+    static const uint32_t MAGIC = 0x52415241;       // "ARAR"
+    static const uint32_t BLOCK_MAGIC = 0x42415241; // "ARAB"
+    static const uint32_t VERSION = 1;
+    static const int FILE_HEADER_SIZE = 16;
+    static const int BLOCK_HEADER_SIZE = 16;
+    static const int DEFAULT_BLOCK_SIZE = 4096;
+    static const int MAX_BLOCK_SIZE = 65536;
+    static const int MAX_ENCODED_SIZE = 32; // Bytes, for one reading
+    static const int SENSOR_SLOTS = 8;
+    static const int QUEUE_SIZE = 256; // Readings waiting for the writer thread
+    static const int64_t DEFAULT_COMMIT_INTERVAL = 600000000; // 10 minutes
+    static const int64_t DEFAULT_SYNC_INTERVAL = 3600000000;  // 1 hour
+
+    enum TagFlags { NEW_SENSOR = 0x08, SMALL_DELTAS = 0x10, OTHER_CHANGED = 0x20, REPEATS_CHANGED = 0x40 };
+
+    class Stats {
+      public:
+        uint64_t readings = 0;
+        uint64_t blocks = 0;
+        uint64_t bytes = 0;        // Bytes written, including headers
+        uint64_t pagesWritten = 0; // 4K pages touched by each block write, an estimate of the flash writes needed
+        uint64_t syncs = 0;
+        uint64_t writeErrors = 0;  // Blocks lost because they couldn't be written
+        uint64_t dropped = 0;      // Readings lost because the writer thread fell behind
+    };
+
+  private:
+    class SensorSlot {
+      public:
+        bool active = false;
+        int humidity = 0;
+        int64_t interval = 0;
+        uint64_t key = 0;
+        uint64_t other = 0;
+        int rawTemp = 0;
+        int repeats = 0;
+        int64_t time = 0;
+    };
+
+  public:
+    // Buffers readings into blocks, which are written out whole when full, or when a reading arrives
+    // commitInterval or more after the first reading in the block. The file is synced to storage when a
+    // block is written syncInterval or more after the last sync. Intervals are in microseconds, measured
+    // by the readings' own collection times. Appending is thread-safe, and never waits on the file: readings
+    // are queued for a writer thread, which does all of the encoding, writing, and syncing.
+    //
+    // An existing archive is appended to, after trimming anything following its last good block, such as a
+    // block torn at the end of the file. Damaged blocks before that are left for readers to skip.
+    class Writer {
+      private:
+        vector<uint8_t> block; // Block header, then payload
+        int blockReadings = 0;
+        int64_t blockStart = 0;
+        int blockSize;
+        int64_t commitInterval;
+        uint64_t droppedCount = 0;
+        int fd = -1;
+        uint64_t fileSize = 0;
+        int64_t lastSync = 0;
+        mutex lock;
+        int nextSlot = 0;
+        vector<ArPackedReading> queue;
+        condition_variable queueDrained;
+        int queueLength = 0;
+        mutex queueLock; // Guards the queue, and never held while touching the file
+        condition_variable queueReady;
+        int queueStart = 0;
+        SensorSlot slots[SENSOR_SLOTS];
+        Stats stats;
+        int64_t syncInterval;
+        size_t used = BLOCK_HEADER_SIZE;
+        bool writerBusy = false;
+        bool writerExit = false;
+        thread *writerThread = nullptr;
+
+        void commit();
+        void encode(const ArPackedReading &reading);
+        void store(const ArPackedReading &reading);
+        void sync();
+        void waitUntilDrained();
+        void writerLoop();
+
+      public:
+        Writer(const string &path, int blockSize = DEFAULT_BLOCK_SIZE, int64_t commitInterval = DEFAULT_COMMIT_INTERVAL,
+               int64_t syncInterval = DEFAULT_SYNC_INTERVAL);
+        ~Writer();
+
+        Writer(const Writer&) = delete;
+        Writer &operator=(const Writer&) = delete;
+
+        bool append(const ArTemperatureHumiditySignalMonitor::SensorData &sd); // False if dropped, queue full
+        void flush(); // Waits for queued readings, writes out any buffered readings, and syncs the file
+        Stats getStats();
+    };
+
+    // Reads an archive from start to finish, skipping damaged blocks.
+    class Reader {
+      private:
+        int blockReadings = 0;
+        bool damaged = false;
+        FILE *file = nullptr;
+        uint64_t goodLength = FILE_HEADER_SIZE;
+        vector<uint8_t> payload;
+        size_t position = 0;
+        SensorSlot slots[SENSOR_SLOTS];
+
+        bool decode(ArPackedReading &reading);
+        bool findBlock(long from);
+        bool nextBlock();
+
+      public:
+        Reader(const string &path);
+        ~Reader();
+
+        Reader(const Reader&) = delete;
+        Reader &operator=(const Reader&) = delete;
+
+        bool isDamaged() const { return damaged; } // Skipped damaged data
+        bool next(ArPackedReading &reading);
+        bool next(ArTemperatureHumiditySignalMonitor::SensorData &sd);
+        uint64_t validLength() const { return goodLength; } // Bytes up to the end of the last good block read
+    };
+
+    static uint32_t crc32(const uint8_t *data, size_t length, uint32_t crc = 0);
+};
+
+}
+
+#endif
@@ -0,0 +1,185 @@
+/*
+ * ar-history-store.cpp
+ *
+ * Copyright 2020-2025 Kerry Shetline <kerry@shetline.com>
+ *
+ * MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "ar-history-store.h"
+
+#if !defined(WIN32) && !defined(WINDOWS)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#define ARTHSM ArTemperatureHumiditySignalMonitor
+
+static_assert(sizeof(ArHistoryStore::Header) == 64, "History header must stay 64 bytes");
+
+ArHistoryStore::ArHistoryStore(const string &directory, const string &prefix, int capacity) : capacity(capacity) {
+  if (capacity < 1)
+    throw "History capacity must be at least 1";
+
+  try {
+    for (char channel : { 'A', 'B', 'C' })
+      openFile(files[channel - 'A'], directory + "/" + prefix + "-" + channel + ".hist", channel);
+  }
+  catch (char const *err) {
+    closeFiles();
+    throw;
+  }
+}
+
+ArHistoryStore::~ArHistoryStore() {
+  closeFiles();
+}
+
+#if defined(WIN32) || defined(WINDOWS)
+void ArHistoryStore::closeFiles() {
+}
+
+void ArHistoryStore::openFile(ChannelFile &file, const string &path, char channel) {
+  throw "History store is not supported on this platform";
+}
+#else
+void ArHistoryStore::closeFiles() {
+  for (auto &file : files) {
+    if (file.header)
+      munmap(file.header, file.mapSize);
+
+    if (file.fd >= 0)
+      close(file.fd);
+
+    file.header = nullptr;
+    file.fd = -1;
+  }
+}
+
+// An existing file is kept as long as its layout matches, otherwise it's started over.
+void ArHistoryStore::openFile(ChannelFile &file, const string &path, char channel) {
+  struct stat status;
+
+  file.mapSize = sizeof(Header) + (size_t) capacity * sizeof(ArPackedReading);
+  file.fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+
+  if (file.fd < 0 || fstat(file.fd, &status) != 0)
+    throw "Unable to open history file";
+
+  bool fresh = ((size_t) status.st_size != file.mapSize);
+
+  if (fresh && ftruncate(file.fd, file.mapSize) != 0)
+    throw "Unable to size history file";
+
+  void *map = mmap(nullptr, file.mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, file.fd, 0);
+
+  if (map == MAP_FAILED)
+    throw "Unable to map history file";
+
+  file.header = (Header *) map;
+  file.records = (ArPackedReading *) ((char *) map + sizeof(Header));
+
+  Header *header = file.header;
+
+  if (fresh || header->magic != MAGIC || header->version != VERSION || header->recordSize != sizeof(ArPackedReading) ||
+      header->capacity != (uint32_t) capacity || header->channel != channel) {
+    header->magic = 0;
+    header->version = VERSION;
+    header->recordSize = sizeof(ArPackedReading);
+    header->capacity = capacity;
+    header->count.store(0, memory_order_relaxed);
+    header->channel = channel;
+    header->magic = MAGIC;
+  }
+}
+#endif
+
+ArHistoryStore::ChannelFile *ArHistoryStore::getFile(char channel) const {
+  int index = channel - 'A';
+
+  if (index < 0 || index > 2 || files[index].header == nullptr)
+    return nullptr;
+
+  return const_cast<ChannelFile *>(&files[index]);
+}
+
+void ArHistoryStore::append(const ARTHSM::SensorData &sd) {
+  ChannelFile *file = getFile(sd.channel);
+
+  if (!file)
+    return;
+
+  uint64_t count = file->header->count.load(memory_order_relaxed);
+
+  // Pairs with the fence in overwritten(): a reader which sees any of this record also sees the count before it.
+  atomic_thread_fence(memory_order_release);
+  file->records[count % capacity] = ArPackedReading::encode(sd);
+  file->header->count.store(count + 1, memory_order_release);
+}
+
+// Readings are appended in time order, so records can be found by binary search.
+uint64_t ArHistoryStore::lowerBound(const ChannelFile &file, uint64_t low, uint64_t high, int64_t time) const {
+  while (low < high) {
+    uint64_t middle = low + (high - low) / 2;
+
+    if (file.records[middle % capacity].collectionTime() < time)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return low;
+}
+
+ArHistoryStore::Range ArHistoryStore::query(char channel, int64_t from, int64_t to) const {
+  ChannelFile *file = getFile(channel);
+  Range range;
+
+  if (!file)
+    return range;
+
+  uint64_t count = file->header->count.load(memory_order_acquire);
+  // Once the ring is full, its oldest record is the next to be overwritten, so it's left out.
+  uint64_t oldest = (count >= (uint64_t) capacity ? count - capacity + 1 : 0);
+  uint64_t start = lowerBound(*file, oldest, count, from);
+  uint64_t end = max(lowerBound(*file, start, count, to), start);
+  size_t startIndex = start % capacity;
+  size_t length = end - start;
+
+  range.start = start;
+  range.first = &file->records[startIndex];
+  range.firstCount = min(length, capacity - startIndex);
+  range.second = file->records;
+  range.secondCount = length - range.firstCount;
+
+  return range;
+}
+
+bool ArHistoryStore::overwritten(char channel, const Range &range) const {
+  ChannelFile *file = getFile(channel);
+
+  // Keeps the caller's copying of the records from moving after the count is checked. Once the count reaches
+  // start + capacity, the record at start may already be half overwritten by the next append.
+  atomic_thread_fence(memory_order_acquire);
+
+  return file && file->header->count.load(memory_order_relaxed) >= range.start + capacity;
+}
@@ -0,0 +1,84 @@
+#ifndef AR_HISTORY_STORE
+#define AR_HISTORY_STORE
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "ar-packed-reading.h"
+
+namespace std {
+
+// A bounded on-disk history of readings, one memory-mapped ring file per channel, named
+// <directory>/<prefix>-A.hist and so on. Each file is a 64-byte Header followed by capacity records in
+// the 16-byte ArPackedReading format. Once a file is full, each new reading overwrites the oldest. Files
+// are reopened, history intact, as long as the capacity doesn't change.
+//
+// Only one thread at a time may append. Queries can run concurrently with appending, and are served
+// straight from the mapping, so the records of a Range can be overwritten by later appends if the ring
+// wraps around while they are being read; overwritten() tells whether that happened. A full ring's oldest
+// record, the next to be overwritten, is left out of queries.
+class ArHistoryStore {
+  public:
+    static const uint32_t MAGIC = 0x53485241; // "ARHS"
+    static const uint32_t VERSION = 2;
+    static const int DEFAULT_CAPACITY = 8192; // A little over a day and a half of one reading every 16 seconds
+
+    class Header {
+      public:
+        uint32_t magic;
+        uint32_t version;
+        uint32_t recordSize;
+        uint32_t capacity;
+        atomic<uint64_t> count; // Records ever appended. Record n is at index n % capacity.
+        char channel;
+        char reserved[39];
+    };
+
+    // Up to two spans of records, in time order, because a range can wrap around the end of the ring.
+    class Range {
+      public:
+        const ArPackedReading *first = nullptr;
+        size_t firstCount = 0;
+        const ArPackedReading *second = nullptr;
+        size_t secondCount = 0;
+        uint64_t start = 0; // Sequence number of the first record
+
+        const ArPackedReading &operator[](size_t i) const { return i < firstCount ? first[i] : second[i - firstCount]; }
+        size_t size() const { return firstCount + secondCount; }
+    };
+
+  private:
+    class ChannelFile {
+      public:
+        int fd = -1;
+        Header *header = nullptr;
+        size_t mapSize = 0;
+        ArPackedReading *records = nullptr;
+    };
+
+    int capacity;
+    ChannelFile files[3]; // A-C
+
+    void closeFiles();
+    ChannelFile *getFile(char channel) const;
+    uint64_t lowerBound(const ChannelFile &file, uint64_t low, uint64_t high, int64_t time) const;
+    void openFile(ChannelFile &file, const string &path, char channel);
+
+  public:
+    ArHistoryStore(const string &directory, const string &prefix = "history", int capacity = DEFAULT_CAPACITY);
+    ~ArHistoryStore();
+
+    ArHistoryStore(const ArHistoryStore&) = delete;
+    ArHistoryStore &operator=(const ArHistoryStore&) = delete;
+
+    void append(const ArTemperatureHumiditySignalMonitor::SensorData &sd);
+    int getCapacity() const { return capacity; }
+    bool overwritten(char channel, const Range &range) const;
+    Range query(char channel, int64_t from, int64_t to) const; // Wall clock microseconds, from <= time < to
+};
+
+}
+
+#endif
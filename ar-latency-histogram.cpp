@@ -0,0 +1,122 @@
+/*
+ * ar-latency-histogram.cpp
+ *
+ * Copyright 2020-2025 Kerry Shetline <kerry@shetline.com>
+ *
+ * MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "ar-latency-histogram.h"
+
+#include <cmath>
+
+using namespace std;
+
+int ArLatencyHistogram::bucketIndex(uint64_t value) {
+  if (value < (uint64_t) LINEAR_LIMIT)
+    return (int) value;
+
+  int exponent = SUB_BUCKET_BITS + 1;
+
+  while (exponent < 63 && (value >> (exponent + 1)) != 0)
+    ++exponent;
+
+  if (exponent > MAX_EXPONENT)
+    return BUCKET_COUNT - 1;
+
+  return LINEAR_LIMIT + (exponent - SUB_BUCKET_BITS - 1) * SUB_BUCKETS +
+    (int) ((value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+}
+
+uint64_t ArLatencyHistogram::bucketLowerBound(int index) {
+  if (index < LINEAR_LIMIT)
+    return index;
+
+  int exponent = (index - LINEAR_LIMIT) / SUB_BUCKETS + SUB_BUCKET_BITS + 1;
+  int subBucket = (index - LINEAR_LIMIT) % SUB_BUCKETS;
+
+  return (uint64_t) (SUB_BUCKETS + subBucket) << (exponent - SUB_BUCKET_BITS);
+}
+
+uint64_t ArLatencyHistogram::bucketUpperBound(int index) {
+  if (index < LINEAR_LIMIT)
+    return index;
+  else if (index == BUCKET_COUNT - 1)
+    return UINT64_MAX;
+
+  return bucketLowerBound(index + 1) - 1;
+}
+
+void ArLatencyHistogram::record(int64_t micros) {
+  uint64_t value = (uint64_t) (micros < 0 ? 0 : micros);
+  uint64_t previousMax = max.load(memory_order_relaxed);
+
+  counts[bucketIndex(value)].fetch_add(1, memory_order_relaxed);
+  sum.fetch_add(value, memory_order_relaxed);
+
+  while (value > previousMax && !max.compare_exchange_weak(previousMax, value, memory_order_relaxed)) {}
+}
+
+void ArLatencyHistogram::reset() {
+  for (auto &count : counts)
+    count.store(0, memory_order_relaxed);
+
+  max.store(0, memory_order_relaxed);
+  sum.store(0, memory_order_relaxed);
+}
+
+// Buckets are copied one at a time while recording goes on, so a snapshot is only approximately
+// consistent, which is fine for percentiles.
+ArLatencyHistogram::Snapshot ArLatencyHistogram::snapshot() const {
+  Snapshot snapshot;
+
+  for (int i = 0; i < BUCKET_COUNT; ++i) {
+    snapshot.counts[i] = counts[i].load(memory_order_relaxed);
+    snapshot.count += snapshot.counts[i];
+  }
+
+  snapshot.max = max.load(memory_order_relaxed);
+  snapshot.sum = sum.load(memory_order_relaxed);
+
+  return snapshot;
+}
+
+double ArLatencyHistogram::Snapshot::mean() const {
+  return count == 0 ? 0 : (double) sum / count;
+}
+
+// Reports the upper bound of the bucket holding the requested rank, but never more than the maximum.
+uint64_t ArLatencyHistogram::Snapshot::percentile(double p) const {
+  if (count == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t) ceil(fmin(fmax(p, 0.0), 100.0) / 100.0 * count);
+  uint64_t seen = 0;
+
+  if (rank == 0)
+    rank = 1;
+
+  for (int i = 0; i < BUCKET_COUNT; ++i) {
+    seen += counts[i];
+
+    if (seen >= rank)
+      return bucketUpperBound(i) < max ? bucketUpperBound(i) : max;
+  }
+
+  return max;
+}
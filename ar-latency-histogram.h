@@ -0,0 +1,49 @@
+#ifndef AR_LATENCY_HISTOGRAM
+#define AR_LATENCY_HISTOGRAM
+
+#include <atomic>
+#include <cstdint>
+
+namespace std {
+
+// A log-linear histogram of latencies in microseconds, cheap enough to record into on every reading
+// from any thread. Values below 16 get a bucket each; above that, every power of two is split into 8
+// linear sub-buckets, so a percentile is never off by more than 12.5%. Values beyond about 36 hours
+// are counted in the last bucket.
+class ArLatencyHistogram {
+  public:
+    static const int SUB_BUCKET_BITS = 3;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int LINEAR_LIMIT = SUB_BUCKETS * 2;
+    static const int MAX_EXPONENT = 36;
+    static const int BUCKET_COUNT = LINEAR_LIMIT + (MAX_EXPONENT - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+    class Snapshot {
+      public:
+        uint64_t counts[BUCKET_COUNT] = {};
+        uint64_t count = 0;
+        uint64_t max = 0;
+        uint64_t sum = 0;
+
+        double mean() const;
+        uint64_t percentile(double p) const; // p from 0 to 100
+    };
+
+  private:
+    atomic<uint64_t> counts[BUCKET_COUNT] = {};
+    atomic<uint64_t> max { 0 };
+    atomic<uint64_t> sum { 0 };
+
+  public:
+    static int bucketIndex(uint64_t value);
+    static uint64_t bucketLowerBound(int index);
+    static uint64_t bucketUpperBound(int index);
+
+    void record(int64_t micros);
+    void reset();
+    Snapshot snapshot() const;
+};
+
+}
+
+#endif
@@ -0,0 +1,396 @@
+/*
+ * ar-log.cpp
+ *
+ * Copyright 2020-2025 Kerry Shetline <kerry@shetline.com>
+ *
+ * MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "ar-log.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#if !defined(WIN32) && !defined(WINDOWS)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#define ARTHSM ArTemperatureHumiditySignalMonitor
+
+static const int64_t RATE_WINDOW = 1000000; // One second, in microseconds
+static const int LINE_SIZE = 256;
+
+static int64_t wallClockMicros() {
+  return chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Same format as getTimestamp(), but safe to call from any thread.
+static void formatTimestamp(int64_t time, char *buf, size_t size) {
+  time_t seconds = (time_t) (time / 1000000);
+  struct tm local;
+
+#if defined(WIN32) || defined(WINDOWS)
+  localtime_s(&local, &seconds);
+#else
+  localtime_r(&seconds, &local);
+#endif
+
+  size_t length = strftime(buf, size, "%R:%S.", &local);
+  snprintf(buf + length, size - length, "%03d", (int) (time / 1000 % 1000));
+}
+
+void ArLog::StreamSink::write(const char *line) {
+  fputs(line, stream);
+  fputc('\n', stream);
+}
+
+void ArLog::StreamSink::flush() {
+  fflush(stream);
+}
+
+ArLog::FileSink::FileSink(const string &path) {
+  file = fopen(path.c_str(), "a");
+
+  if (file == nullptr)
+    throw "Unable to open log file";
+}
+
+ArLog::FileSink::~FileSink() {
+  fclose(file);
+}
+
+void ArLog::FileSink::write(const char *line) {
+  fputs(line, file);
+  fputc('\n', file);
+}
+
+void ArLog::FileSink::flush() {
+  fflush(file);
+}
+
+#if !defined(WIN32) && !defined(WINDOWS)
+ArLog::SyslogSink::SyslogSink(const string &ident, const string &socketPath) : ident(ident), socketPath(socketPath) {
+  if (socketPath.size() >= sizeof(sockaddr_un::sun_path))
+    throw "Syslog socket path is too long";
+
+  connectSocket();
+}
+
+ArLog::SyslogSink::~SyslogSink() {
+  if (socketFd >= 0)
+    close(socketFd);
+}
+
+bool ArLog::SyslogSink::connectSocket() {
+  sockaddr_un address;
+
+  if (socketFd >= 0)
+    close(socketFd);
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+  socketFd = socket(AF_UNIX, SOCK_DGRAM, 0);
+
+  if (socketFd >= 0 && connect(socketFd, (sockaddr *) &address, sizeof(address)) != 0) {
+    close(socketFd);
+    socketFd = -1;
+  }
+
+  return socketFd >= 0;
+}
+
+// Lines are dropped, rather than stalling the log, if the syslog daemon falls behind. It may also have
+// been restarted since the last message, so one reconnect is tried on any other failure.
+void ArLog::SyslogSink::write(const char *line) {
+  char message[LINE_SIZE + 64];
+  int length = snprintf(message, sizeof(message), "<15>%s: %s", ident.c_str(), line); // user.debug
+
+  length = min(length, (int) sizeof(message) - 1);
+
+  if (socketFd >= 0 && send(socketFd, message, length, MSG_DONTWAIT) >= 0)
+    return;
+  else if (socketFd >= 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  else if (connectSocket())
+    send(socketFd, message, length, MSG_DONTWAIT);
+}
+#endif
+
+ArLog::ArLog() {
+  for (int i = 0; i < QUEUE_SIZE; ++i)
+    cells[i].sequence.store(i, memory_order_relaxed);
+
+  writerThread = new thread([this]() { writerLoop(); });
+}
+
+ArLog::~ArLog() {
+  writerLock.lock();
+  writerExit = true;
+  writerLock.unlock();
+  wakeUp.notify_one();
+  writerThread->join();
+  delete writerThread;
+}
+
+shared_ptr<ArLog> ArLog::defaultLog() {
+  static shared_ptr<ArLog> log = []() {
+    auto log = make_shared<ArLog>();
+
+    log->addSink(make_shared<StreamSink>(stdout));
+
+    return log;
+  }();
+
+  return log;
+}
+
+void ArLog::addSink(const shared_ptr<Sink> &sink) {
+  lock_guard<mutex> lock(sinkLock);
+
+  sinks.push_back(sink);
+}
+
+void ArLog::clearSinks() {
+  lock_guard<mutex> lock(sinkLock);
+
+  sinks.clear();
+}
+
+void ArLog::flush() {
+  uint64_t target = enqueuePosition.load(memory_order_acquire);
+  unique_lock<mutex> lock(writerLock);
+
+  wakeUp.notify_one();
+  written.wait(lock, [this, target]() { return writerExit || dequeuePosition.load(memory_order_acquire) >= target; });
+}
+
+uint64_t ArLog::getDroppedCount() {
+  return droppedCount.load(memory_order_relaxed);
+}
+
+uint64_t ArLog::getRateLimitedCount() {
+  return rateLimitedCount.load(memory_order_relaxed);
+}
+
+void ArLog::setRateLimit(int messagesPerSecond) {
+  rateLimit.store(max(messagesPerSecond, 0), memory_order_relaxed);
+}
+
+bool ArLog::logCorruptFrame(const ARTHSM::Frame &frame, int64_t duration, int candidates, bool cleanedUp) {
+  return enqueue(CORRUPT_FRAME, nullptr, &frame, duration, candidates, cleanedUp, nullptr);
+}
+
+bool ArLog::logReading(const ARTHSM::SensorData &sd, const ARTHSM::Frame &frame, int64_t duration, int candidates,
+                       bool cleanedUp) {
+  return enqueue(READING, &sd, &frame, duration, candidates, cleanedUp, nullptr);
+}
+
+bool ArLog::logText(const char *text) {
+  return enqueue(TEXT, nullptr, nullptr, -1, 0, false, text);
+}
+
+// A bounded multi-producer queue, with a sequence number in each cell saying whose turn it is to use it.
+bool ArLog::enqueue(EntryKind kind, const ARTHSM::SensorData *sd, const ARTHSM::Frame *frame, int64_t duration,
+                    int candidates, bool cleanedUp, const char *text) {
+  int64_t now = wallClockMicros();
+  int limit = rateLimit.load(memory_order_relaxed);
+
+  if (limit > 0) {
+    int64_t start = windowStart.load(memory_order_relaxed);
+
+    if ((now < start || now >= start + RATE_WINDOW) &&
+        windowStart.compare_exchange_strong(start, now, memory_order_relaxed))
+      windowCount.store(0, memory_order_relaxed);
+
+    if (windowCount.fetch_add(1, memory_order_relaxed) >= limit) {
+      rateLimitedCount.fetch_add(1, memory_order_relaxed);
+      return false;
+    }
+  }
+
+  uint64_t position = enqueuePosition.load(memory_order_relaxed);
+  Cell *cell;
+
+  while (true) {
+    cell = &cells[position % QUEUE_SIZE];
+
+    int64_t difference = (int64_t) (cell->sequence.load(memory_order_acquire) - position);
+
+    if (difference == 0) {
+      if (enqueuePosition.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+        break;
+    }
+    else if (difference < 0) {
+      droppedCount.fetch_add(1, memory_order_relaxed);
+      return false;
+    }
+    else
+      position = enqueuePosition.load(memory_order_relaxed);
+  }
+
+  Entry &entry = cell->entry;
+
+  entry.kind = kind;
+  entry.time = now;
+
+  if (sd)
+    entry.sd = *sd;
+
+  if (frame)
+    entry.frame = *frame;
+
+  entry.duration = duration;
+  entry.candidates = candidates;
+  entry.cleanedUp = cleanedUp;
+
+  if (text) {
+    strncpy(entry.text, text, TEXT_SIZE - 1);
+    entry.text[TEXT_SIZE - 1] = 0;
+  }
+
+  cell->sequence.store(position + 1, memory_order_release);
+
+  // The writer polls as well, so a wake-up missed while it's busy only delays output a little.
+  if (position == dequeuePosition.load(memory_order_relaxed))
+    wakeUp.notify_one();
+
+  return true;
+}
+
+void ArLog::writeLine(const char *line) {
+  for (auto &sink : sinks)
+    sink->write(line);
+}
+
+// Formats without allocating, matching the original debug output.
+void ArLog::writeEntry(const Entry &entry) {
+  char line[LINE_SIZE];
+  char timestamp[32];
+  int length = 0;
+
+  formatTimestamp(entry.time, timestamp, sizeof(timestamp));
+
+  if (entry.kind == TEXT) {
+    snprintf(line, sizeof(line), "%s: %s", timestamp, entry.text);
+    writeLine(line);
+    return;
+  }
+
+  for (int i = 0; i < ARTHSM::Frame::BIT_COUNT; ++i) {
+    if (i > 0 && i % 8 == 0)
+      line[length++] = ' ';
+
+    int bit = entry.frame.getBit(i);
+
+    line[length++] = (bit == 0 ? '0' : bit == 1 ? '1' : '~');
+  }
+
+  line[length] = 0;
+
+  if (entry.duration >= 0)
+    length += snprintf(line + length, sizeof(line) - length, u8" (%lldµs)", (long long) entry.duration);
+
+  if (entry.cleanedUp)
+    length += snprintf(line + length, sizeof(line) - length, "*");
+
+  if (entry.candidates > 0)
+    snprintf(line + length, sizeof(line) - length, " (%d candidates)", entry.candidates);
+
+  writeLine(line);
+
+  if (entry.kind == CORRUPT_FRAME) {
+    snprintf(line, sizeof(line), "%s: Corrupted data", timestamp);
+    writeLine(line);
+    return;
+  }
+
+  const ARTHSM::SensorData &sd = entry.sd;
+
+  snprintf(line, sizeof(line), "%s%c ch. %c, %d%%, %.1fC (%d raw), %.1fF, battery %s, %d/%d",
+    timestamp, sd.validChecksum ? ':' : '~', sd.channel,
+    sd.humidity, sd.tempCelsius, sd.rawTemp, sd.tempFahrenheit,
+    sd.batteryLow ? "LOW" : "good",
+    sd.repeatsCaptured,
+    sd.signalQuality);
+  writeLine(line);
+}
+
+void ArLog::writerLoop() {
+  uint64_t reportedDropped = 0;
+  uint64_t reportedRateLimited = 0;
+  unique_lock<mutex> lock(writerLock);
+
+  while (true) {
+    lock.unlock();
+    sinkLock.lock();
+
+    uint64_t position = dequeuePosition.load(memory_order_relaxed);
+    bool wroteAny = false;
+
+    while (true) {
+      Cell &cell = cells[position % QUEUE_SIZE];
+
+      if (cell.sequence.load(memory_order_acquire) != position + 1)
+        break;
+
+      writeEntry(cell.entry);
+      cell.sequence.store(position + QUEUE_SIZE, memory_order_release);
+      dequeuePosition.store(++position, memory_order_release);
+      wroteAny = true;
+    }
+
+    uint64_t dropped = droppedCount.load(memory_order_relaxed);
+    uint64_t rateLimited = rateLimitedCount.load(memory_order_relaxed);
+    char line[LINE_SIZE];
+
+    if (dropped != reportedDropped) {
+      snprintf(line, sizeof(line), "(%llu log messages dropped, queue full)", (unsigned long long) (dropped - reportedDropped));
+      writeLine(line);
+      reportedDropped = dropped;
+      wroteAny = true;
+    }
+
+    if (rateLimited != reportedRateLimited) {
+      snprintf(line, sizeof(line), "(%llu log messages dropped by rate limit)",
+        (unsigned long long) (rateLimited - reportedRateLimited));
+      writeLine(line);
+      reportedRateLimited = rateLimited;
+      wroteAny = true;
+    }
+
+    if (wroteAny) {
+      for (auto &sink : sinks)
+        sink->flush();
+    }
+
+    sinkLock.unlock();
+    lock.lock();
+    written.notify_all();
+
+    if (writerExit)
+      break;
+
+    wakeUp.wait_for(lock, chrono::milliseconds(100));
+  }
+}
@@ -0,0 +1,142 @@
+#ifndef AR_LOG
+#define AR_LOG
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ar-signal-monitor.h"
+
+namespace std {
+
+// Debug output which stays out of the way of signal processing. Logging a message only copies raw
+// fields into a fixed-size lock-free queue; a background thread formats them and writes to the sinks.
+// Messages are dropped, and counted, rather than ever blocking the caller, either when the queue is
+// full or when they exceed the rate limit.
+class ArLog {
+  public:
+    static const int QUEUE_SIZE = 256; // Must be a power of 2
+    static const int TEXT_SIZE = 120;
+
+    class Sink {
+      public:
+        virtual ~Sink() {}
+        virtual void write(const char *line) = 0; // One line, without a line ending
+        virtual void flush() {}
+    };
+
+    // stdout or stderr
+    class StreamSink : public Sink {
+      private:
+        FILE *stream;
+
+      public:
+        StreamSink(FILE *stream) : stream(stream) {}
+        void write(const char *line) override;
+        void flush() override;
+    };
+
+    class FileSink : public Sink {
+      private:
+        FILE *file;
+
+      public:
+        FileSink(const string &path); // Appends to the file
+        ~FileSink();
+        void write(const char *line) override;
+        void flush() override;
+    };
+
+#if !defined(WIN32) && !defined(WINDOWS)
+    // Sends each line as a user.debug message to a syslog daemon's local datagram socket.
+    class SyslogSink : public Sink {
+      private:
+        string ident;
+        int socketFd = -1;
+        string socketPath;
+
+        bool connectSocket();
+
+      public:
+        SyslogSink(const string &ident, const string &socketPath = "/dev/log");
+        ~SyslogSink();
+        void write(const char *line) override;
+    };
+#endif
+
+  private:
+    enum EntryKind { CORRUPT_FRAME, READING, TEXT };
+
+    class Entry {
+      public:
+        EntryKind kind;
+        int64_t time; // Wall clock microseconds
+        ArTemperatureHumiditySignalMonitor::SensorData sd;
+        ArTemperatureHumiditySignalMonitor::Frame frame;
+        int64_t duration;
+        int candidates;
+        bool cleanedUp;
+        char text[TEXT_SIZE];
+    };
+
+    class Cell {
+      public:
+        atomic<uint64_t> sequence;
+        Entry entry;
+    };
+
+    Cell cells[QUEUE_SIZE];
+    atomic<uint64_t> dequeuePosition { 0 };
+    atomic<uint64_t> droppedCount { 0 };
+    atomic<uint64_t> enqueuePosition { 0 };
+    atomic<int> rateLimit { 0 };
+    atomic<uint64_t> rateLimitedCount { 0 };
+    atomic<int> windowCount { 0 };
+    atomic<int64_t> windowStart { 0 };
+
+    mutex sinkLock; // Only taken by the writer thread and for configuration, never when logging
+    vector<shared_ptr<Sink>> sinks;
+    condition_variable wakeUp;
+    condition_variable written;
+    bool writerExit = false;
+    mutex writerLock;
+    thread *writerThread;
+
+    bool enqueue(EntryKind kind, const ArTemperatureHumiditySignalMonitor::SensorData *sd,
+      const ArTemperatureHumiditySignalMonitor::Frame *frame, int64_t duration, int candidates, bool cleanedUp,
+      const char *text);
+    void writeEntry(const Entry &entry);
+    void writeLine(const char *line);
+    void writerLoop();
+
+  public:
+    ArLog();
+    ~ArLog();
+
+    ArLog(const ArLog&) = delete;
+    ArLog &operator=(const ArLog&) = delete;
+
+    void addSink(const shared_ptr<Sink> &sink);
+    void clearSinks();
+    void flush(); // Waits until everything logged so far has been written
+    uint64_t getDroppedCount();
+    uint64_t getRateLimitedCount();
+    bool logCorruptFrame(const ArTemperatureHumiditySignalMonitor::Frame &frame, int64_t duration, int candidates,
+      bool cleanedUp);
+    bool logReading(const ArTemperatureHumiditySignalMonitor::SensorData &sd,
+      const ArTemperatureHumiditySignalMonitor::Frame &frame, int64_t duration, int candidates, bool cleanedUp);
+    bool logText(const char *text);
+    void setRateLimit(int messagesPerSecond); // 0 for no limit
+
+    // Shared by all monitors which haven't been given a log of their own, writing to stdout.
+    static shared_ptr<ArLog> defaultLog();
+};
+
+}
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ * ar-packed-reading.cpp
+ *
+ * Copyright 2020-2025 Kerry Shetline <kerry@shetline.com>
+ *
+ * MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "ar-packed-reading.h"
+
+#include <cmath>
+
+using namespace std;
+
+#define ARTHSM ArTemperatureHumiditySignalMonitor
+
+static_assert(sizeof(ArPackedReading) == 16, "Packed readings must stay 16 bytes");
+
+static const uint64_t TIME_MASK = (1ULL << 56) - 1;
+static const int HUMIDITY_UNKNOWN = 127;
+static const int RAW_TEMP_UNKNOWN = 8191;
+
+static inline uint64_t field(int value, int shift, int bits) {
+  return ((uint64_t) value & ((1ULL << bits) - 1)) << shift;
+}
+
+static inline int field(uint64_t fields, int shift, int bits) {
+  return (int) ((fields >> shift) & ((1ULL << bits) - 1));
+}
+
+static inline int channelCode(char channel) {
+  return channel >= 'A' && channel <= 'C' ? channel - 'A' + 1 : channel == '-' ? 4 : 0;
+}
+
+ArPackedReading ArPackedReading::encode(const ARTHSM::SensorData &sd) {
+  ArPackedReading packed;
+
+  packed.time = ((uint64_t) sd.collectionTime & TIME_MASK) |
+    ((uint64_t) (sd.repeatsCaptured < 255 ? sd.repeatsCaptured : 255) << 56);
+  packed.fields = field(channelCode(sd.channel), 0, 3) |
+    field(sd.batteryLow, 3, 1) |
+    field(sd.validChecksum, 4, 1) |
+    field(sd.rank, 5, 4) |
+    field(sd.signalQuality, 9, 7) |
+    field(sd.humidity == -999 ? HUMIDITY_UNKNOWN : sd.humidity, HUMIDITY_SHIFT, 7) |
+    field(sd.miscData3, 23, 3) |
+    field(sd.miscData2, 26, 7) |
+    field(sd.miscData1, SENSOR_ID_SHIFT, 14) |
+    field(sd.rawTemp == -999 ? RAW_TEMP_UNKNOWN : sd.rawTemp, RAW_TEMP_SHIFT, 13) |
+    field(sd.restored, 60, 1);
+
+  return packed;
+}
+
+ARTHSM::SensorData ArPackedReading::decode(const ArPackedReading &packed) {
+  ARTHSM::SensorData sd;
+  uint64_t fields = packed.fields;
+  int humidity = field(fields, HUMIDITY_SHIFT, 7);
+  int rawTemp = field(fields, RAW_TEMP_SHIFT, 13);
+
+  sd.collectionTime = packed.collectionTime();
+  sd.repeatsCaptured = packed.repeatsCaptured();
+  sd.channel = "?ABC-???"[field(fields, 0, 3)];
+  sd.batteryLow = field(fields, 3, 1);
+  sd.validChecksum = field(fields, 4, 1);
+  sd.rank = field(fields, 5, 4);
+  sd.signalQuality = field(fields, 9, 7);
+  sd.humidity = (humidity == HUMIDITY_UNKNOWN ? -999 : humidity);
+  sd.miscData3 = field(fields, 23, 3);
+  sd.miscData2 = field(fields, 26, 7);
+  sd.miscData1 = field(fields, SENSOR_ID_SHIFT, 14);
+  sd.restored = field(fields, 60, 1);
+
+  // The same conversion as the decoder's.
+  if (rawTemp != RAW_TEMP_UNKNOWN) {
+    sd.rawTemp = rawTemp;
+    sd.tempCelsius = (rawTemp - 1000) / 10.0;
+
+    if (abs(sd.tempCelsius) > 60)
+      sd.tempCelsius = -999;
+    else
+      sd.tempFahrenheit = round((sd.tempCelsius * 1.8 + 32.0) * 10.0) / 10.0;
+  }
+
+  return sd;
+}
+
+void ArPackedReading::encode(const ARTHSM::SensorData *readings, ArPackedReading *packed, size_t count) {
+  for (size_t i = 0; i < count; ++i)
+    packed[i] = encode(readings[i]);
+}
+
+void ArPackedReading::decode(const ArPackedReading *packed, ARTHSM::SensorData *readings, size_t count) {
+  for (size_t i = 0; i < count; ++i)
+    readings[i] = decode(packed[i]);
+}
@@ -0,0 +1,48 @@
+#ifndef AR_PACKED_READING
+#define AR_PACKED_READING
+
+#include <cstddef>
+#include <cstdint>
+
+#include "ar-signal-monitor.h"
+
+namespace std {
+
+// A 16-byte form of SensorData for storage and IPC, two native-endian 64-bit words:
+//
+//   time:   bits 0-55, collectionTime in microseconds (signed); bits 56-63, repeatsCaptured (capped at 255)
+//   fields: bits 0-2, channel (0 = '?', 1-3 = A-C, 4 = '-'); bit 3, batteryLow; bit 4, validChecksum;
+//           bits 5-8, rank; bits 9-15, signalQuality; bits 16-22, humidity (127 = unknown);
+//           bits 23-25, miscData3; bits 26-32, miscData2; bits 33-46, miscData1;
+//           bits 47-59, rawTemp (8191 = unknown); bit 60, restored; bits 61-63, zero
+//
+// Temperatures in degrees are recomputed from rawTemp on decoding, so every reading produced by the
+// decoder survives the round trip unchanged.
+class ArPackedReading {
+  public:
+    static const int HUMIDITY_SHIFT = 16;
+    static const int RAW_TEMP_SHIFT = 47;
+    static const int SENSOR_ID_SHIFT = 33;
+    static const uint64_t CHANNEL_MASK = 0x7;
+    static const uint64_t HUMIDITY_MASK = 0x7FULL << HUMIDITY_SHIFT;
+    static const uint64_t RAW_TEMP_MASK = 0x1FFFULL << RAW_TEMP_SHIFT;
+    static const uint64_t SENSOR_ID_MASK = 0x3FFFULL << SENSOR_ID_SHIFT;
+
+    uint64_t time;
+    uint64_t fields;
+
+    int64_t collectionTime() const { return (int64_t) (time << 8) >> 8; }
+    int repeatsCaptured() const { return (int) (time >> 56); }
+
+    static ArPackedReading encode(const ArTemperatureHumiditySignalMonitor::SensorData &sd);
+    static ArTemperatureHumiditySignalMonitor::SensorData decode(const ArPackedReading &packed);
+
+    // Convenience loops over arrays, one reading at a time. SensorData is too wide and too mixed for these to
+    // vectorize, so they cost the same per reading as the single-reading forms.
+    static void encode(const ArTemperatureHumiditySignalMonitor::SensorData *readings, ArPackedReading *packed, size_t count);
+    static void decode(const ArPackedReading *packed, ArTemperatureHumiditySignalMonitor::SensorData *readings, size_t count);
+};
+
+}
+
+#endif
@@ -0,0 +1,250 @@
+/*
+ * ar-reading-table.cpp
+ *
+ * Copyright 2020-2025 Kerry Shetline <kerry@shetline.com>
+ *
+ * MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "ar-reading-table.h"
+
+#include <cmath>
+
+#if !defined(WIN32) && !defined(WINDOWS)
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#define ARTHSM ArTemperatureHumiditySignalMonitor
+
+static_assert(sizeof(atomic<int32_t>) == sizeof(int32_t), "Table words must be plain 32-bit integers");
+
+const char *ArReadingTable::DEFAULT_NAME = "/ar-signal-monitor-latest";
+
+static int32_t toTenths(double value) {
+  return value == -999 ? -9990 : (int32_t) lround(value * 10.0);
+}
+
+static double fromTenths(int32_t value) {
+  return value == -9990 ? -999 : value / 10.0;
+}
+
+ArReadingTable::ArReadingTable() : ownsMemory(true) {
+  words = new atomic<int32_t>[WORD_COUNT]();
+  words[0] = MAGIC;
+  words[1] = VERSION;
+  words[2] = SLOT_COUNT;
+  words[3] = SLOT_WORDS;
+}
+
+ArReadingTable::ArReadingTable(void *memory) : ownsMemory(false) {
+  words = reinterpret_cast<atomic<int32_t>*>(memory);
+  initialize();
+}
+
+ArReadingTable::ArReadingTable(const string &name, bool publisher) : name(name), ownsMemory(false) {
+  map(name, publisher);
+}
+
+void ArReadingTable::initialize() {
+  words[0].store(0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  for (int i = 1; i < WORD_COUNT; ++i)
+    words[i].store(0, memory_order_relaxed);
+
+  words[1] = VERSION;
+  words[2] = SLOT_COUNT;
+  words[3] = SLOT_WORDS;
+  // Written last, so that a reader which sees the magic number sees a complete header.
+  words[0] = MAGIC;
+}
+
+#if defined(WIN32) || defined(WINDOWS)
+ArReadingTable::~ArReadingTable() {
+  if (ownsMemory)
+    delete [] words;
+}
+
+void ArReadingTable::map(const string &name, bool publisher) {
+  throw "Shared reading tables are not supported on this platform";
+}
+
+bool ArReadingTable::remove(const string &name) {
+  return false;
+}
+#else
+ArReadingTable::~ArReadingTable() {
+  if (ownsMemory)
+    delete [] words;
+  else if (mapSize > 0)
+    munmap(words, mapSize);
+
+  if (lockFd >= 0)
+    close(lockFd);
+}
+
+void ArReadingTable::map(const string &name, bool publisher) {
+  int fd = shm_open(name.c_str(), publisher ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+  struct stat status;
+
+  if (fd < 0)
+    throw (publisher ? "Unable to create shared reading table" : "Shared reading table not found");
+
+  // The publisher holds a lock on the table for as long as it's open, which the system drops if it dies.
+  if (publisher && flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    close(fd);
+    throw "Shared reading table already has a publisher";
+  }
+
+  if (fstat(fd, &status) != 0 || (publisher && (size_t) status.st_size != BYTE_SIZE && ftruncate(fd, BYTE_SIZE) != 0)) {
+    close(fd);
+    throw "Unable to open shared reading table";
+  }
+  else if (!publisher && (size_t) status.st_size < BYTE_SIZE) {
+    close(fd);
+    throw "Shared reading table not ready";
+  }
+
+  void *memory = mmap(nullptr, BYTE_SIZE, publisher ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+
+  if (memory == MAP_FAILED) {
+    close(fd);
+    throw "Unable to map shared reading table";
+  }
+
+  if (publisher)
+    lockFd = fd;
+  else
+    close(fd);
+
+  words = reinterpret_cast<atomic<int32_t>*>(memory);
+  mapSize = BYTE_SIZE;
+
+  bool matching = (words[0] == MAGIC && words[1] == VERSION && words[2] == SLOT_COUNT && words[3] == SLOT_WORDS);
+
+  if (publisher && !matching)
+    initialize();
+  else if (publisher) {
+    for (int i = 0; i < SLOT_COUNT; ++i) {
+      auto &sequence = words[HEADER_WORDS + i * SLOT_WORDS + SEQUENCE];
+
+      if (sequence.load(memory_order_relaxed) & 1)
+        sequence.store(0, memory_order_release);
+    }
+  }
+  else if (!matching) {
+    munmap(memory, BYTE_SIZE);
+    words = nullptr;
+    mapSize = 0;
+    throw "Unrecognized shared reading table format";
+  }
+}
+
+bool ArReadingTable::remove(const string &name) {
+  return shm_unlink(name.c_str()) == 0;
+}
+#endif
+
+void ArReadingTable::publish(const ARTHSM::SensorData &sd) {
+  int index = sd.channel - 'A';
+
+  if (index < 0 || index >= SLOT_COUNT)
+    return;
+
+  atomic<int32_t> *slot = words + HEADER_WORDS + index * SLOT_WORDS;
+  int32_t sequence = slot[SEQUENCE].load(memory_order_relaxed);
+  int32_t values[SLOT_WORDS] = {0};
+
+  values[CHANNEL] = sd.channel;
+  values[FLAGS] = (sd.batteryLow ? BATTERY_LOW : 0) | (sd.validChecksum ? VALID_CHECKSUM : 0) |
+    (sd.restored ? RESTORED : 0);
+  values[RAW_TEMP] = sd.rawTemp;
+  values[TEMP_CELSIUS_TENTHS] = toTenths(sd.tempCelsius);
+  values[TEMP_FAHRENHEIT_TENTHS] = toTenths(sd.tempFahrenheit);
+  values[HUMIDITY] = sd.humidity;
+  values[SIGNAL_QUALITY] = sd.signalQuality;
+  values[MISC_DATA_1] = sd.miscData1;
+  values[MISC_DATA_2] = sd.miscData2;
+  values[MISC_DATA_3] = sd.miscData3;
+  values[REPEATS_CAPTURED] = sd.repeatsCaptured;
+  values[COLLECTION_TIME_LOW] = (int32_t) (uint32_t) sd.collectionTime;
+  values[COLLECTION_TIME_HIGH] = (int32_t) (sd.collectionTime >> 32);
+
+  slot[SEQUENCE].store(sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  for (int i = 1; i < SLOT_WORDS; ++i)
+    slot[i].store(values[i], memory_order_relaxed);
+
+  slot[SEQUENCE].store(sequence + 2, memory_order_release);
+}
+
+ArReadingTable::ReadStatus ArReadingTable::tryRead(char channel, ARTHSM::SensorData &sd) const {
+  int index = channel - 'A';
+
+  if (index < 0 || index >= SLOT_COUNT)
+    return EMPTY;
+
+  const atomic<int32_t> *slot = words + HEADER_WORDS + index * SLOT_WORDS;
+  int32_t values[SLOT_WORDS];
+  int32_t sequence;
+
+  for (int attempt = 0; ; ++attempt) {
+    // A slot which stays busy this long has a publisher which stalled or died while writing it.
+    if (attempt >= MAX_READ_ATTEMPTS)
+      return BUSY;
+
+    sequence = slot[SEQUENCE].load(memory_order_acquire);
+
+    if (sequence == 0)
+      return EMPTY;
+    else if (sequence & 1)
+      continue;
+
+    for (int i = 1; i < SLOT_WORDS; ++i)
+      values[i] = slot[i].load(memory_order_relaxed);
+
+    atomic_thread_fence(memory_order_acquire);
+
+    if (slot[SEQUENCE].load(memory_order_relaxed) == sequence)
+      break;
+  }
+
+  sd.channel = (char) values[CHANNEL];
+  sd.batteryLow = (values[FLAGS] & BATTERY_LOW) != 0;
+  sd.validChecksum = (values[FLAGS] & VALID_CHECKSUM) != 0;
+  sd.restored = (values[FLAGS] & RESTORED) != 0;
+  sd.rawTemp = values[RAW_TEMP];
+  sd.tempCelsius = fromTenths(values[TEMP_CELSIUS_TENTHS]);
+  sd.tempFahrenheit = fromTenths(values[TEMP_FAHRENHEIT_TENTHS]);
+  sd.humidity = values[HUMIDITY];
+  sd.signalQuality = values[SIGNAL_QUALITY];
+  sd.miscData1 = values[MISC_DATA_1];
+  sd.miscData2 = values[MISC_DATA_2];
+  sd.miscData3 = values[MISC_DATA_3];
+  sd.repeatsCaptured = values[REPEATS_CAPTURED];
+  sd.collectionTime = ((int64_t) values[COLLECTION_TIME_HIGH] << 32) | (uint32_t) values[COLLECTION_TIME_LOW];
+
+  return VALID;
+}
@@ -0,0 +1,86 @@
+#ifndef AR_READING_TABLE
+#define AR_READING_TABLE
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "ar-signal-monitor.h"
+
+namespace std {
+
+// A fixed-layout table holding the latest reading for each channel, which readers can poll without
+// any locking or calls into the monitor. The table is an array of 32-bit little-endian words:
+//
+//   Header (16 words): MAGIC, VERSION, SLOT_COUNT, SLOT_WORDS, then reserved words.
+//   Slots (SLOT_WORDS each, for channels A, B, and C in order), using the SlotWord offsets below.
+//
+// Each slot is guarded by a seqlock. The sequence word is odd while the slot is being written. A
+// reader loads the sequence, copies the slot, then loads the sequence again, and retries if the two
+// values differ or are odd, giving up after MAX_READ_ATTEMPTS tries. A slot with a sequence of 0 has never
+// held a reading. Temperatures are
+// stored in tenths of a degree, with -9990 meaning unknown, and a humidity of -999 means unknown.
+//
+// A table can also live in POSIX shared memory, published by one process and mapped read-only by any
+// number of others, which then poll it with a few loads and no system calls. Only one publisher at a time
+// may open a table, holding an flock() on it to keep others out. A publisher keeps the
+// readings of an existing table with the same layout, so readers keep their mappings across its restarts,
+// and clears any slot left half-written by a publisher that died. A change of layout changes VERSION.
+class ArReadingTable {
+  public:
+    static const int32_t MAGIC = 0x41525254; // "ARRT"
+    static const int32_t VERSION = 1;
+    static const int HEADER_WORDS = 16;
+    static const int SLOT_COUNT = 3;
+    static const int SLOT_WORDS = 16;
+    static const int WORD_COUNT = HEADER_WORDS + SLOT_COUNT * SLOT_WORDS;
+    static const size_t BYTE_SIZE = WORD_COUNT * sizeof(int32_t);
+    static const char *DEFAULT_NAME;
+    static const int MAX_READ_ATTEMPTS = 1000;
+
+    enum SlotWord {
+      SEQUENCE, CHANNEL, FLAGS, RAW_TEMP, TEMP_CELSIUS_TENTHS, TEMP_FAHRENHEIT_TENTHS, HUMIDITY,
+      SIGNAL_QUALITY, MISC_DATA_1, MISC_DATA_2, MISC_DATA_3, REPEATS_CAPTURED,
+      COLLECTION_TIME_LOW, COLLECTION_TIME_HIGH // Wall clock microseconds
+    };
+
+    enum Flag { BATTERY_LOW = 1, VALID_CHECKSUM = 2, RESTORED = 4 };
+
+    enum ReadStatus { EMPTY, VALID, BUSY }; // BUSY: the slot stayed mid-write for MAX_READ_ATTEMPTS tries
+
+  private:
+    int lockFd = -1;
+    size_t mapSize = 0;
+    string name;
+    bool ownsMemory;
+    atomic<int32_t> *words;
+
+    void initialize();
+    void map(const string &name, bool publisher);
+
+  public:
+    ArReadingTable();
+    ArReadingTable(void *memory); // Caller-provided memory of BYTE_SIZE bytes, such as shared memory
+    // In POSIX shared memory: a publisher creates the table, or reuses a matching one; others attach read-only.
+    ArReadingTable(const string &name, bool publisher);
+    ~ArReadingTable();
+
+    ArReadingTable(const ArReadingTable&) = delete;
+    ArReadingTable &operator=(const ArReadingTable&) = delete;
+
+    void *data() const { return words; }
+    const string &getName() const { return name; } // Empty unless the table is in shared memory
+    // Only one thread at a time may publish.
+    void publish(const ArTemperatureHumiditySignalMonitor::SensorData &sd);
+    bool read(char channel, ArTemperatureHumiditySignalMonitor::SensorData &sd) const {
+      return tryRead(channel, sd) == VALID;
+    }
+    ReadStatus tryRead(char channel, ArTemperatureHumiditySignalMonitor::SensorData &sd) const;
+
+    static bool remove(const string &name = DEFAULT_NAME);
+};
+
+}
+
+#endif
@@ -0,0 +1,238 @@
+/*
+ * ar-shared-ring.cpp
+ *
+ * Copyright 2020-2025 Kerry Shetline <kerry@shetline.com>
+ *
+ * MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "ar-shared-ring.h"
+
+#if !defined(WIN32) && !defined(WINDOWS)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#define ARTHSM ArTemperatureHumiditySignalMonitor
+
+static_assert(sizeof(ArSharedRing::Header) == 64, "Shared ring header must stay 64 bytes");
+static_assert(sizeof(ArSharedRing::Slot) == sizeof(ArPackedReading), "Shared ring slots must hold packed readings");
+
+const char *ArSharedRing::DEFAULT_NAME = "/ar-signal-monitor";
+
+ArSharedRing::ArSharedRing(const string &name, int capacity) {
+  if (capacity < 2)
+    throw "Shared ring capacity must be at least 2";
+
+  map(name, true, capacity);
+}
+
+ArSharedRing::ArSharedRing(const string &name) {
+  map(name, false, 0);
+}
+
+#if defined(WIN32) || defined(WINDOWS)
+ArSharedRing::~ArSharedRing() {
+}
+
+void ArSharedRing::map(const string &name, bool publisher, int capacity) {
+  throw "Shared memory rings are not supported on this platform";
+}
+
+bool ArSharedRing::remove(const string &name) {
+  return false;
+}
+#else
+ArSharedRing::~ArSharedRing() {
+  if (header)
+    munmap(header, mapSize);
+}
+
+void ArSharedRing::map(const string &name, bool publisher, int capacity) {
+  int fd = shm_open(name.c_str(), publisher ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+  struct stat status;
+
+  if (fd < 0)
+    throw (publisher ? "Unable to create shared memory ring" : "Shared memory ring not found");
+
+  if (fstat(fd, &status) != 0) {
+    close(fd);
+    throw "Unable to open shared memory ring";
+  }
+
+  size_t size = (size_t) status.st_size;
+  bool fresh = false;
+
+  if (publisher) {
+    size_t wanted = sizeof(Header) + (size_t) capacity * sizeof(Slot);
+
+    // Readers map the whole segment, and would fault on slots cut off by shrinking it, or run past their
+    // mappings into slots added by growing it, so the old segment is retired and a new one created.
+    if (size != 0 && size != wanted) {
+      if (size >= sizeof(Header)) {
+        void *old = mmap(nullptr, sizeof(Header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        if (old != MAP_FAILED) {
+          ((Header *) old)->magic = 0;
+          munmap(old, sizeof(Header));
+        }
+      }
+
+      close(fd);
+      shm_unlink(name.c_str());
+      fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+      size = 0;
+
+      if (fd < 0)
+        throw "Unable to create shared memory ring";
+    }
+
+    fresh = (size != wanted);
+
+    if (fresh && ftruncate(fd, wanted) != 0) {
+      close(fd);
+      throw "Unable to size shared memory ring";
+    }
+
+    size = wanted;
+  }
+  else if (size < sizeof(Header)) {
+    close(fd);
+    throw "Shared memory ring not ready";
+  }
+
+  void *memory = mmap(nullptr, size, publisher ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+
+  close(fd);
+
+  if (memory == MAP_FAILED)
+    throw "Unable to map shared memory ring";
+
+  header = (Header *) memory;
+  mapSize = size;
+  this->capacity = (publisher ? capacity : header->capacity);
+  slots = (Slot *) ((char *) memory + sizeof(Header));
+
+  if (publisher && (fresh || header->magic != MAGIC || header->version != VERSION ||
+      header->slotSize != sizeof(Slot) || header->capacity != (uint32_t) capacity)) {
+    header->magic = 0;
+    header->version = VERSION;
+    header->slotSize = sizeof(Slot);
+    header->capacity = capacity;
+    header->count.store(0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    header->magic = MAGIC;
+  }
+  else if (!publisher && (header->magic != MAGIC || header->version != VERSION || header->slotSize != sizeof(Slot) ||
+           sizeof(Header) + (size_t) header->capacity * sizeof(Slot) > size)) {
+    munmap(memory, size);
+    header = nullptr;
+    throw "Unrecognized shared memory ring format";
+  }
+}
+
+bool ArSharedRing::remove(const string &name) {
+  return shm_unlink(name.c_str()) == 0;
+}
+#endif
+
+void ArSharedRing::publish(const ARTHSM::SensorData &sd) {
+  ArPackedReading reading = ArPackedReading::encode(sd);
+  uint64_t count = header->count.load(memory_order_relaxed);
+  Slot &slot = slots[count % capacity];
+
+  // Keeps the slot from changing before the count that tells readers it's about to change.
+  atomic_thread_fence(memory_order_release);
+  slot.time.store(reading.time, memory_order_relaxed);
+  slot.fields.store(reading.fields, memory_order_relaxed);
+  header->count.store(count + 1, memory_order_release);
+}
+
+bool ArSharedRing::isReplaced() const {
+  bool replaced = (header->magic != MAGIC || header->capacity != capacity);
+
+  atomic_thread_fence(memory_order_acquire);
+
+  return replaced;
+}
+
+ArSharedRing::Reader::Reader(const ArSharedRing &ring, bool fromOldest) : ring(ring) {
+  uint64_t count = ring.getCount();
+  uint64_t capacity = ring.capacity;
+
+  cursor = (!fromOldest ? count : count >= capacity ? count - capacity + 1 : 0);
+}
+
+uint64_t ArSharedRing::Reader::available() const {
+  uint64_t count = ring.getCount();
+
+  return count >= cursor ? count - cursor : count;
+}
+
+bool ArSharedRing::Reader::next(ArPackedReading &reading) {
+  // Never the header's capacity, which needn't match the mapping once the segment's been replaced.
+  uint64_t capacity = ring.capacity;
+
+  while (true) {
+    if (ring.isReplaced())
+      return false;
+
+    uint64_t count = ring.getCount();
+
+    if (count < cursor) {
+      cursor = 0;
+      ++resets;
+    }
+
+    if (cursor >= count)
+      return false;
+    else if (count - cursor >= capacity) {
+      lost += count - capacity + 1 - cursor;
+      cursor = count - capacity + 1;
+    }
+
+    const Slot &slot = ring.slots[cursor % capacity];
+
+    reading.time = slot.time.load(memory_order_relaxed);
+    reading.fields = slot.fields.load(memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+
+    uint64_t after = ring.header->count.load(memory_order_relaxed);
+
+    // Otherwise the slot might have been overwritten, or the ring started over, while it was being read, so try again.
+    if (after >= cursor && after - cursor < capacity && !ring.isReplaced()) {
+      ++cursor;
+      return true;
+    }
+  }
+}
+
+bool ArSharedRing::Reader::next(ARTHSM::SensorData &sd) {
+  ArPackedReading reading;
+
+  if (!next(reading))
+    return false;
+
+  sd = ArPackedReading::decode(reading);
+
+  return true;
+}
@@ -0,0 +1,101 @@
+#ifndef AR_SHARED_RING
+#define AR_SHARED_RING
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "ar-packed-reading.h"
+
+namespace std {
+
+// A ring of readings in POSIX shared memory, written by one publishing process and read by any number of
+// others, each reading at its own pace with its own cursor. The segment is a 64-byte Header followed by
+// capacity Slots, each holding one reading in the 16-byte ArPackedReading format as two 64-bit words.
+// All fields are native-endian.
+//
+// Reading n (counting from 0) is kept in slot n % capacity. The publisher stores a reading's slot words,
+// then stores count = n + 1 with release ordering. To read reading n, a reader loads count with acquire
+// ordering, and if n < count, loads the slot words, then loads count again. If the second count exceeds
+// n + capacity - 1, the publisher may have been overwriting the slot, and the reader has fallen too far
+// behind: it skips ahead to the oldest reading still held, count - capacity + 1, and counts the rest as lost.
+//
+// The segment outlives the publisher, so readers carry on where they left off when it restarts with the
+// same capacity. If it restarts with its ring laid out afresh at the same size, count starts over from 0,
+// and a reader finding count below its cursor starts over with it. A segment is never resized under its
+// readers' mappings: a publisher wanting a different size clears magic in the old segment, unlinks it, and
+// creates a new one, and readers still mapping the old one find it replaced, and must attach again.
+class ArSharedRing {
+  public:
+    static const uint32_t MAGIC = 0x52535241; // "ARSR"
+    static const uint32_t VERSION = 1;
+    static const int DEFAULT_CAPACITY = 4096;
+    static const char *DEFAULT_NAME;
+
+    class Header {
+      public:
+        uint32_t magic;
+        uint32_t version;
+        uint32_t slotSize;
+        uint32_t capacity;
+        atomic<uint64_t> count; // Readings ever published
+        char reserved[40];
+    };
+
+    class Slot {
+      public:
+        atomic<uint64_t> time;
+        atomic<uint64_t> fields;
+    };
+
+    // Reads readings in order, starting with those published after the Reader was created, or with the
+    // oldest reading still held.
+    class Reader {
+      private:
+        uint64_t cursor;
+        uint64_t lost = 0;
+        uint64_t resets = 0;
+        const ArSharedRing &ring;
+
+      public:
+        Reader(const ArSharedRing &ring, bool fromOldest = false);
+
+        uint64_t available() const;
+        uint64_t getLost() const { return lost; } // Readings skipped because this reader fell too far behind
+        uint64_t getResets() const { return resets; } // Times the publisher started the ring over
+        bool next(ArPackedReading &reading);
+        bool next(ArTemperatureHumiditySignalMonitor::SensorData &sd);
+    };
+
+  private:
+    uint32_t capacity = 0; // As mapped, whatever the header might say later
+    Header *header = nullptr;
+    size_t mapSize = 0;
+    Slot *slots = nullptr;
+
+    void map(const string &name, bool publisher, int capacity);
+
+  public:
+    ArSharedRing(const string &name, int capacity); // For publishing: creates the segment, or reuses a matching one
+    ArSharedRing(const string &name = DEFAULT_NAME); // For reading: attaches to an existing segment
+    ~ArSharedRing();
+
+    ArSharedRing(const ArSharedRing&) = delete;
+    ArSharedRing &operator=(const ArSharedRing&) = delete;
+
+    size_t byteSize() const { return mapSize; }
+    const void *data() const { return header; }
+    int getCapacity() const { return (int) capacity; }
+    uint64_t getCount() const { return header->count.load(memory_order_acquire); }
+    // True once the publisher has retired this segment, or while it's laying the ring out afresh.
+    bool isReplaced() const;
+    // Only one thread in one process may publish.
+    void publish(const ArTemperatureHumiditySignalMonitor::SensorData &sd);
+
+    static bool remove(const string &name = DEFAULT_NAME);
+};
+
+}
+
+#endif
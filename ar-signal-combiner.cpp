@@ -0,0 +1,328 @@
+/*
+ * ar-signal-combiner.cpp
+ *
+ * Copyright 2020-2025 Kerry Shetline <kerry@shetline.com>
+ *
+ * MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "ar-signal-combiner.h"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+#define ARTHSM ArTemperatureHumiditySignalMonitor
+
+ArSignalCombiner::ArSignalCombiner() {
+  candidates.reserve(MAX_CANDIDATES);
+  lastConnectionCheck = micros();
+  establishQualityCheck();
+}
+
+ArSignalCombiner::~ArSignalCombiner() {
+  stopQualityCheck();
+
+  while (!sources.empty())
+    removeSource(sources.back());
+
+  queueLock.lock();
+  combinerActive = false;
+  windowThreadExit = true;
+  queueLock.unlock();
+  windowSignal.notify_one();
+
+  if (windowThread) {
+    windowThread->join();
+    delete windowThread;
+  }
+}
+
+void ArSignalCombiner::addSource(ARTHSM *source) {
+  source->signalLock.lock();
+
+  if (source->frameSink != nullptr && source->frameSink != this) {
+    source->signalLock.unlock();
+    throw "Monitor is already being combined with other monitors";
+  }
+
+  source->frameSink = this;
+  source->signalLock.unlock();
+
+  queueLock.lock();
+
+  if (find(sources.begin(), sources.end(), source) == sources.end())
+    sources.push_back(source);
+
+  // Started here rather than when a frame arrives, so the sources' capture threads never wait on it.
+  if (!windowThread)
+    windowThread = new thread([this]() { windowLoop(); });
+
+  queueLock.unlock();
+}
+
+uint64_t ArSignalCombiner::getOverrunCount() {
+  uint64_t total = overrunCount;
+
+  for (auto source : getSources())
+    total += source->getOverrunCount();
+
+  return total;
+}
+
+// Signals are measured by the sources, so their histograms are added together.
+bool ArSignalCombiner::getSignalHealth(char channel, ArSignalHealth::Channel &health) {
+  if (!ARTHSM::getSignalHealth(channel, health))
+    return false;
+
+  for (auto source : getSources()) {
+    ArSignalHealth::Channel sourceHealth;
+
+    if (source->getSignalHealth(channel, sourceHealth))
+      health.add(sourceHealth);
+  }
+
+  return true;
+}
+
+// Decoding happens in the sources, dispatching here, so the totals combine both.
+ARTHSM::Stats ArSignalCombiner::getStats() {
+  Stats total = ARTHSM::getStats();
+
+  for (auto source : getSources()) {
+    Stats stats = source->getStats();
+
+    total.edges += stats.edges;
+    total.noiseEdges += stats.noiseEdges;
+    total.syncs += stats.syncs;
+    total.candidateFrames += stats.candidateFrames;
+    total.badBitFrames += stats.badBitFrames;
+    total.badParityFrames += stats.badParityFrames;
+    total.badChecksumFrames += stats.badChecksumFrames;
+    total.goodFrames += stats.goodFrames;
+    total.bitRepairs += stats.bitRepairs;
+    total.cleanUps += stats.cleanUps;
+    total.overruns += stats.overruns;
+  }
+
+  return total;
+}
+
+// Merges the sources' decoder events, tagged by source, with the combiner's own.
+vector<ArTraceRing::Record> ArSignalCombiner::getTrace() {
+  auto records = ARTHSM::getTrace();
+  int sourceNumber = 0;
+
+  for (auto source : getSources()) {
+    auto sourceRecords = source->getTrace();
+
+    ++sourceNumber;
+
+    for (auto &record : sourceRecords)
+      record.source = (uint8_t) sourceNumber;
+
+    records.insert(records.end(), sourceRecords.begin(), sourceRecords.end());
+  }
+
+  stable_sort(records.begin(), records.end(),
+    [](const ArTraceRing::Record &a, const ArTraceRing::Record &b) { return a.time < b.time; });
+
+  return records;
+}
+
+vector<ARTHSM*> ArSignalCombiner::getSources() {
+  lock_guard<mutex> lock(queueLock);
+
+  return sources;
+}
+
+void ArSignalCombiner::removeSource(ARTHSM *source) {
+  source->signalLock.lock();
+
+  if (source->frameSink == this)
+    source->frameSink = nullptr;
+
+  source->signalLock.unlock();
+
+  queueLock.lock();
+  sources.erase(remove(sources.begin(), sources.end(), source), sources.end());
+  queueLock.unlock();
+}
+
+// Dead air is only reported when none of the sources is receiving anything at all.
+int64_t ArSignalCombiner::lastActivityTime() {
+  int64_t latest = lastConnectionCheck;
+
+  queueLock.lock();
+
+  for (auto source : sources)
+    latest = max(latest, source->lastActivityTime());
+
+  queueLock.unlock();
+
+  return latest;
+}
+
+void ArSignalCombiner::receiveCandidateFrame(const Frame &frame, DataIntegrity integrity, int64_t clockTime) {
+  if (frame.getChannel() == '?')
+    return;
+
+  queueLock.lock();
+
+  if (!combinerActive) {
+    queueLock.unlock();
+    return;
+  }
+
+  lastConnectionCheck = clockTime;
+
+  if (candidates.size() < MAX_CANDIDATES)
+    candidates.push_back(Candidate { frame, integrity, clockTime });
+
+  bool opening = !windowOpen;
+
+  if (opening) {
+    windowOpen = true;
+    windowDeadline = micros() + holdWindow;
+  }
+
+  queueLock.unlock();
+
+  if (opening)
+    windowSignal.notify_one();
+}
+
+// Must be called with queueLock held.
+int ArSignalCombiner::closeWindow(SensorData results[3], DebugFrame resultFrames[3]) {
+  int resultCount = 0;
+
+  windowOpen = false;
+
+  for (char channel : { 'A', 'B', 'C' }) {
+    if (combinerActive && combineChannel(channel, results[resultCount], resultFrames[resultCount]))
+      ++resultCount;
+  }
+
+  candidates.clear();
+
+  return resultCount;
+}
+
+// Closes each window once its hold time is up, then dispatches its results outside of queueLock.
+void ArSignalCombiner::windowLoop() {
+  applyThreadOptions(threadOptions);
+
+  unique_lock<mutex> lock(queueLock);
+
+  while (!windowThreadExit) {
+    int64_t now = micros();
+
+    if (!windowOpen)
+      windowSignal.wait(lock);
+    else if (now < windowDeadline)
+      windowSignal.wait_for(lock, chrono::microseconds(windowDeadline - now));
+    else {
+      SensorData results[3];
+      DebugFrame resultFrames[3];
+      int resultCount = closeWindow(results, resultFrames);
+
+      lock.unlock();
+
+      for (int i = 0; i < resultCount; ++i)
+        dispatchData(results[i], resultFrames[i]);
+
+      lock.lock();
+    }
+  }
+}
+
+bool ArSignalCombiner::combineChannel(char channel, SensorData &sd, DebugFrame &debugFrame) {
+  int votes[Frame::BIT_COUNT] = {0}; // Weighted sum: positive for 1 bits, negative for 0 bits
+  const Candidate *best = nullptr;
+  int count = 0;
+  int64_t time = 0;
+
+  for (auto &candidate : candidates) {
+    if (candidate.frame.getChannel() != channel)
+      continue;
+
+    // Candidates which decoded more cleanly get a stronger vote.
+    int weight = candidate.integrity + 1;
+
+    for (int i = 0; i < Frame::BIT_COUNT; ++i) {
+      int bit = candidate.frame.getBit(i);
+
+      if (bit >= 0)
+        votes[i] += (bit ? weight : -weight);
+    }
+
+    if (!best || candidate.integrity > best->integrity)
+      best = &candidate;
+
+    if (count++ == 0)
+      time = candidate.time;
+  }
+
+  if (count == 0)
+    return false;
+
+  Frame voted;
+
+  for (int i = 0; i < Frame::BIT_COUNT; ++i) {
+    int bit = (votes[i] > 0 ? 1 : votes[i] < 0 ? 0 : best->frame.getBit(i));
+
+    voted.bits <<= 1;
+    voted.validBits <<= 1;
+
+    if (bit >= 0) {
+      voted.bits |= bit;
+      voted.validBits |= 1;
+    }
+  }
+
+  auto integrity = checkDataIntegrity(voted);
+
+  // The vote should never produce a worse result than the best single candidate.
+  if (integrity < best->integrity) {
+    voted = best->frame;
+    integrity = best->integrity;
+  }
+
+  int agreeing = 0;
+
+  for (auto &candidate : candidates) {
+    if (candidate.frame.getChannel() == channel && candidate.integrity == GOOD && candidate.frame.bits == voted.bits)
+      ++agreeing;
+  }
+
+  sd = decodeFrame(voted, integrity);
+  sd.collectionTime = time;
+  sd.repeatsCaptured = count;
+
+  if (sd.rank >= RANK_HIGH && agreeing >= 2)
+    sd.rank = RANK_BEST;
+
+  sd.signalQuality = updateSignalQuality(channel, time, sd.rank);
+  trace.record(ArTraceRing::COMBINE, micros(), channel, integrity, count, voted.bits);
+
+  debugFrame.frame = voted;
+  debugFrame.candidates = count;
+
+  return sd.rank >= RANK_MID;
+}
@@ -0,0 +1,56 @@
+#ifndef AR_SIGNAL_COMBINER
+#define AR_SIGNAL_COMBINER
+
+#include "ar-signal-monitor.h"
+
+namespace std {
+
+// Fuses the candidate frames decoded by several monitors, each with its own receiver and antenna,
+// into a single stream of readings. All candidates arriving within one hold window are combined
+// by a bit-by-bit vote, and the result is dispatched to this object's own listeners.
+class ArSignalCombiner : public ArTemperatureHumiditySignalMonitor {
+  private:
+    static const int MAX_CANDIDATES = 48;
+
+    class Candidate {
+      public:
+        Frame frame;
+        DataIntegrity integrity;
+        int64_t time;
+    };
+
+    vector<Candidate> candidates;
+    bool combinerActive = true;
+    vector<ArTemperatureHumiditySignalMonitor*> sources;
+    int64_t windowDeadline = 0;
+    bool windowOpen = false;
+    condition_variable windowSignal;
+    thread *windowThread = nullptr; // Started with the first source, and kept until the combiner is deleted
+    bool windowThreadExit = false;
+
+  public:
+    ArSignalCombiner();
+    ~ArSignalCombiner();
+
+    // Sources must be removed before they are deleted, or outlive the combiner.
+    void addSource(ArTemperatureHumiditySignalMonitor *source);
+    uint64_t getOverrunCount() override;
+    bool getSignalHealth(char channel, ArSignalHealth::Channel &health) override;
+    Stats getStats() override;
+    vector<ArTraceRing::Record> getTrace() override;
+    vector<ArTemperatureHumiditySignalMonitor*> getSources();
+    void removeSource(ArTemperatureHumiditySignalMonitor *source);
+
+  protected:
+    int64_t lastActivityTime() override;
+    void receiveCandidateFrame(const Frame &frame, DataIntegrity integrity, int64_t clockTime) override;
+
+  private:
+    int closeWindow(SensorData results[3], DebugFrame resultFrames[3]);
+    bool combineChannel(char channel, SensorData &sd, DebugFrame &debugFrame);
+    void windowLoop();
+};
+
+}
+
+#endif
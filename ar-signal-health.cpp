@@ -0,0 +1,176 @@
+/*
+ * ar-signal-health.cpp
+ *
+ * Copyright 2020-2025 Kerry Shetline <kerry@shetline.com>
+ *
+ * MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "ar-signal-health.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+void ArSignalHealth::Histogram::setRange(int nominal, int tolerance) {
+  this->nominal = nominal;
+  this->tolerance = tolerance;
+  binWidth = max((tolerance * 2 + BIN_COUNT - 1) / BIN_COUNT, 1);
+}
+
+void ArSignalHealth::Histogram::record(int value) {
+  int bin = (value - (nominal - tolerance));
+
+  bin = (bin < 0 ? -1 : bin / binWidth);
+
+  if (bin < 0)
+    ++below;
+  else if (bin >= BIN_COUNT)
+    ++above;
+  else
+    ++counts[bin];
+
+  if (count == 0 || value < minimum)
+    minimum = value;
+
+  if (count == 0 || value > maximum)
+    maximum = value;
+
+  ++count;
+  sum += value;
+  sumOfSquares += (double) value * value;
+}
+
+// Both histograms must have the same range.
+void ArSignalHealth::Histogram::add(const Histogram &other) {
+  if (other.count == 0)
+    return;
+
+  for (int i = 0; i < BIN_COUNT; ++i)
+    counts[i] += other.counts[i];
+
+  minimum = (count == 0 ? other.minimum : min(minimum, other.minimum));
+  maximum = (count == 0 ? other.maximum : max(maximum, other.maximum));
+  below += other.below;
+  above += other.above;
+  count += other.count;
+  sum += other.sum;
+  sumOfSquares += other.sumOfSquares;
+}
+
+double ArSignalHealth::Histogram::mean() const {
+  return count == 0 ? 0 : sum / count;
+}
+
+double ArSignalHealth::Histogram::standardDeviation() const {
+  if (count < 2)
+    return 0;
+
+  double m = mean();
+
+  return sqrt(max(sumOfSquares / count - m * m, 0.0));
+}
+
+int ArSignalHealth::Histogram::percentile(double p) const {
+  if (count == 0)
+    return 0;
+
+  uint64_t rank = max((uint64_t) ceil(min(max(p, 0.0), 100.0) / 100.0 * count), (uint64_t) 1);
+  uint64_t seen = below;
+
+  if (seen >= rank)
+    return minimum;
+
+  for (int i = 0; i < BIN_COUNT; ++i) {
+    seen += counts[i];
+
+    if (seen >= rank)
+      return nominal - tolerance + i * binWidth + binWidth / 2;
+  }
+
+  return maximum;
+}
+
+void ArSignalHealth::Channel::add(const Channel &other) {
+  frames += other.frames;
+
+  for (int i = 0; i < MEASURE_COUNT; ++i)
+    histograms[i].add(other.histograms[i]);
+}
+
+bool ArSignalHealth::getChannel(char channel, Channel &snapshot) const {
+  int index = channel - 'A';
+
+  if (index < 0 || index >= CHANNEL_COUNT)
+    return false;
+
+  lock_guard<mutex> guard(lock);
+  snapshot = channels[index];
+
+  return true;
+}
+
+// Called once per frame, so the lock is taken once per frame, not once per pulse.
+void ArSignalHealth::recordFrame(char channel, const FrameTimings &timings) {
+  int index = channel - 'A';
+
+  if (index < 0 || index >= CHANNEL_COUNT)
+    return;
+
+  lock_guard<mutex> guard(lock);
+  Channel &c = channels[index];
+
+  ++c.frames;
+
+  for (int i = 0; i + 1 < timings.dataTimingCount; i += 2) {
+    int t0 = timings.dataTimings[i];
+    int t1 = timings.dataTimings[i + 1];
+
+    c.histograms[SHORT_PULSE_WIDTH].record(min(t0, t1));
+    c.histograms[LONG_PULSE_WIDTH].record(max(t0, t1));
+  }
+
+  for (int i = 0; i < timings.syncTimingCount; ++i)
+    c.histograms[SYNC_PULSE_WIDTH].record(timings.syncTimings[i]);
+
+  if (timings.hasJitter)
+    c.histograms[FRAME_JITTER].record(timings.jitter);
+}
+
+void ArSignalHealth::reset() {
+  lock_guard<mutex> guard(lock);
+
+  for (auto &c : channels) {
+    c.frames = 0;
+
+    for (auto &h : c.histograms) {
+      Histogram empty;
+
+      empty.setRange(h.nominal, h.tolerance);
+      h = empty;
+    }
+  }
+}
+
+void ArSignalHealth::setRange(Measure measure, int nominal, int tolerance) {
+  lock_guard<mutex> guard(lock);
+
+  for (auto &c : channels)
+    c.histograms[measure].setRange(nominal, tolerance);
+}
@@ -0,0 +1,79 @@
+#ifndef AR_SIGNAL_HEALTH
+#define AR_SIGNAL_HEALTH
+
+#include <cstdint>
+#include <mutex>
+
+namespace std {
+
+// Per-channel distributions of the pulse widths measured in successfully decoded frames, and of the
+// timing jitter between repeated frames. Each histogram spans the window the decoder accepts, nominal
+// width ± tolerance, so widths drifting toward the edges of that window show up well before frames
+// start failing.
+class ArSignalHealth {
+  public:
+    static const int BIN_COUNT = 40;
+    static const int CHANNEL_COUNT = 3; // A-C
+
+    enum Measure {
+      SHORT_PULSE_WIDTH,
+      LONG_PULSE_WIDTH,
+      SYNC_PULSE_WIDTH, // The short sync pulses which precede each frame
+      FRAME_JITTER,     // Deviation from the nominal time between the starts of repeated frames
+      MEASURE_COUNT
+    };
+
+    class Histogram {
+      public:
+        int nominal = 0;   // Microseconds
+        int tolerance = 0;
+        int binWidth = 1;  // Bin i starts at nominal - tolerance + i * binWidth
+        uint64_t counts[BIN_COUNT] = {};
+        uint64_t below = 0; // Values outside of the bins
+        uint64_t above = 0;
+        uint64_t count = 0;
+        int maximum = 0;
+        int minimum = 0;
+        double sum = 0;
+        double sumOfSquares = 0;
+
+        void add(const Histogram &other);
+        double mean() const;
+        int percentile(double p) const; // p from 0 to 100, resolved to the middle of a bin
+        void record(int value);
+        void setRange(int nominal, int tolerance);
+        double standardDeviation() const;
+    };
+
+    class Channel {
+      public:
+        uint64_t frames = 0;
+        Histogram histograms[MEASURE_COUNT];
+
+        void add(const Channel &other);
+    };
+
+    class FrameTimings {
+      public:
+        const int *dataTimings = nullptr;  // Alternating high and low times, two per bit
+        int dataTimingCount = 0;
+        const int *syncTimings = nullptr;  // Optional
+        int syncTimingCount = 0;
+        bool hasJitter = false;
+        int jitter = 0;
+    };
+
+  private:
+    Channel channels[CHANNEL_COUNT];
+    mutable mutex lock;
+
+  public:
+    bool getChannel(char channel, Channel &snapshot) const;
+    void recordFrame(char channel, const FrameTimings &timings);
+    void reset();
+    void setRange(Measure measure, int nominal, int tolerance);
+};
+
+}
+
+#endif
@@ -1,7 +1,16 @@
 #include <napi.h>
+#include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <thread>
+#include "ar-archive.h"
+#include "ar-history-store.h"
+#include "ar-reading-table.h"
+#include "ar-shared-ring.h"
+#include "ar-signal-combiner.h"
 #include "ar-signal-monitor.h"
 #include "pin-conversions.h"
 
@@ -9,117 +18,639 @@ using namespace std;
 
 #define ARTHSM ArTemperatureHumiditySignalMonitor
 
+static const int READING_QUEUE_SIZE = 64;
+static const int BLOCK_TIMEOUT = 100; // Milliseconds
+static const int HISTORY_READ_ATTEMPTS = 4;
+
+enum OverflowPolicy { DROP_OLDEST, COALESCE, BLOCK };
+
+// Readings are queued here until the JavaScript thread can take them, so that one call through the
+// thread-safe function can deliver any number of readings, with no memory allocated per reading.
 struct CallbackInfo {
   Napi::Env env;
   Napi::Function callback;
-  napi_threadsafe_function *tsfn;
+  napi_threadsafe_function tsfn;
   int callbackId;
+  bool batch;
+  int archiveListenerId = -1; // A second native listener, feeding the archive, if any
+  bool callPending = false;
+  bool closing = false;
+  uint64_t coalescedCount = 0;
+  uint64_t droppedCount = 0;
+  ARTHSM *monitor = nullptr;
+  OverflowPolicy overflow = DROP_OLDEST;
+  bool pull = false; // JavaScript takes readings itself, and is only notified when readings are available
+  int queueCapacity = READING_QUEUE_SIZE;
+  mutex queueLock;
+  int queueLength = 0;
+  int queueStart = 0;
+  condition_variable queueSpaceAvailable;
+  ARTHSM::SensorData queue[READING_QUEUE_SIZE];
+  int64_t queuedAt[READING_QUEUE_SIZE]; // Microseconds, for timing how long each reading waits
+#ifdef USE_FAKE_GPIOD
+  thread *simulation = nullptr;
+#endif
+};
+
+struct MonitorReference {
+  string key;
+  int count;
 };
 
-static map<int, ARTHSM*> signalMonitorsByPin;
-static map<int, ARTHSM*> signalMonitorsById;
-static map<int, CallbackInfo*> callbackInfoById;
+// Monitors are shared by every Node environment (main thread and workers) in the process.
+static recursive_mutex monitorLock;
+static map<string, ARTHSM*> signalMonitorsByLine;
+static map<ARTHSM*, MonitorReference> monitorReferences;
+
+static const char *SENSOR_DATA_KEYS[] = { "batteryLow", "channel", "humidity", "miscData1", "miscData2", "miscData3",
+  "rawTemp", "restored", "signalQuality", "tempCelsius", "tempFahrenheit", "validChecksum" };
+static const int SENSOR_DATA_KEY_COUNT = sizeof(SENSOR_DATA_KEYS) / sizeof(SENSOR_DATA_KEYS[0]);
+
+// Listeners belong to the environment which added them.
+struct AddonData {
+  map<int, ARTHSM*> signalMonitorsById;
+  map<int, CallbackInfo*> callbackInfoById;
+  napi_ref sensorDataKeys[SENSOR_DATA_KEY_COUNT];
+};
+
+static AddonData *getAddonData(napi_env env) {
+  void *data = nullptr;
+
+  napi_get_instance_data(env, &data);
+
+  return (AddonData *) data;
+}
+
+static Napi::Object sensorDataToObject(Napi::Env env, const ARTHSM::SensorData *sensorData) {
+  AddonData *data = getAddonData(env);
+  char channel[2] = { sensorData->channel, 0 };
+  napi_value values[SENSOR_DATA_KEY_COUNT] = {
+    Napi::Boolean::New(env, sensorData->batteryLow),
+    Napi::String::New(env, channel),
+    sensorData->humidity == -999 ? env.Undefined() : Napi::Number::New(env, sensorData->humidity),
+    Napi::Number::New(env, sensorData->miscData1),
+    Napi::Number::New(env, sensorData->miscData2),
+    Napi::Number::New(env, sensorData->miscData3),
+    Napi::Number::New(env, sensorData->rawTemp),
+    Napi::Boolean::New(env, sensorData->restored),
+    Napi::Number::New(env, sensorData->signalQuality),
+    sensorData->tempCelsius == -999 ? env.Undefined() : Napi::Number::New(env, sensorData->tempCelsius),
+    sensorData->tempFahrenheit == -999 ? env.Undefined() : Napi::Number::New(env, sensorData->tempFahrenheit),
+    Napi::Boolean::New(env, sensorData->validChecksum)
+  };
+  napi_property_descriptor properties[SENSOR_DATA_KEY_COUNT];
+  napi_value obj;
+
+  // All properties are defined at once, always in the same order, with keys created only once per environment,
+  // so every reading object gets the same shape.
+  for (int i = 0; i < SENSOR_DATA_KEY_COUNT; ++i) {
+    properties[i] = { nullptr, nullptr, nullptr, nullptr, nullptr, values[i],
+      (napi_property_attributes) (napi_writable | napi_enumerable | napi_configurable), nullptr };
+    napi_get_reference_value(env, data->sensorDataKeys[i], &properties[i].name);
+  }
+
+  napi_create_object(env, &obj);
+  napi_define_properties(env, obj, SENSOR_DATA_KEY_COUNT, properties);
+
+  return Napi::Object(env, obj);
+}
+
+// Runs on the JavaScript thread once the tsfn has been closed, and nothing else can be using cbi.
+static void finalizeCallbackInfo(napi_env env, void *data, void *hint) {
+  CallbackInfo *cbi = (CallbackInfo *) data;
+
+#ifdef USE_FAKE_GPIOD
+  if (cbi->simulation) {
+    cbi->simulation->join();
+    delete cbi->simulation;
+  }
+#endif
+
+  delete cbi;
+}
+
+static int64_t steadyMicros() {
+  return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Must be called with cbi->queueLock held.
+static void recordQueueing(CallbackInfo *cbi, int index, int64_t now) {
+  if (!cbi->closing)
+    cbi->monitor->recordLatency(ARTHSM::TSFN_QUEUEING, now - cbi->queuedAt[index]);
+}
 
 static void jsCallback(napi_env env, napi_value js_cb, void* context, void* miscData) {
+  // Calls still queued when the tsfn is closed arrive here without an environment, after cbi is gone.
+  if (env == nullptr)
+    return;
+
   CallbackInfo *cbi = (CallbackInfo *) context;
-  auto origEnv = cbi->env;
-  auto sensorData = (ARTHSM::SensorData*) miscData;
-  Napi::Object obj = Napi::Object::New(env);
+  ARTHSM::SensorData readings[READING_QUEUE_SIZE];
+  int64_t now = steadyMicros();
+  int count;
+
+  cbi->queueLock.lock();
+  count = (cbi->pull ? 0 : cbi->queueLength);
+
+  for (int i = 0; i < count; ++i) {
+    int index = (cbi->queueStart + i) % READING_QUEUE_SIZE;
+
+    readings[i] = cbi->queue[index];
+    recordQueueing(cbi, index, now);
+  }
+
+  cbi->queueStart = (cbi->queueStart + count) % READING_QUEUE_SIZE;
+  cbi->queueLength -= count;
+  cbi->callPending = false;
+  cbi->queueLock.unlock();
+  cbi->queueSpaceAvailable.notify_all();
+
+  if (js_cb == nullptr || (count == 0 && !cbi->pull))
+    return;
+
+  Napi::Env jsEnv(env);
   napi_value result;
-  char channel[2] = { sensorData->channel, 0 };
 
-  obj.Set(Napi::String::New(env, "batteryLow"),
-    Napi::Boolean::New(env, sensorData->batteryLow));
-  obj.Set(Napi::String::New(env, "channel"),
-    Napi::String::New(env, channel));
-  obj.Set(Napi::String::New(env, "humidity"),
-    sensorData->humidity == -999 ? origEnv.Undefined() : Napi::Number::New(env, sensorData->humidity));
-  obj.Set(Napi::String::New(env, "miscData1"),
-    Napi::Number::New(env, sensorData->miscData1));
-  obj.Set(Napi::String::New(env, "miscData2"),
-    Napi::Number::New(env, sensorData->miscData2));
-  obj.Set(Napi::String::New(env, "miscData3"),
-    Napi::Number::New(env, sensorData->miscData3));
-  obj.Set(Napi::String::New(env, "rawTemp"),
-    Napi::Number::New(env, sensorData->rawTemp));
-  obj.Set(Napi::String::New(env, "signalQuality"),
-    Napi::Number::New(env, sensorData->signalQuality));
-  obj.Set(Napi::String::New(env, "tempCelsius"),
-    sensorData->tempCelsius == -999 ? origEnv.Undefined() : Napi::Number::New(env, sensorData->tempCelsius));
-  obj.Set(Napi::String::New(env, "tempFahrenheit"),
-    sensorData->tempFahrenheit == -999 ? origEnv.Undefined() : Napi::Number::New(env, sensorData->tempFahrenheit));
-  obj.Set(Napi::String::New(env, "validChecksum"),
-    Napi::Boolean::New(env, sensorData->validChecksum));
-
-  napi_value args[] = { obj };
-
-  napi_call_function(env, origEnv.Global(), js_cb, 1, args, &result);
-  napi_release_threadsafe_function(*cbi->tsfn, napi_tsfn_release);
-  delete sensorData;
-}
-
-static void callBackHandler(ARTHSM::SensorData sensorData, void *miscData) {
-  CallbackInfo *cbi = (CallbackInfo *) miscData;
-
-  auto sensorDataCopy = (ARTHSM::SensorData *) malloc(sizeof(ARTHSM::SensorData));
-  memcpy(sensorDataCopy, &sensorData, sizeof(ARTHSM::SensorData));
-
-  if (napi_acquire_threadsafe_function(*cbi->tsfn) == napi_ok)
-    napi_call_threadsafe_function(*cbi->tsfn, sensorDataCopy, napi_tsfn_blocking);
+  if (cbi->pull)
+    napi_call_function(env, jsEnv.Global(), js_cb, 0, nullptr, &result);
+  else if (cbi->batch) {
+    Napi::Array array = Napi::Array::New(env, count);
+
+    for (int i = 0; i < count; ++i)
+      array.Set((uint32_t) i, sensorDataToObject(jsEnv, &readings[i]));
+
+    napi_value args[] = { array };
+
+    napi_call_function(env, jsEnv.Global(), js_cb, 1, args, &result);
+  }
+  else {
+    for (int i = 0; i < count; ++i) {
+      napi_value args[] = { sensorDataToObject(jsEnv, &readings[i]) };
+
+      napi_call_function(env, jsEnv.Global(), js_cb, 1, args, &result);
+    }
+  }
+}
+
+static void callBackHandler(const ARTHSM::SensorData &sensorData, CallbackInfo *cbi) {
+  unique_lock<mutex> lock(cbi->queueLock);
+  bool callNeeded;
+  int index;
+
+  if (cbi->overflow == COALESCE) {
+    // A newer reading for a channel replaces one that JavaScript hasn't gotten to yet.
+    for (int i = 0; i < cbi->queueLength; ++i) {
+      index = (cbi->queueStart + i) % READING_QUEUE_SIZE;
+
+      if (cbi->queue[index].channel == sensorData.channel) {
+        cbi->queue[index] = sensorData;
+        cbi->queuedAt[index] = steadyMicros();
+        ++cbi->coalescedCount;
+        return;
+      }
+    }
+  }
+  else if (cbi->overflow == BLOCK) {
+    // The dispatch lock is held here, and the JavaScript thread may be waiting on it too, so the wait is
+    // bounded, after which the oldest reading is dropped as usual.
+    cbi->queueSpaceAvailable.wait_for(lock, chrono::milliseconds(BLOCK_TIMEOUT),
+      [cbi]() { return cbi->queueLength < cbi->queueCapacity || cbi->closing; });
+  }
+
+  if (cbi->closing)
+    return;
+
+  // If JavaScript has fallen this far behind, drop the oldest reading.
+  if (cbi->queueLength >= cbi->queueCapacity) {
+    cbi->queueStart = (cbi->queueStart + 1) % READING_QUEUE_SIZE;
+    --cbi->queueLength;
+    ++cbi->droppedCount;
+  }
+
+  index = (cbi->queueStart + cbi->queueLength++) % READING_QUEUE_SIZE;
+  cbi->queue[index] = sensorData;
+  cbi->queuedAt[index] = steadyMicros();
+  callNeeded = !cbi->callPending;
+  cbi->callPending = true;
+  lock.unlock();
+
+  if (callNeeded)
+    napi_call_threadsafe_function(cbi->tsfn, nullptr, napi_tsfn_nonblocking);
+}
+
+// A line is either a pin number, or an object of the form { chip?: string, line: number | string }.
+static void resolveLine(const Napi::Value &pin, PinSystem pinSys, string &chipName, int &lineOffset) {
+  lineOffset = -1;
+
+  if (pin.IsObject()) {
+    auto lineSpec = pin.As<Napi::Object>();
+    auto line = lineSpec.Get("line");
+
+    if (line.IsString()) {
+      if (!ARTHSM::lookUpLine(line.As<Napi::String>().Utf8Value(), chipName, lineOffset))
+        throw "GPIO line not found";
+    }
+    else if (lineSpec.Has("chip") && !lineSpec.Get("chip").IsUndefined()) {
+      chipName = lineSpec.Get("chip").As<Napi::String>().Utf8Value();
+      lineOffset = line.As<Napi::Number>().Int32Value();
+    }
+    else
+      ARTHSM::lookUpGpioLine(line.As<Napi::Number>().Int32Value(), chipName, lineOffset);
+  }
+  else
+    ARTHSM::lookUpGpioLine(convertPinToGpio(pin.As<Napi::Number>().Int32Value(), pinSys), chipName, lineOffset);
+
+  if (lineOffset < 0)
+    throw "Invalid pin number";
+}
+
+static ARTHSM::ThreadOptions getThreadOptions(const Napi::Value &value) {
+  ARTHSM::ThreadOptions options;
+
+  if (value.IsObject()) {
+    auto obj = value.As<Napi::Object>();
+
+    if (obj.Get("cpu").IsNumber())
+      options.cpu = obj.Get("cpu").As<Napi::Number>().Int32Value();
+
+    if (obj.Get("lockMemory").IsBoolean())
+      options.lockMemory = obj.Get("lockMemory").As<Napi::Boolean>().Value();
+
+    if (obj.Get("realtimePriority").IsNumber())
+      options.realtimePriority = obj.Get("realtimePriority").As<Napi::Number>().Int32Value();
+  }
+
+  return options;
+}
+
+static ARTHSM::ListenerFilter getListenerFilter(const Napi::Value &value) {
+  ARTHSM::ListenerFilter filter;
+
+  if (value.IsObject()) {
+    auto obj = value.As<Napi::Object>();
+
+    if (obj.Get("channels").IsString())
+      filter.channels = obj.Get("channels").As<Napi::String>().Utf8Value();
+
+    if (obj.Get("sensorIds").IsArray()) {
+      auto ids = obj.Get("sensorIds").As<Napi::Array>();
+
+      for (uint32_t i = 0; i < ids.Length(); ++i)
+        filter.sensorIds.push_back(ids.Get(i).As<Napi::Number>().Int32Value());
+    }
+
+    if (obj.Get("minTempDelta").IsNumber())
+      filter.minTempDelta = obj.Get("minTempDelta").As<Napi::Number>().DoubleValue();
+
+    if (obj.Get("minHumidityDelta").IsNumber())
+      filter.minHumidityDelta = obj.Get("minHumidityDelta").As<Napi::Number>().Int32Value();
+
+    if (obj.Get("minInterval").IsNumber()) // Milliseconds
+      filter.minInterval = (int64_t) (obj.Get("minInterval").As<Napi::Number>().DoubleValue() * 1000);
+
+    if (obj.Get("includeDeadAir").IsBoolean())
+      filter.includeDeadAir = obj.Get("includeDeadAir").As<Napi::Boolean>().Value();
+
+    if (obj.Get("includeQualityOnly").IsBoolean())
+      filter.includeQualityOnly = obj.Get("includeQualityOnly").As<Napi::Boolean>().Value();
+  }
+
+  return filter;
+}
+
+// Thread options only take effect when a monitor is first created.
+// A state file only applies to a newly created monitor.
+static ARTHSM *acquireMonitor(const string &chipName, int lineOffset, const ARTHSM::ThreadOptions &options,
+                              const string &stateFile = "") {
+  lock_guard<recursive_mutex> lock(monitorLock);
+  string lineKey = ARTHSM::lineKey(chipName, lineOffset);
+  ARTHSM *monitor;
+
+  if (signalMonitorsByLine.count(lineKey) == 0) {
+    monitor = new ARTHSM();
+    monitor->setThreadOptions(options);
+
+    if (!stateFile.empty())
+      monitor->setStateFile(stateFile);
+
+    try {
+      monitor->init(chipName, lineOffset);
+    }
+    catch (char const *err) {
+      delete monitor;
+      throw;
+    }
+
+    signalMonitorsByLine[lineKey] = monitor;
+    monitorReferences[monitor] = MonitorReference { lineKey, 0 };
+  }
+  else
+    monitor = signalMonitorsByLine[lineKey];
+
+  ++monitorReferences[monitor].count;
+
+  return monitor;
+}
+
+static void releaseMonitor(ARTHSM *monitor) {
+  lock_guard<recursive_mutex> lock(monitorLock);
+
+  if (monitorReferences.count(monitor) == 0 || --monitorReferences[monitor].count > 0)
+    return;
+
+  signalMonitorsByLine.erase(monitorReferences[monitor].key);
+  monitorReferences.erase(monitor);
+
+  auto combiner = dynamic_cast<ArSignalCombiner*>(monitor);
+
+  if (combiner) {
+    auto sources = combiner->getSources();
+
+    delete combiner;
+
+    for (auto source : sources)
+      releaseMonitor(source);
+  }
   else
-    free(sensorDataCopy);
+    delete monitor;
+}
+
+// Receivers on multiple pins are fused into one stream of readings.
+static ARTHSM *acquireCombiner(const Napi::Array &pins, PinSystem pinSys, const ARTHSM::ThreadOptions &options,
+                               const string &stateFile = "") {
+  vector<pair<string, int>> lines;
+  vector<string> keys;
+  string combinedKey;
+
+  for (uint32_t i = 0; i < pins.Length(); ++i) {
+    string chipName;
+    int lineOffset;
+
+    resolveLine(pins.Get(to_string(i)), pinSys, chipName, lineOffset);
+    keys.push_back(ARTHSM::lineKey(chipName, lineOffset));
+    lines.push_back(make_pair(chipName, lineOffset));
+  }
+
+  sort(keys.begin(), keys.end());
+
+  for (auto &key : keys)
+    combinedKey += (combinedKey.empty() ? "" : "+") + key;
+
+  lock_guard<recursive_mutex> lock(monitorLock);
+
+  if (signalMonitorsByLine.count(combinedKey) > 0) {
+    ARTHSM *monitor = signalMonitorsByLine[combinedKey];
+
+    ++monitorReferences[monitor].count;
+
+    return monitor;
+  }
+
+  ArSignalCombiner *combiner = new ArSignalCombiner();
+
+  combiner->setThreadOptions(options);
+  signalMonitorsByLine[combinedKey] = combiner;
+  monitorReferences[combiner] = MonitorReference { combinedKey, 1 };
+
+  try {
+    for (auto &line : lines)
+      combiner->addSource(acquireMonitor(line.first, line.second, options));
+  }
+  catch (char const *err) {
+    releaseMonitor(combiner);
+    throw;
+  }
+
+  if (!stateFile.empty()) {
+    combiner->setStateFile(stateFile);
+    combiner->restoreState();
+  }
+
+  return combiner;
 }
 
 Napi::Value addSensorDataListener(const Napi::CallbackInfo &info) {
   Napi::Env env = info.Env();
 
   if (info.Length() < 2) {
-    Napi::TypeError::New(env, "2-3 arguments should be provided").ThrowAsJavaScriptException();
+    Napi::TypeError::New(env, "2-4 arguments should be provided").ThrowAsJavaScriptException();
     return env.Undefined();
   }
 
-  int pin = info[0].As<Napi::Number>().Int32Value();
   int pinSys = 0;
   int callBackArg = 1;
   ARTHSM *monitor;
 
-  if (info.Length() > 2) {
+  if (info.Length() > 2 && info[1].IsNumber()) {
     pinSys = info[1].As<Napi::Number>().Int32Value();
     ++callBackArg;
   }
 
-  if (signalMonitorsByPin.count(pin) == 0) {
+  auto options = (info.Length() > (size_t) callBackArg + 1 ? info[callBackArg + 1] : env.Undefined());
+
+  if (options.IsObject() && options.As<Napi::Object>().Get("queueSize").IsNumber()) {
+    int queueSize = options.As<Napi::Object>().Get("queueSize").As<Napi::Number>().Int32Value();
+
+    if (queueSize < 1 || queueSize > READING_QUEUE_SIZE) {
+      Napi::RangeError::New(env, "queueSize must be from 1 to 64").ThrowAsJavaScriptException();
+      return env.Undefined();
+    }
+  }
+  auto threadOptions = getThreadOptions(options);
+  string stateFile = (options.IsObject() && options.As<Napi::Object>().Get("stateFile").IsString() ?
+    options.As<Napi::Object>().Get("stateFile").As<Napi::String>().Utf8Value() : "");
+
+  try {
+    if (info[0].IsArray())
+      monitor = acquireCombiner(info[0].As<Napi::Array>(), (PinSystem) pinSys, threadOptions, stateFile);
+    else {
+      string chipName;
+      int lineOffset;
+
+      resolveLine(info[0], (PinSystem) pinSys, chipName, lineOffset);
+      monitor = acquireMonitor(chipName, lineOffset, threadOptions, stateFile);
+    }
+  }
+  catch (char const *err) {
+    cerr << err << endl;
+    Napi::TypeError::New(env, err).ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  shared_ptr<ArHistoryStore> addedHistory;
+  shared_ptr<ArReadingTable> replacedTable;
+  // Undoes what this listener set up on a monitor which might be shared with other listeners.
+  auto undoSetUp = [monitor, &addedHistory, &replacedTable]() {
+    if (addedHistory)
+      monitor->setHistoryStore(nullptr);
+
+    if (replacedTable)
+      monitor->setReadingTable(replacedTable);
+
+    releaseMonitor(monitor);
+  };
+
+  // A monitor shared by several listeners keeps the history store of whichever listener asked for one first.
+  if (options.IsObject() && options.As<Napi::Object>().Get("history").IsObject() && !monitor->getHistoryStore()) {
+    auto history = options.As<Napi::Object>().Get("history").As<Napi::Object>();
+    string prefix = history.Get("prefix").IsString() ? history.Get("prefix").As<Napi::String>().Utf8Value() : "history";
+    int capacity = history.Get("capacity").IsNumber() ? history.Get("capacity").As<Napi::Number>().Int32Value() :
+      ArHistoryStore::DEFAULT_CAPACITY;
+
+    try {
+      addedHistory = make_shared<ArHistoryStore>(history.Get("directory").ToString().Utf8Value(), prefix, capacity);
+      monitor->setHistoryStore(addedHistory);
+    }
+    catch (char const *err) {
+      undoSetUp();
+      Napi::Error::New(env, err).ThrowAsJavaScriptException();
+      return env.Undefined();
+    }
+  }
+
+  // Likewise for a shared table, so a second listener naming the same table doesn't try to publish it twice.
+  if (options.IsObject() && options.As<Napi::Object>().Get("sharedTable").IsString() &&
+      monitor->getReadingTable()->getName().empty()) {
     try {
-      monitor = new ARTHSM();
-      monitor->init(pin, (PinSystem) pinSys);
+      auto table = make_shared<ArReadingTable>(options.As<Napi::Object>().Get("sharedTable").As<Napi::String>().Utf8Value(),
+        true);
+
+      replacedTable = monitor->getReadingTable();
+      monitor->setReadingTable(table);
     }
     catch (char const *err) {
-      cerr << err << endl;
-      Napi::TypeError::New(env, err).ThrowAsJavaScriptException();
+      undoSetUp();
+      Napi::Error::New(env, err).ThrowAsJavaScriptException();
       return env.Undefined();
     }
+  }
+
+  shared_ptr<ArArchive::Writer> archive;
+
+  if (options.IsObject() && options.As<Napi::Object>().Get("archive").IsObject()) {
+    auto archiveOptions = options.As<Napi::Object>().Get("archive").As<Napi::Object>();
+    auto milliseconds = [&archiveOptions](const char *key, int64_t defaultValue) {
+      return archiveOptions.Get(key).IsNumber() ?
+        (int64_t) (archiveOptions.Get(key).As<Napi::Number>().DoubleValue() * 1000) : defaultValue;
+    };
 
-    signalMonitorsByPin[pin] = monitor;
+    try {
+      archive = make_shared<ArArchive::Writer>(archiveOptions.Get("path").ToString().Utf8Value(),
+        archiveOptions.Get("blockSize").IsNumber() ? archiveOptions.Get("blockSize").As<Napi::Number>().Int32Value() :
+          ArArchive::DEFAULT_BLOCK_SIZE,
+        milliseconds("commitInterval", ArArchive::DEFAULT_COMMIT_INTERVAL),
+        milliseconds("syncInterval", ArArchive::DEFAULT_SYNC_INTERVAL));
+    }
+    catch (char const *err) {
+      undoSetUp();
+      Napi::Error::New(env, err).ThrowAsJavaScriptException();
+      return env.Undefined();
+    }
   }
-  else
-    monitor = signalMonitorsByPin[pin];
 
   auto callback = info[callBackArg].As<Napi::Function>();
-  napi_threadsafe_function *threadSafeFunction = new napi_threadsafe_function;
-  CallbackInfo *cbi = new CallbackInfo { env, callback, threadSafeFunction, 0 };
+  bool batch = options.IsObject() && options.As<Napi::Object>().Get("batch").ToBoolean();
+  CallbackInfo *cbi = new CallbackInfo { env, callback, nullptr, 0, batch };
+
+  cbi->monitor = monitor;
+
+  if (options.IsObject()) {
+    auto obj = options.As<Napi::Object>();
+
+    cbi->pull = obj.Get("pull").ToBoolean();
+
+    if (obj.Get("queueSize").IsNumber())
+      cbi->queueCapacity = obj.Get("queueSize").As<Napi::Number>().Int32Value();
+
+    if (obj.Get("overflow").IsString()) {
+      string overflow = obj.Get("overflow").As<Napi::String>().Utf8Value();
 
-  NAPI_THROW_IF_FAILED_VOID(env,
-    napi_create_threadsafe_function(env, callback, nullptr,
-    Napi::String::New(env, "ARTHSM callback"), 0, 1, nullptr,
-    nullptr, cbi, jsCallback, threadSafeFunction));
+      cbi->overflow = (overflow == "block" ? BLOCK : overflow == "coalesce" ? COALESCE : DROP_OLDEST);
+    }
+  }
+
+  napi_status status = napi_create_threadsafe_function(env, callback, nullptr,
+    Napi::String::New(env, "ARTHSM callback"), 0, 1, cbi,
+    finalizeCallbackInfo, cbi, jsCallback, &cbi->tsfn);
+
+  if (status != napi_ok) {
+    // Taken before cleaning up, while the failure is still the last N-API error.
+    Napi::Error error = Napi::Error::New(env);
+
+    delete cbi;
+    undoSetUp();
+    error.ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
 
-  cbi->callbackId = monitor->addListener(callBackHandler, cbi);
-  signalMonitorsById[cbi->callbackId] = monitor;
-  callbackInfoById[cbi->callbackId] = cbi;
+  cbi->callbackId = monitor->addListener([cbi](const ARTHSM::SensorData &sd) { callBackHandler(sd, cbi); },
+    getListenerFilter(options));
+
+  // The archive gets the same readings as the listener, less dead air, signal quality updates, and restored readings.
+  if (archive) {
+    auto filter = getListenerFilter(options);
+
+    filter.includeDeadAir = filter.includeQualityOnly = false;
+    cbi->archiveListenerId = monitor->addListener([archive](const ARTHSM::SensorData &sd) {
+      if (!sd.restored)
+        archive->append(sd);
+    },
+      filter);
+  }
+
+  auto data = getAddonData(env);
+
+  data->signalMonitorsById[cbi->callbackId] = monitor;
+  data->callbackInfoById[cbi->callbackId] = cbi;
+
+  // Readings restored when the monitor started are passed along at once, rather than after the next transmission.
+  monitor->sendRestoredData(cbi->callbackId);
 
   return Napi::Number::New(env, cbi->callbackId);
 }
 
+static void removeListener(AddonData *data, int id) {
+  ARTHSM *monitor = nullptr;
+
+  // Release any dispatch blocked waiting for queue space, so that removing the listener can't deadlock.
+  if (data->callbackInfoById.count(id) > 0) {
+    auto cbi = data->callbackInfoById[id];
+
+    cbi->queueLock.lock();
+    cbi->closing = true;
+    cbi->queueLock.unlock();
+    cbi->queueSpaceAvailable.notify_all();
+  }
+
+  if (data->signalMonitorsById.count(id) > 0) {
+    monitor = data->signalMonitorsById[id];
+
+    if (data->callbackInfoById.count(id) > 0 && data->callbackInfoById[id]->archiveListenerId >= 0)
+      monitor->removeListener(data->callbackInfoById[id]->archiveListenerId);
+
+    monitor->removeListener(id);
+    data->signalMonitorsById.erase(id);
+  }
+
+  if (data->callbackInfoById.count(id) > 0) {
+    auto cbi = data->callbackInfoById[id];
+    data->callbackInfoById.erase(id);
+    // The monitor won't call this listener again, so the tsfn can be closed now. cbi is deleted by its finalizer.
+    napi_release_threadsafe_function(cbi->tsfn, napi_tsfn_abort);
+  }
+
+  if (monitor)
+    releaseMonitor(monitor);
+}
+
+// When an environment (such as a worker thread) shuts down, its listeners go with it.
+static void cleanUpEnvironment(void *arg) {
+  auto data = (AddonData *) arg;
+
+  while (!data->signalMonitorsById.empty())
+    removeListener(data, data->signalMonitorsById.begin()->first);
+}
+
 void removeSensorDataListener(const Napi::CallbackInfo &info) {
   Napi::Env env = info.Env();
 
@@ -128,49 +659,545 @@ void removeSensorDataListener(const Napi::CallbackInfo &info) {
     return;
   }
 
+  removeListener(getAddonData(env), info[0].As<Napi::Number>().Int32Value());
+}
+
+Napi::Value getOverrunCount(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 1) {
+    Napi::TypeError::New(env, "One numeric argument should be provided").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
   int id = info[0].As<Napi::Number>().Int32Value();
-  int pin = -1;
-  ARTHSM *monitor = nullptr;
+  auto data = getAddonData(env);
 
-  if (signalMonitorsById.count(id) > 0) {
-    monitor = signalMonitorsById[id];
-    pin = monitor->getDataPin();
-    monitor->removeListener(id);
-    signalMonitorsById.erase(id);
+  if (data->signalMonitorsById.count(id) == 0)
+    return env.Undefined();
+
+  return Napi::Number::New(env, (double) data->signalMonitorsById[id]->getOverrunCount());
+}
+
+Napi::Value getStats(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 1) {
+    Napi::TypeError::New(env, "One numeric argument should be provided").ThrowAsJavaScriptException();
+    return env.Undefined();
   }
 
-  if (callbackInfoById.count(id) > 0) {
-    auto cbi = callbackInfoById[id];
-    auto tsfn = cbi->tsfn;
-    callbackInfoById.erase(id);
-    napi_acquire_threadsafe_function(*cbi->tsfn);
-    napi_release_threadsafe_function(*cbi->tsfn, napi_tsfn_abort);
+  int id = info[0].As<Napi::Number>().Int32Value();
+  auto data = getAddonData(env);
 
-    // Hack alert! If I don't wait to delete this, there's a crash, but I don't know if there's a good signal to wait for.
-    thread([tsfn]() {
-      this_thread::sleep_for(chrono::milliseconds(250));
-      delete tsfn;
-    }).detach();
+  if (data->signalMonitorsById.count(id) == 0)
+    return env.Undefined();
 
-    delete cbi;
+  auto stats = data->signalMonitorsById[id]->getStats();
+  Napi::Object result = Napi::Object::New(env);
+
+  result.Set("edges", Napi::Number::New(env, (double) stats.edges));
+  result.Set("noiseEdges", Napi::Number::New(env, (double) stats.noiseEdges));
+  result.Set("syncs", Napi::Number::New(env, (double) stats.syncs));
+  result.Set("candidateFrames", Napi::Number::New(env, (double) stats.candidateFrames));
+  result.Set("badBitFrames", Napi::Number::New(env, (double) stats.badBitFrames));
+  result.Set("badParityFrames", Napi::Number::New(env, (double) stats.badParityFrames));
+  result.Set("badChecksumFrames", Napi::Number::New(env, (double) stats.badChecksumFrames));
+  result.Set("goodFrames", Napi::Number::New(env, (double) stats.goodFrames));
+  result.Set("bitRepairs", Napi::Number::New(env, (double) stats.bitRepairs));
+  result.Set("cleanUps", Napi::Number::New(env, (double) stats.cleanUps));
+  result.Set("suppressedRepeats", Napi::Number::New(env, (double) stats.suppressedRepeats));
+  result.Set("dispatches", Napi::Number::New(env, (double) stats.dispatches));
+  result.Set("overruns", Napi::Number::New(env, (double) stats.overruns));
+
+  return result;
+}
+
+static Napi::Object signalHistogramToObject(Napi::Env env, const ArSignalHealth::Histogram &histogram) {
+  Napi::Object result = Napi::Object::New(env);
+  Napi::Array bins = Napi::Array::New(env, ArSignalHealth::BIN_COUNT);
+
+  for (int i = 0; i < ArSignalHealth::BIN_COUNT; ++i)
+    bins.Set((uint32_t) i, Napi::Number::New(env, (double) histogram.counts[i]));
+
+  result.Set("nominal", Napi::Number::New(env, histogram.nominal));
+  result.Set("tolerance", Napi::Number::New(env, histogram.tolerance));
+  result.Set("binStart", Napi::Number::New(env, histogram.nominal - histogram.tolerance));
+  result.Set("binWidth", Napi::Number::New(env, histogram.binWidth));
+  result.Set("bins", bins);
+  result.Set("below", Napi::Number::New(env, (double) histogram.below));
+  result.Set("above", Napi::Number::New(env, (double) histogram.above));
+  result.Set("count", Napi::Number::New(env, (double) histogram.count));
+  result.Set("mean", Napi::Number::New(env, histogram.mean()));
+  result.Set("standardDeviation", Napi::Number::New(env, histogram.standardDeviation()));
+  result.Set("min", Napi::Number::New(env, histogram.minimum));
+  result.Set("max", Napi::Number::New(env, histogram.maximum));
+  result.Set("p1", Napi::Number::New(env, histogram.percentile(1)));
+  result.Set("p50", Napi::Number::New(env, histogram.percentile(50)));
+  result.Set("p99", Napi::Number::New(env, histogram.percentile(99)));
+
+  return result;
+}
+
+Napi::Value getSignalHealth(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 1) {
+    Napi::TypeError::New(env, "One numeric argument should be provided").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  int id = info[0].As<Napi::Number>().Int32Value();
+  auto data = getAddonData(env);
+
+  if (data->signalMonitorsById.count(id) == 0)
+    return env.Undefined();
+
+  auto monitor = data->signalMonitorsById[id];
+  Napi::Object result = Napi::Object::New(env);
+
+  for (char channel : { 'A', 'B', 'C' }) {
+    ArSignalHealth::Channel health;
+
+    if (!monitor->getSignalHealth(channel, health))
+      continue;
+
+    Napi::Object channelHealth = Napi::Object::New(env);
+
+    channelHealth.Set("frames", Napi::Number::New(env, (double) health.frames));
+    channelHealth.Set("shortPulse", signalHistogramToObject(env, health.histograms[ArSignalHealth::SHORT_PULSE_WIDTH]));
+    channelHealth.Set("longPulse", signalHistogramToObject(env, health.histograms[ArSignalHealth::LONG_PULSE_WIDTH]));
+    channelHealth.Set("syncPulse", signalHistogramToObject(env, health.histograms[ArSignalHealth::SYNC_PULSE_WIDTH]));
+    channelHealth.Set("frameJitter", signalHistogramToObject(env, health.histograms[ArSignalHealth::FRAME_JITTER]));
+    result.Set(string(1, channel), channelHealth);
+  }
+
+  return result;
+}
+
+// Returns the decoder trace as binary data, in the format described in ar-trace-ring.h.
+Napi::Value dumpTrace(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 1) {
+    Napi::TypeError::New(env, "One numeric argument should be provided").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  int id = info[0].As<Napi::Number>().Int32Value();
+  auto data = getAddonData(env);
+
+  if (data->signalMonitorsById.count(id) == 0)
+    return env.Undefined();
+
+  string dump = data->signalMonitorsById[id]->dumpTrace();
+  auto buffer = Napi::ArrayBuffer::New(env, dump.size());
+
+  memcpy(buffer.Data(), dump.data(), dump.size());
+
+  return buffer;
+}
+
+static Napi::Object latencyToObject(Napi::Env env, const ArLatencyHistogram::Snapshot &snapshot) {
+  Napi::Object result = Napi::Object::New(env);
+
+  result.Set("count", Napi::Number::New(env, (double) snapshot.count));
+  result.Set("mean", Napi::Number::New(env, snapshot.mean()));
+  result.Set("p50", Napi::Number::New(env, (double) snapshot.percentile(50)));
+  result.Set("p90", Napi::Number::New(env, (double) snapshot.percentile(90)));
+  result.Set("p99", Napi::Number::New(env, (double) snapshot.percentile(99)));
+  result.Set("p999", Napi::Number::New(env, (double) snapshot.percentile(99.9)));
+  result.Set("max", Napi::Number::New(env, (double) snapshot.max));
+
+  return result;
+}
+
+Napi::Value getLatencies(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 1) {
+    Napi::TypeError::New(env, "One numeric argument should be provided").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  int id = info[0].As<Napi::Number>().Int32Value();
+  auto data = getAddonData(env);
+
+  if (data->signalMonitorsById.count(id) == 0)
+    return env.Undefined();
+
+  auto monitor = data->signalMonitorsById[id];
+  Napi::Object result = Napi::Object::New(env);
+
+  result.Set("holdWait", latencyToObject(env, monitor->getLatency(ARTHSM::HOLD_WAIT)));
+  result.Set("dispatchLockWait", latencyToObject(env, monitor->getLatency(ARTHSM::DISPATCH_LOCK_WAIT)));
+  result.Set("listenerExecution", latencyToObject(env, monitor->getLatency(ARTHSM::LISTENER_EXECUTION)));
+  result.Set("tsfnQueueing", latencyToObject(env, monitor->getLatency(ARTHSM::TSFN_QUEUEING)));
+
+  return result;
+}
+
+// Readings from the history store, oldest first, each with its wall clock time in milliseconds.
+Napi::Value getHistory(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 2) {
+    Napi::TypeError::New(env, "2-4 arguments should be provided").ThrowAsJavaScriptException();
+    return env.Undefined();
   }
 
-  if (pin >= 0) {
-    int count = 0;
-    auto it = signalMonitorsById.begin();
+  int id = info[0].As<Napi::Number>().Int32Value();
+  string channel = info[1].ToString().Utf8Value();
+  double from = (info.Length() > 2 && info[2].IsNumber() ? info[2].As<Napi::Number>().DoubleValue() : 0);
+  double to = (info.Length() > 3 && info[3].IsNumber() ? info[3].As<Napi::Number>().DoubleValue() : 1E15);
+  auto data = getAddonData(env);
+
+  if (data->signalMonitorsById.count(id) == 0 || channel.length() != 1)
+    return env.Undefined();
+
+  auto store = data->signalMonitorsById[id]->getHistoryStore();
+
+  if (!store)
+    return env.Undefined();
+
+  vector<ArPackedReading> records;
+  bool intact = false;
+
+  // The records are copied out first. If the ring wrapped around onto them while they were being copied,
+  // they are read again, a few times at most.
+  for (int attempt = 0; attempt < HISTORY_READ_ATTEMPTS && !intact; ++attempt) {
+    auto range = store->query(channel[0], (int64_t) (from * 1000), (int64_t) (to * 1000));
+
+    records.resize(range.size());
+
+    for (size_t i = 0; i < range.size(); ++i)
+      records[i] = range[i];
+
+    intact = !store->overwritten(channel[0], range);
+  }
+
+  if (!intact) {
+    Napi::Error::New(env, "History was overwritten while being read").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
 
-    while (it != signalMonitorsById.end()) {
-      if (it->second->getDataPin() == pin)
-        ++count;
+  Napi::Array result = Napi::Array::New(env, records.size());
+  Napi::String timeKey = Napi::String::New(env, "time");
 
-      ++it;
+  for (size_t i = 0; i < records.size(); ++i) {
+    auto sd = ArPackedReading::decode(records[i]);
+    auto reading = sensorDataToObject(env, &sd);
+
+    reading.Set(timeKey, Napi::Number::New(env, sd.collectionTime / 1000.0));
+    result.Set((uint32_t) i, reading);
+  }
+
+  return result;
+}
+
+// Every reading in an archive file, oldest first, each with its wall clock time in milliseconds.
+Napi::Value readArchive(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 1) {
+    Napi::TypeError::New(env, "One string argument should be provided").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  try {
+    ArArchive::Reader reader(info[0].ToString().Utf8Value());
+    ARTHSM::SensorData sd;
+    Napi::Array result = Napi::Array::New(env);
+    Napi::String timeKey = Napi::String::New(env, "time");
+    uint32_t index = 0;
+
+    while (reader.next(sd)) {
+      auto reading = sensorDataToObject(env, &sd);
+
+      reading.Set(timeKey, Napi::Number::New(env, sd.collectionTime / 1000.0));
+      result.Set(index++, reading);
     }
 
-    if (count == 0 && signalMonitorsByPin.count(pin)) {
-      signalMonitorsByPin.erase(pin);
-      delete monitor;
+    return result;
+  }
+  catch (char const *err) {
+    Napi::Error::New(env, err).ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+}
+
+// Takes the oldest queued reading for a listener, if any, for listeners which pull their own readings.
+Napi::Value takeSensorData(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 1) {
+    Napi::TypeError::New(env, "One numeric argument should be provided").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  int id = info[0].As<Napi::Number>().Int32Value();
+  auto data = getAddonData(env);
+
+  if (data->callbackInfoById.count(id) == 0)
+    return env.Undefined();
+
+  auto cbi = data->callbackInfoById[id];
+  ARTHSM::SensorData sd;
+
+  cbi->queueLock.lock();
+
+  if (cbi->queueLength == 0) {
+    cbi->queueLock.unlock();
+    return env.Undefined();
+  }
+
+  sd = cbi->queue[cbi->queueStart];
+  recordQueueing(cbi, cbi->queueStart, steadyMicros());
+  cbi->queueStart = (cbi->queueStart + 1) % READING_QUEUE_SIZE;
+  --cbi->queueLength;
+  cbi->queueLock.unlock();
+  cbi->queueSpaceAvailable.notify_all();
+
+  return sensorDataToObject(env, &sd);
+}
+
+Napi::Value getQueueStats(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 1) {
+    Napi::TypeError::New(env, "One numeric argument should be provided").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  int id = info[0].As<Napi::Number>().Int32Value();
+  auto data = getAddonData(env);
+
+  if (data->callbackInfoById.count(id) == 0)
+    return env.Undefined();
+
+  auto cbi = data->callbackInfoById[id];
+  Napi::Object stats = Napi::Object::New(env);
+  lock_guard<mutex> lock(cbi->queueLock);
+
+  stats.Set(Napi::String::New(env, "capacity"), Napi::Number::New(env, cbi->queueCapacity));
+  stats.Set(Napi::String::New(env, "coalesced"), Napi::Number::New(env, (double) cbi->coalescedCount));
+  stats.Set(Napi::String::New(env, "depth"), Napi::Number::New(env, cbi->queueLength));
+  stats.Set(Napi::String::New(env, "dropped"), Napi::Number::New(env, (double) cbi->droppedCount));
+
+  return stats;
+}
+
+#ifdef USE_FAKE_GPIOD
+// Feeds synthetic readings to a listener from another thread, for benchmarking delivery to JavaScript, each
+// on channel '?' with sensor ID 16383, which tells them apart from the fake receiver's readings. Built only
+// with the fake gpiod, never into an addon for real hardware.
+Napi::Value simulateReadings(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() != 2) {
+    Napi::TypeError::New(env, "2 arguments should be provided").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  int id = info[0].As<Napi::Number>().Int32Value();
+  int count = info[1].As<Napi::Number>().Int32Value();
+  auto data = getAddonData(env);
+
+  if (data->callbackInfoById.count(id) == 0 || data->callbackInfoById[id]->simulation)
+    return Napi::Boolean::New(env, false);
+
+  CallbackInfo *cbi = data->callbackInfoById[id];
+
+  cbi->simulation = new thread([cbi, count]() {
+    ARTHSM::SensorData sd;
+
+    sd.channel = '?';
+    sd.humidity = 50;
+    sd.miscData1 = 16383;
+    sd.rawTemp = 1200;
+    sd.signalQuality = 100;
+    sd.tempCelsius = 20;
+    sd.tempFahrenheit = 68;
+    sd.validChecksum = true;
+
+    for (int i = 0; i < count; ++i) {
+      sd.miscData2 = i % 128;
+      callBackHandler(sd, cbi);
+    }
+  });
+
+  return Napi::Boolean::New(env, true);
+}
+#endif
+
+// The table stays valid for as long as JavaScript holds the buffer, even after the monitor is gone.
+static void releaseReadingTable(Napi::Env env, void *data, shared_ptr<ArReadingTable> *table) {
+  delete table;
+}
+
+Napi::Value getReadingTable(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 1) {
+    Napi::TypeError::New(env, "One numeric argument should be provided").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  int id = info[0].As<Napi::Number>().Int32Value();
+  auto data = getAddonData(env);
+
+  if (data->signalMonitorsById.count(id) == 0)
+    return env.Undefined();
+
+  auto table = new shared_ptr<ArReadingTable>(data->signalMonitorsById[id]->getReadingTable());
+
+  return Napi::ArrayBuffer::New(env, (*table)->data(), ArReadingTable::BYTE_SIZE, releaseReadingTable, table);
+}
+
+// A shared ring mapped read-only, with this process's own cursor into it, attached again, starting with the
+// oldest reading, whenever the publisher replaces the ring with one of a different size.
+class SharedRingClient {
+  private:
+    uint64_t lostBefore = 0;
+    string name;
+    uint64_t resetsBefore = 0;
+
+  public:
+    unique_ptr<ArSharedRing> ring;
+    unique_ptr<ArSharedRing::Reader> reader;
+
+    SharedRingClient(const string &name, bool fromOldest) : name(name) {
+      ring.reset(new ArSharedRing(name));
+      reader.reset(new ArSharedRing::Reader(*ring, fromOldest));
+    }
+
+    uint64_t getLost() const { return lostBefore + reader->getLost(); }
+    uint64_t getResets() const { return resetsBefore + reader->getResets(); }
+
+    void refresh() {
+      if (!ring->isReplaced())
+        return;
+
+      try {
+        unique_ptr<ArSharedRing> newRing(new ArSharedRing(name));
+
+        if (newRing->isReplaced())
+          return;
+
+        lostBefore = getLost();
+        resetsBefore = getResets() + 1;
+        reader.reset(new ArSharedRing::Reader(*newRing, true));
+        ring = move(newRing);
+      }
+      catch (char const *err) {} // The new ring isn't ready yet, so try again next time.
     }
+};
+
+static Napi::Object historyReadingToObject(Napi::Env env, const ARTHSM::SensorData *sd) {
+  auto reading = sensorDataToObject(env, sd);
+
+  reading.Set("time", Napi::Number::New(env, sd->collectionTime / 1000.0));
+
+  return reading;
+}
+
+static void releaseSharedTable(Napi::Env env, ArReadingTable *table) {
+  delete table;
+}
+
+// Maps a reading table published by another process, read-only, for as long as JavaScript holds the handle.
+// The mapping itself is never handed to JavaScript, where a write to it would crash the process.
+Napi::Value attachReadingTable(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+  string name = (info.Length() > 0 && info[0].IsString() ? info[0].ToString().Utf8Value() : ArReadingTable::DEFAULT_NAME);
+
+  try {
+    return Napi::External<ArReadingTable>::New(env, new ArReadingTable(name, false), releaseSharedTable);
   }
+  catch (char const *err) {
+    Napi::Error::New(env, err).ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+}
+
+// The latest reading for a channel of an attached table, or undefined if there's none, or its slot is stuck mid-write.
+Napi::Value readSharedTable(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 2 || !info[0].IsExternal()) {
+    Napi::TypeError::New(env, "A table handle and a channel should be provided").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  auto table = info[0].As<Napi::External<ArReadingTable>>().Data();
+  string channel = info[1].ToString().Utf8Value();
+  ARTHSM::SensorData sd;
+
+  if (channel.length() != 1 || !table->read(channel[0], sd))
+    return env.Undefined();
+
+  return historyReadingToObject(env, &sd);
+}
+
+static void releaseSharedRing(Napi::Env env, SharedRingClient *client) {
+  delete client;
+}
+
+// Maps a ring published by another process, read-only, for as long as JavaScript holds the handle.
+Napi::Value attachSharedRing(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+  string name = (info.Length() > 0 && info[0].IsString() ? info[0].ToString().Utf8Value() : ArSharedRing::DEFAULT_NAME);
+  bool fromOldest = (info.Length() > 1 && info[1].ToBoolean());
+
+  try {
+    return Napi::External<SharedRingClient>::New(env, new SharedRingClient(name, fromOldest), releaseSharedRing);
+  }
+  catch (char const *err) {
+    Napi::Error::New(env, err).ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+}
+
+// Up to maxCount (default: all available) of the next readings from an attached ring, oldest first.
+Napi::Value readSharedRing(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 1 || !info[0].IsExternal()) {
+    Napi::TypeError::New(env, "A ring handle should be provided").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  auto client = info[0].As<Napi::External<SharedRingClient>>().Data();
+  int64_t maxCount = (info.Length() > 1 && info[1].IsNumber() ? info[1].As<Napi::Number>().Int64Value() : INT64_MAX);
+  Napi::Array result = Napi::Array::New(env);
+  ARTHSM::SensorData sd;
+  uint32_t index = 0;
+
+  client->refresh();
+
+  while (index < maxCount && client->reader->next(sd))
+    result.Set(index++, historyReadingToObject(env, &sd));
+
+  return result;
+}
+
+Napi::Value getSharedRingStatus(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  if (info.Length() < 1 || !info[0].IsExternal()) {
+    Napi::TypeError::New(env, "A ring handle should be provided").ThrowAsJavaScriptException();
+    return env.Undefined();
+  }
+
+  auto client = info[0].As<Napi::External<SharedRingClient>>().Data();
+  Napi::Object status = Napi::Object::New(env);
+
+  client->refresh();
+  status.Set("available", Napi::Number::New(env, client->reader->available()));
+  status.Set("lost", Napi::Number::New(env, client->getLost()));
+  status.Set("resets", Napi::Number::New(env, client->getResets()));
+
+  return status;
 }
 
 Napi::Value convertPinJS(const Napi::CallbackInfo &info) {
@@ -197,12 +1224,73 @@ Napi::Value convertPinJS(const Napi::CallbackInfo &info) {
 }
 
 Napi::Object Init(Napi::Env env, Napi::Object exports) {
+  auto data = new AddonData();
+
+  for (int i = 0; i < SENSOR_DATA_KEY_COUNT; ++i)
+    napi_create_reference(env, Napi::String::New(env, SENSOR_DATA_KEYS[i]), 1, &data->sensorDataKeys[i]);
+
+  napi_set_instance_data(env, data, [](napi_env env, void *data, void *hint) {
+    auto addonData = (AddonData *) data;
+
+    for (int i = 0; i < SENSOR_DATA_KEY_COUNT; ++i)
+      napi_delete_reference(env, addonData->sensorDataKeys[i]);
+
+    delete addonData;
+  }, nullptr);
+  napi_add_env_cleanup_hook(env, cleanUpEnvironment, data);
+
   exports.Set(Napi::String::New(env, "addSensorDataListener"),
               Napi::Function::New(env, addSensorDataListener));
 
   exports.Set(Napi::String::New(env, "removeSensorDataListener"),
               Napi::Function::New(env, removeSensorDataListener));
 
+  exports.Set(Napi::String::New(env, "getOverrunCount"),
+              Napi::Function::New(env, getOverrunCount));
+  exports.Set(Napi::String::New(env, "getStats"),
+              Napi::Function::New(env, getStats));
+  exports.Set(Napi::String::New(env, "getLatencies"),
+              Napi::Function::New(env, getLatencies));
+  exports.Set(Napi::String::New(env, "dumpTrace"),
+              Napi::Function::New(env, dumpTrace));
+  exports.Set(Napi::String::New(env, "getSignalHealth"),
+              Napi::Function::New(env, getSignalHealth));
+
+  exports.Set(Napi::String::New(env, "getHistory"),
+              Napi::Function::New(env, getHistory));
+
+  exports.Set(Napi::String::New(env, "readArchive"),
+              Napi::Function::New(env, readArchive));
+
+  exports.Set(Napi::String::New(env, "getQueueStats"),
+              Napi::Function::New(env, getQueueStats));
+
+  exports.Set(Napi::String::New(env, "takeSensorData"),
+              Napi::Function::New(env, takeSensorData));
+
+#ifdef USE_FAKE_GPIOD
+  exports.Set(Napi::String::New(env, "simulateReadings"),
+              Napi::Function::New(env, simulateReadings));
+#endif
+
+  exports.Set(Napi::String::New(env, "getReadingTable"),
+              Napi::Function::New(env, getReadingTable));
+
+  exports.Set(Napi::String::New(env, "attachReadingTable"),
+              Napi::Function::New(env, attachReadingTable));
+
+  exports.Set(Napi::String::New(env, "readSharedTable"),
+              Napi::Function::New(env, readSharedTable));
+
+  exports.Set(Napi::String::New(env, "attachSharedRing"),
+              Napi::Function::New(env, attachSharedRing));
+
+  exports.Set(Napi::String::New(env, "readSharedRing"),
+              Napi::Function::New(env, readSharedRing));
+
+  exports.Set(Napi::String::New(env, "getSharedRingStatus"),
+              Napi::Function::New(env, getSharedRingStatus));
+
   exports.Set(Napi::String::New(env, "convertPin"),
               Napi::Function::New(env, convertPinJS));
 
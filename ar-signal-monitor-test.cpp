@@ -1,13 +1,28 @@
+#include "ar-archive.h"
+#include "ar-log.h"
+#include "ar-packed-reading.h"
+#include "ar-reading-table.h"
+#include "ar-shared-ring.h"
+#include "ar-signal-combiner.h"
 #include "ar-signal-monitor.h"
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #if defined(WIN32) || defined(WINDOWS)
 #include <windows.h>
 #else
 #include <csignal>
+#include <poll.h>
 #endif
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <new>
 #include "pin-conversions.h"
+#include <thread>
+#include <vector>
 
 using namespace std;
 
@@ -23,6 +38,667 @@ void callback(ArTemperatureHumiditySignalMonitor::SensorData sd, void *msg) {
 
 static ArTemperatureHumiditySignalMonitor *SM;
 
+static atomic<uint64_t> allocationCount { 0 };
+static thread_local uint64_t threadAllocationCount = 0;
+
+void *operator new(size_t size) {
+  ++allocationCount;
+  ++threadAllocationCount;
+
+  void *p = malloc(size == 0 ? 1 : size);
+
+  if (p == nullptr)
+    throw bad_alloc();
+
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+// Feeds synthetic transmissions straight into the signal decoder, in the same format as the fake gpiod.
+class AllocationTestMonitor : public ArTemperatureHumiditySignalMonitor {
+  private:
+    int64_t clock = 0;
+    bool pinHigh = false;
+
+    void pulse(int duration) {
+      timespec ts;
+
+      pinHigh ^= true;
+      clock += duration;
+      ts.tv_sec = clock / 1000000;
+      ts.tv_nsec = clock % 1000000 * 1000;
+      signalHasChanged(pinHigh ? PI_LOW : PI_HIGH, dataPin, &ts, this);
+    }
+
+    void sendSync() {
+      pulse(207);
+      pulse(2205);
+
+      for (int i = 0; i < 8; ++i)
+        pulse(606);
+    }
+
+    static int applyParity(int b) {
+      int sum = 0;
+
+      for (int i = 0; i < 7; ++i)
+        sum += (b >> i) & 1;
+
+      return b | (sum % 2 == 1 ? 0x80 : 0);
+    }
+
+  public:
+    AllocationTestMonitor() {
+      chipName = "test";
+      dataPin = 0;
+    }
+
+    void sendTransmission(int channelBits, int temp, int humidity) {
+      int bytes[7] = { channelBits << 6, 0, 0, applyParity(humidity), applyParity(temp >> 7), applyParity(temp & 0x7F), 0 };
+
+      for (int i = 0; i < 6; ++i)
+        bytes[6] += bytes[i];
+
+      bytes[6] &= 0xFF;
+      pulse(210);
+      pulse(401);
+      sendSync();
+
+      for (int i = 0; i < 7; ++i) {
+        for (int bit = 0x80; bit; bit >>= 1) {
+          pulse((bytes[i] & bit) ? 401 : 210);
+          pulse((bytes[i] & bit) ? 210 : 401);
+        }
+      }
+
+      sendSync();
+      clock += 1000000;
+    }
+
+    static int64_t holdTime() { return holdWindow; }
+};
+
+// Once the first few readings have warmed everything up, decoding and dispatching readings
+// should need no memory allocation at all.
+static int allocationTest(int rounds, bool debug) {
+  static const int channelBits[] = { 3, 2, 0 };
+  AllocationTestMonitor monitor;
+  atomic<int> readings { 0 };
+  uint64_t allocations = 0;
+
+  monitor.enableDebugOutput(debug);
+
+  monitor.addListener([&readings](const ArTemperatureHumiditySignalMonitor::SensorData &sd) { ++readings; });
+
+  for (int round = 0; round < rounds + 3; ++round) {
+    if (round == 3) {
+      readings = 0;
+      allocations = allocationCount;
+    }
+
+    for (int channel = 0; channel < 3; ++channel)
+      monitor.sendTransmission(channelBits[channel], 1020 + channel * 100 + round % 20, 40 + round % 10);
+
+    this_thread::sleep_for(chrono::microseconds(monitor.holdTime() * 2));
+  }
+
+  if (debug)
+    monitor.getDebugLog()->flush();
+
+  allocations = allocationCount - allocations;
+  printf("%d readings dispatched, %llu heap allocations\n", readings.load(), (unsigned long long) allocations);
+
+  return allocations == 0 && readings > 0 ? 0 : 1;
+}
+
+static bool sameReading(const ArTemperatureHumiditySignalMonitor::SensorData &a,
+                        const ArTemperatureHumiditySignalMonitor::SensorData &b) {
+  return a.batteryLow == b.batteryLow && a.channel == b.channel && a.collectionTime == b.collectionTime &&
+    a.humidity == b.humidity && a.miscData1 == b.miscData1 && a.miscData2 == b.miscData2 &&
+    a.miscData3 == b.miscData3 && a.rawTemp == b.rawTemp && a.rank == b.rank &&
+    a.repeatsCaptured == b.repeatsCaptured && a.restored == b.restored && a.signalQuality == b.signalQuality &&
+    a.tempCelsius == b.tempCelsius && a.tempFahrenheit == b.tempFahrenheit && a.validChecksum == b.validChecksum;
+}
+
+// Checks that decoded readings, and every temperature and humidity a sensor can send, survive a round
+// trip through ArPackedReading, then times batch encoding and decoding.
+static int packedReadingTest(int count) {
+  typedef ArTemperatureHumiditySignalMonitor::SensorData SensorData;
+  static const int channelBits[] = { 3, 2, 0 };
+  AllocationTestMonitor monitor;
+  mutex readingsLock;
+  vector<SensorData> readings;
+  int failures = 0;
+
+  monitor.addListener([&](const SensorData &sd) { lock_guard<mutex> lock(readingsLock); readings.push_back(sd); });
+
+  for (int round = 0; round < 5; ++round) {
+    for (int channel = 0; channel < 3; ++channel)
+      monitor.sendTransmission(channelBits[channel], 500 + channel * 700 + round * 13, 10 + round * 20);
+
+    this_thread::sleep_for(chrono::microseconds(monitor.holdTime() * 2));
+  }
+
+  lock_guard<mutex> lock(readingsLock);
+  SensorData deadAir;
+
+  deadAir.channel = '-';
+  deadAir.collectionTime = -12345;
+  readings.push_back(deadAir);
+
+  for (int rawTemp = 0; rawTemp < 2048; ++rawTemp) {
+    SensorData sd = ArPackedReading::decode(ArPackedReading::encode(readings[0]));
+
+    sd.rawTemp = rawTemp;
+    sd.humidity = (rawTemp % 128 > 100 ? -999 : rawTemp % 128);
+    sd = ArPackedReading::decode(ArPackedReading::encode(sd));
+    readings.push_back(sd);
+  }
+
+  for (auto &sd : readings) {
+    if (!sameReading(sd, ArPackedReading::decode(ArPackedReading::encode(sd))))
+      ++failures;
+  }
+
+  printf("%d of %d readings changed by packing\n", failures, (int) readings.size());
+
+  vector<SensorData> unpacked(count);
+  vector<ArPackedReading> packed(count);
+
+  for (int i = 0; i < count; ++i)
+    unpacked[i] = readings[i % readings.size()];
+
+  auto start = chrono::steady_clock::now();
+  ArPackedReading::encode(unpacked.data(), packed.data(), count);
+  auto middle = chrono::steady_clock::now();
+  ArPackedReading::decode(packed.data(), unpacked.data(), count);
+  auto end = chrono::steady_clock::now();
+
+  printf("%d readings, %d bytes packed vs. %d unpacked: encode %.2f ns, decode %.2f ns per reading\n", count,
+    (int) sizeof(ArPackedReading), (int) sizeof(SensorData),
+    chrono::duration<double, nano>(middle - start).count() / count, chrono::duration<double, nano>(end - middle).count() / count);
+
+  return failures == 0 && readings.size() > 2048 ? 0 : 1;
+}
+
+// Archives simulated readings from three sensors, a day's worth at a time, then reads them back,
+// reporting bytes per reading and an estimate of write amplification on flash storage.
+static int archiveTest(int count, const char *path) {
+  typedef ArTemperatureHumiditySignalMonitor::SensorData SensorData;
+  static const int intervals[] = { 15800000, 16100000, 16300000 }; // Microseconds, channels A-C
+  vector<SensorData> readings(count);
+  SensorData last[3];
+  int64_t nextTime[3];
+
+  srand(1);
+  remove(path);
+
+  for (int channel = 0; channel < 3; ++channel) {
+    last[channel].channel = 'A' + channel;
+    last[channel].humidity = 40 + channel * 5;
+    last[channel].miscData1 = 1000 + channel;
+    last[channel].rank = 9;
+    last[channel].rawTemp = 1200 + channel * 50;
+    last[channel].signalQuality = 100;
+    last[channel].validChecksum = true;
+    nextTime[channel] = 1700000000000000LL + channel * 5000000;
+  }
+
+  for (auto &sd : readings) {
+    int channel = (int) (min_element(nextTime, nextTime + 3) - nextTime);
+    SensorData &prev = last[channel];
+
+    prev.collectionTime = nextTime[channel];
+    prev.rawTemp = max(prev.rawTemp + rand() % 3 - 1, 400);
+    prev.humidity = min(max(prev.humidity + (rand() % 8 == 0 ? rand() % 3 - 1 : 0), 0), 100);
+    prev.repeatsCaptured = (rand() % 10 == 0 ? 2 : 3);
+    prev.signalQuality = (rand() % 50 == 0 ? 60 + rand() % 41 : prev.signalQuality);
+    sd = ArPackedReading::decode(ArPackedReading::encode(prev));
+    nextTime[channel] += intervals[channel] + rand() % 2000 - 1000;
+  }
+
+  ArArchive::Stats stats;
+  auto start = chrono::steady_clock::now();
+
+  {
+    ArArchive::Writer writer(path);
+
+    // Far faster than real readings arrive, so wait out a full queue rather than drop.
+    for (auto &sd : readings) {
+      while (!writer.append(sd))
+        this_thread::yield();
+    }
+
+    writer.flush();
+    stats = writer.getStats();
+  }
+
+  auto middle = chrono::steady_clock::now();
+  ArArchive::Reader reader(path);
+  SensorData sd;
+  int readBack = 0;
+  int mismatches = 0;
+
+  while (reader.next(sd)) {
+    if (readBack >= count || !sameReading(sd, readings[readBack]))
+      ++mismatches;
+
+    ++readBack;
+  }
+
+  auto end = chrono::steady_clock::now();
+  double rowBytes = 64; // A typical text row per reading, each written and synced by itself
+
+  printf("%d readings, %d read back, %d mismatched%s\n", count, readBack, mismatches, reader.isDamaged() ? ", damaged" : "");
+  printf("%llu bytes in %llu blocks: %.2f bytes per reading (%d packed, %d unpacked)\n",
+    (unsigned long long) stats.bytes + ArArchive::FILE_HEADER_SIZE, (unsigned long long) stats.blocks,
+    (double) stats.bytes / count, (int) sizeof(ArPackedReading), (int) sizeof(SensorData));
+  printf("%llu pages written, %llu syncs: write amplification %.2f (row per reading: %.1f)\n",
+    (unsigned long long) stats.pagesWritten, (unsigned long long) stats.syncs,
+    stats.pagesWritten * 4096.0 / stats.bytes, 4096 / rowBytes);
+  printf("write %.1f ns, read %.1f ns per reading\n", chrono::duration<double, nano>(middle - start).count() / count,
+    chrono::duration<double, nano>(end - middle).count() / count);
+
+  // Damage a block in the middle, then reopen the archive for writing: only the damaged block may be lost.
+  fstream damage(path, ios::in | ios::out | ios::binary);
+  char byte;
+
+  damage.seekg(0, ios::end);
+
+  long length = (long) damage.tellg();
+
+  damage.seekg(length / 2);
+  damage.read(&byte, 1);
+  byte ^= 0x55;
+  damage.seekp(length / 2);
+  damage.write(&byte, 1);
+  damage.close();
+
+  { ArArchive::Writer writer(path); }
+
+  ArArchive::Reader damagedReader(path);
+  int survivors = 0;
+  bool lastSurvived = false;
+
+  while (damagedReader.next(sd)) {
+    ++survivors;
+    lastSurvived = sameReading(sd, readings[count - 1]);
+  }
+
+  int lost = count - survivors;
+
+  printf("after damaging one block: %d readings lost%s, last reading %s\n", lost,
+    damagedReader.isDamaged() ? " (damage skipped)" : "", lastSurvived ? "kept" : "lost");
+
+  return mismatches == 0 && readBack == count && damagedReader.isDamaged() && lastSurvived &&
+    lost > 0 && lost * (int) stats.blocks <= count * 2 ? 0 : 1;
+}
+
+// Adds and removes listeners while readings are being dispatched. Build with -fsanitize=thread to
+// check that listener changes never race with dispatch. Fails if a listener which stays registered
+// misses a reading, or if a listener is called after its removal returns.
+class ChurnTestMonitor : public ArTemperatureHumiditySignalMonitor {
+  public:
+    void dispatch(const SensorData &sd) {
+      dispatchLock.lock();
+      sendData(sd);
+      dispatchLock.unlock();
+    }
+};
+
+static atomic<uint64_t> churnCalls { 0 };
+
+static void churnCallback(ArTemperatureHumiditySignalMonitor::SensorData sd, void *data) {
+  ++churnCalls;
+  ++*(atomic<uint64_t> *) data;
+}
+
+static int listenerChurnTest(int seconds) {
+  ChurnTestMonitor monitor;
+  atomic<bool> running { true };
+  atomic<uint64_t> dispatches { 0 };
+  atomic<uint64_t> lateCalls { 0 };
+  atomic<uint64_t> listenerChanges { 0 };
+  atomic<uint64_t> stayingCalls { 0 };
+  vector<thread> threads;
+
+  monitor.addListener(&churnCallback, &stayingCalls);
+
+  auto start = chrono::steady_clock::now();
+
+  for (int i = 0; i < 2; ++i) {
+    threads.push_back(thread([&monitor, &running, &dispatches, i]() {
+      ArTemperatureHumiditySignalMonitor::SensorData sd;
+
+      sd.validChecksum = true;
+
+      while (running) {
+        sd.channel = 'A' + (dispatches % 3);
+        sd.rawTemp = 1200 + i;
+        monitor.dispatch(sd);
+        ++dispatches;
+      }
+    }));
+  }
+
+  for (int i = 0; i < 4; ++i) {
+    threads.push_back(thread([&monitor, &running, &lateCalls, &listenerChanges]() {
+      atomic<uint64_t> callCounts[2];
+      uint64_t removedCount = 0;
+
+      // Each removed listener's count is checked again after the next listener has come and gone.
+      for (int n = 0; running; ++n) {
+        atomic<uint64_t> &callCount = callCounts[n % 2];
+
+        callCount = 0;
+
+        int id = monitor.addListener(&churnCallback, &callCount);
+
+        monitor.removeListener(id);
+        listenerChanges += 2;
+
+        if (n > 0 && callCounts[(n + 1) % 2] != removedCount)
+          ++lateCalls;
+
+        removedCount = callCount;
+      }
+    }));
+  }
+
+  this_thread::sleep_for(chrono::seconds(seconds));
+  running = false;
+
+  for (auto &t : threads)
+    t.join();
+
+  double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  printf("%.0f dispatches/s, %.0f listener changes/s, %llu listener calls in %.1f s\n",
+    dispatches / elapsed, listenerChanges / elapsed, (unsigned long long) churnCalls.load(), elapsed);
+  printf("%llu of %llu readings missed by the remaining listener, %llu calls after removal\n",
+    (unsigned long long) (dispatches - stayingCalls), (unsigned long long) dispatches.load(),
+    (unsigned long long) lateCalls.load());
+
+  return dispatches > 0 && stayingCalls == dispatches && lateCalls == 0 ? 0 : 1;
+}
+
+// Monitors a pin for a while, then reports what the decoder made of the signal. Fails if no good frames
+// were decoded, or if the dispatch count doesn't match the readings a listener received.
+int statsTest(int pin, int seconds) {
+  atomic<uint64_t> received { 0 }; // Outlives the monitor
+  ArTemperatureHumiditySignalMonitor monitor;
+  ArTemperatureHumiditySignalMonitor::ListenerFilter filter;
+
+  filter.includeDeadAir = filter.includeQualityOnly = false;
+  monitor.addListener([&received](const ArTemperatureHumiditySignalMonitor::SensorData &sd) { ++received; }, filter);
+  monitor.init(pin, PinSystem::GPIO);
+  this_thread::sleep_for(chrono::seconds(seconds));
+
+  auto stats = monitor.getStats();
+
+  printf("edges: %llu, noise edges: %llu, syncs: %llu\n", (unsigned long long) stats.edges,
+    (unsigned long long) stats.noiseEdges, (unsigned long long) stats.syncs);
+  printf("candidate frames: %llu (bad bits: %llu, bad parity: %llu, bad checksum: %llu, good: %llu)\n",
+    (unsigned long long) stats.candidateFrames, (unsigned long long) stats.badBitFrames,
+    (unsigned long long) stats.badParityFrames, (unsigned long long) stats.badChecksumFrames,
+    (unsigned long long) stats.goodFrames);
+  printf("bit repairs: %llu, clean-ups: %llu, suppressed repeats: %llu, dispatches: %llu, overruns: %llu\n",
+    (unsigned long long) stats.bitRepairs, (unsigned long long) stats.cleanUps,
+    (unsigned long long) stats.suppressedRepeats, (unsigned long long) stats.dispatches,
+    (unsigned long long) stats.overruns);
+
+  const char *stageNames[] = { "hold wait", "dispatch lock wait", "listener execution", "tsfn queueing" };
+
+  for (int i = 0; i < ArTemperatureHumiditySignalMonitor::LATENCY_STAGE_COUNT; ++i) {
+    auto latency = monitor.getLatency((ArTemperatureHumiditySignalMonitor::LatencyStage) i);
+
+    printf("%s: %llu samples, p50 %llu, p99 %llu, max %llu us\n", stageNames[i],
+      (unsigned long long) latency.count, (unsigned long long) latency.percentile(50),
+      (unsigned long long) latency.percentile(99), (unsigned long long) latency.max);
+  }
+
+  const char *measureNames[] = { "short pulse", "long pulse", "sync pulse", "frame jitter" };
+
+  for (char channel : { 'A', 'B', 'C' }) {
+    ArSignalHealth::Channel health;
+
+    if (!monitor.getSignalHealth(channel, health) || health.frames == 0)
+      continue;
+
+    printf("channel %c, %llu frames:\n", channel, (unsigned long long) health.frames);
+
+    for (int i = 0; i < ArSignalHealth::MEASURE_COUNT; ++i) {
+      auto &h = health.histograms[i];
+
+      printf("  %s: %llu samples, nominal %d +/- %d, mean %.1f, sd %.1f, p1 %d, p99 %d, outside %llu\n",
+        measureNames[i], (unsigned long long) h.count, h.nominal, h.tolerance, h.mean(), h.standardDeviation(),
+        h.percentile(1), h.percentile(99), (unsigned long long) (h.below + h.above));
+    }
+  }
+
+  printf("%llu readings received by the listener\n", (unsigned long long) received.load());
+
+  return stats.goodFrames > 0 && stats.dispatches > 0 && stats.dispatches == received ? 0 : 1;
+}
+
+// Monitors a pin for a while with a state file, showing how soon readings arrive. Run twice to see
+// readings restored from the first run.
+int warmStartTest(int pin, int seconds, const char *path) {
+  auto start = chrono::steady_clock::now();
+  ArTemperatureHumiditySignalMonitor monitor;
+
+  monitor.setStateFile(path);
+  monitor.addListener([start](const ArTemperatureHumiditySignalMonitor::SensorData &sd) {
+    printf("%6.0f ms: %c, %.1f°C, %d%%, quality %d%s\n",
+      chrono::duration<double, milli>(chrono::steady_clock::now() - start).count(), sd.channel, sd.tempCelsius,
+      sd.humidity, sd.signalQuality, sd.restored ? ", restored" : "");
+  });
+  monitor.init(pin, PinSystem::GPIO);
+  this_thread::sleep_for(chrono::seconds(seconds));
+
+  return 0;
+}
+
+#if !defined(WIN32) && !defined(WINDOWS)
+// Drives one monitor from a poll() loop on this thread, alongside a threaded monitor on another pin receiving
+// the same signal, and checks that both produce the same readings, with no heap allocations by the loop.
+// Returns nonzero if that check fails.
+int eventLoopTest(int seconds) {
+  static const int MAX_READINGS = 256;
+  static ArTemperatureHumiditySignalMonitor::SensorData threaded[MAX_READINGS], polled[MAX_READINGS];
+  static atomic<int> threadedCount { 0 };
+  static int polledChannels = 0; // Bit per channel
+  static int polledCount = 0;
+  ArTemperatureHumiditySignalMonitor threadedMonitor, polledMonitor;
+
+  threadedMonitor.addListener([](const ArTemperatureHumiditySignalMonitor::SensorData &sd) {
+    int count = threadedCount.load(memory_order_relaxed);
+
+    if (sd.channel != '-' && count < MAX_READINGS) {
+      threaded[count] = sd;
+      threadedCount.store(count + 1, memory_order_release);
+    }
+  });
+  polledMonitor.addListener([](const ArTemperatureHumiditySignalMonitor::SensorData &sd) {
+    if (sd.channel != '-' && polledCount < MAX_READINGS) {
+      polled[polledCount++] = sd;
+      polledChannels |= 1 << (sd.channel - 'A');
+    }
+  });
+  polledMonitor.setExternalEventLoop(true);
+  polledMonitor.init(28, PinSystem::GPIO);
+  threadedMonitor.init(27, PinSystem::GPIO);
+
+  pollfd fds[1] = { { polledMonitor.getEventFd(), POLLIN, 0 } };
+  auto start = chrono::steady_clock::now();
+  uint64_t allocations = 0;
+  uint64_t events = 0;
+  bool warmedUp = false;
+
+  // Allocations by this thread only are counted, once each of the fake signal's channels A, B, and C has
+  // been dispatched, and cached, once.
+  while (chrono::steady_clock::now() < start + chrono::seconds(seconds)) {
+    if (!warmedUp && polledChannels == 7) {
+      warmedUp = true;
+      allocations = threadAllocationCount;
+    }
+
+    if (poll(fds, 1, min(polledMonitor.getTimerTimeout(), 1000)) > 0)
+      events += polledMonitor.processEvents();
+
+    polledMonitor.processTimers();
+  }
+
+  allocations = threadAllocationCount - allocations;
+  this_thread::sleep_for(chrono::milliseconds(200)); // Let the threaded monitor's hold time run out
+
+  int threadedTotal = threadedCount.load(memory_order_acquire);
+  int compared = min(threadedTotal, polledCount);
+  int matching = 0;
+
+  for (int i = 0; i < compared; ++i) {
+    auto &a = threaded[i];
+    auto &b = polled[i];
+
+    if (a.channel == b.channel && a.rawTemp == b.rawTemp && a.humidity == b.humidity &&
+        a.validChecksum == b.validChecksum && a.repeatsCaptured == b.repeatsCaptured &&
+        a.signalQuality == b.signalQuality)
+      ++matching;
+  }
+
+  for (int i = 0; i < polledCount; ++i) {
+    printf("%c, %.1f°C, %d%%, quality %d, %d repeats\n", polled[i].channel, polled[i].tempCelsius,
+      polled[i].humidity, polled[i].signalQuality, polled[i].repeatsCaptured);
+  }
+
+  printf("%llu edges polled; %d readings polled, %d threaded, %d matching; %llu heap allocations after warming up\n",
+    (unsigned long long) events, polledCount, threadedTotal, matching, (unsigned long long) allocations);
+
+  return polledCount == 0 || !warmedUp || matching != compared || allocations != 0 ? 1 : 0;
+}
+#endif
+
+// Runs as a service which owns the receivers on the given pins, combining them if there are several, and
+// publishes readings to a shared memory ring, and the latest reading per channel to a shared memory table
+// named <name>-latest, for any number of other processes to read.
+void publishDaemon(const char *name, const vector<int> &pins) {
+  static ArSharedRing ring(name, ArSharedRing::DEFAULT_CAPACITY);
+  static ArReadingTable table(string(name) + "-latest", true);
+  static deque<ArTemperatureHumiditySignalMonitor> sources;
+  static ArSignalCombiner combiner;
+
+  for (int pin : pins) {
+    sources.emplace_back();
+    sources.back().init(pin, PinSystem::GPIO);
+
+    if (pins.size() > 1)
+      combiner.addSource(&sources.back());
+  }
+
+  auto monitor = (pins.size() > 1 ? &combiner : &sources.front());
+
+  monitor->setReadingTable(shared_ptr<ArReadingTable>(&table, [](ArReadingTable*) {}));
+  monitor->addListener([](const ArTemperatureHumiditySignalMonitor::SensorData &sd) { ring.publish(sd); });
+  cout << "Publishing readings to " << name << endl;
+}
+
+// A client of publishDaemon(), printing readings as they arrive, and attaching again whenever the
+// publisher replaces its ring.
+int readRing(const char *name) {
+  while (true) {
+    ArSharedRing ring(name);
+    ArSharedRing::Reader reader(ring, true);
+    ArTemperatureHumiditySignalMonitor::SensorData sd;
+    uint64_t lost = 0;
+    uint64_t resets = 0;
+
+    while (true) {
+      while (reader.next(sd)) {
+        printf("%lld: %c, %.1f°C, %d%%, quality %d%s\n", (long long) (sd.collectionTime / 1000), sd.channel,
+          sd.tempCelsius, sd.humidity, sd.signalQuality, sd.restored ? ", restored" : "");
+      }
+
+      if (reader.getLost() != lost) {
+        lost = reader.getLost();
+        printf("%llu readings lost\n", (unsigned long long) lost);
+      }
+
+      if (reader.getResets() != resets) {
+        resets = reader.getResets();
+        printf("Ring started over\n");
+      }
+
+      fflush(stdout);
+      this_thread::sleep_for(chrono::milliseconds(100));
+
+      if (ring.isReplaced())
+        break;
+    }
+
+    printf("Ring replaced, attaching again\n");
+
+    for (int attempt = 0; attempt < 50; ++attempt) {
+      try {
+        ArSharedRing probe(name);
+
+        if (!probe.isReplaced())
+          break;
+      }
+      catch (char const *err) {}
+
+      this_thread::sleep_for(chrono::milliseconds(100));
+    }
+  }
+
+  return 0;
+}
+
+// Prints the latest readings from the table published by publishDaemon(), as a status script would.
+int readLatest(const char *name) {
+  ArReadingTable table(name, false);
+  ArTemperatureHumiditySignalMonitor::SensorData sd;
+  int64_t now = chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+
+  for (char channel : { 'A', 'B', 'C' }) {
+    auto status = table.tryRead(channel, sd);
+
+    if (status == ArReadingTable::VALID) {
+      printf("%c: %.1f°C, %d%%, quality %d, %lld seconds ago%s\n", channel, sd.tempCelsius, sd.humidity,
+        sd.signalQuality, (long long) (now - sd.collectionTime / 1000000),
+        sd.restored ? ", restored" : "");
+    }
+    else
+      printf("%c: %s\n", channel, status == ArReadingTable::BUSY ? "busy" : "no reading");
+  }
+
+  return 0;
+}
+
+// Monitors a pin for a while, then saves the decoder trace for ar-trace-tool.
+int traceTest(int pin, int seconds, const char *path) {
+  ArTemperatureHumiditySignalMonitor monitor;
+
+  monitor.init(pin, PinSystem::GPIO);
+  this_thread::sleep_for(chrono::seconds(seconds));
+
+  string dump = monitor.dumpTrace();
+  ofstream file(path, ios::binary);
+
+  file.write(dump.data(), dump.size());
+
+  if (!file) {
+    cerr << "Could not write " << path << endl;
+    return 1;
+  }
+
+  cout << "Trace saved to " << path << endl;
+
+  return 0;
+}
+
 #if defined(WIN32) || defined(WINDOWS)
 BOOL consoleHandler(DWORD signal) {
   if (signal == CTRL_C_EVENT) {
@@ -70,13 +746,66 @@ int main(int argc, char **argv) {
     return 0;
   }
 
-  int pin = (argc == 2 && strcmp(argv[1], "-d") == 0) ? 0 : 27;
+  if (argc >= 2 && strcmp(argv[1], "-a") == 0)
+    return allocationTest(argc > 2 ? atoi(argv[2]) : 20, false);
+  else if (argc >= 2 && strcmp(argv[1], "-A") == 0) // Same, with debug output on
+    return allocationTest(argc > 2 ? atoi(argv[2]) : 20, true);
+  else if (argc >= 2 && strcmp(argv[1], "-c") == 0)
+    return listenerChurnTest(argc > 2 ? atoi(argv[2]) : 5);
+  else if (argc >= 2 && strcmp(argv[1], "-z") == 0)
+    return archiveTest(argc > 2 ? atoi(argv[2]) : 16200, argc > 3 ? argv[3] : "archive.bin");
+  else if (argc >= 2 && strcmp(argv[1], "-k") == 0)
+    return packedReadingTest(argc > 2 ? atoi(argv[2]) : 1000000);
+  else if (argc >= 2 && strcmp(argv[1], "-s") == 0)
+    return statsTest(27, argc > 2 ? atoi(argv[2]) : 20);
+  else if (argc >= 2 && strcmp(argv[1], "-w") == 0)
+    return warmStartTest(27, argc > 2 ? atoi(argv[2]) : 20, argc > 3 ? argv[3] : "monitor-state.bin");
+  else if (argc >= 2 && strcmp(argv[1], "-t") == 0)
+    return traceTest(27, argc > 2 ? atoi(argv[2]) : 20, argc > 3 ? argv[3] : "trace.bin");
+#if !defined(WIN32) && !defined(WINDOWS)
+  else if (argc >= 2 && strcmp(argv[1], "-e") == 0)
+    return eventLoopTest(argc > 2 ? atoi(argv[2]) : 20);
+#endif
+
+  else if (argc >= 2 && (strcmp(argv[1], "-R") == 0 || strcmp(argv[1], "-L") == 0)) {
+    try {
+      if (argv[1][1] == 'R')
+        return readRing(argc > 2 ? argv[2] : ArSharedRing::DEFAULT_NAME);
+      else
+        return readLatest(argc > 2 ? argv[2] : ArReadingTable::DEFAULT_NAME);
+    }
+    catch (char const *err) {
+      cerr << err << endl;
+      return 1;
+    }
+  }
+
+  if (argc >= 2 && strcmp(argv[1], "-S") == 0) {
+    vector<int> pins;
+
+    for (int i = 3; i < argc; ++i)
+      pins.push_back(atoi(argv[i]));
 
-  cout << "*** Acu-Rite temperature/humidity monitor starting *** \n\n";
-  SM = new ArTemperatureHumiditySignalMonitor();
-  SM->init(pin, PinSystem::GPIO);
-  SM->enableDebugOutput(true);
-  SM->addListener(&callback, (void *) "Got data");
+    if (pins.empty())
+      pins.push_back(27);
+
+    try {
+      publishDaemon(argc > 2 ? argv[2] : ArSharedRing::DEFAULT_NAME, pins);
+    }
+    catch (char const *err) {
+      cerr << err << endl;
+      return 1;
+    }
+  }
+  else {
+    int pin = (argc == 2 && strcmp(argv[1], "-d") == 0) ? 0 : 27;
+
+    cout << "*** Acu-Rite temperature/humidity monitor starting *** \n\n";
+    SM = new ArTemperatureHumiditySignalMonitor();
+    SM->init(pin, PinSystem::GPIO);
+    SM->enableDebugOutput(true);
+    SM->addListener(&callback, (void *) "Got data");
+  }
 
 #if defined(WIN32) || defined(WINDOWS)
   SetConsoleCtrlHandler(consoleHandler, TRUE);
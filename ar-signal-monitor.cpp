@@ -26,6 +26,10 @@
  */
 
 #include "ar-signal-monitor.h"
+#include "ar-history-store.h"
+#include "ar-log.h"
+#include "ar-packed-reading.h"
+#include "ar-reading-table.h"
 
 #include <algorithm>
 #include <chrono>
@@ -41,6 +45,13 @@
 #include <thread>
 #if defined(WIN32) || defined(WINDOWS)
 #include <Windows.h>
+#else
+#include <fcntl.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 #endif
 
 using namespace std;
@@ -59,7 +70,7 @@ static const int SHORT_SYNC_PULSE =    606;
 static const int TOLERANCE =           100;
 static const int LONG_SYNC_TOL =       450;
 
-static const int MESSAGE_BITS =       56;
+static const int MESSAGE_BITS =       ARTHSM::Frame::BIT_COUNT;
 static const int MIN_TRANSITIONS =    MESSAGE_BITS * 2;
 static const int IDEAL_TRANSITIONS =  MIN_TRANSITIONS + 2; // short sync high, long sync low
 static const int MAX_TRANSITIONS =    IDEAL_TRANSITIONS + 4; // small allowance for spurious noises
@@ -103,22 +114,17 @@ static const int SIGNAL_QUALITY_CHECK_DIVS =           9;
 static const int SIGNAL_QUALITY_WINDOW =     300'000'000; // 5 minutes
 static const int DESIRED_SIGNAL_RATE =        30'000'000; // At least one channel update every 30 seconds
 
-static const int RANK_BEST  = 10;
-static const int RANK_HIGH  =  9;
-static const int RANK_MID   =  5;
-static const int RANK_LOW   =  2;
-static const int RANK_CHECK =  0;
-
 static const struct timespec TIME_OUT = {0, 250000000}; // 250 milliseconds
 
-bool ARTHSM::initialSetupDone = false;
-int ARTHSM::nextClientCallbackIndex = 0;
-bool ARTHSM::pinInUse[32] = {false};
-int ARTHSM::pinsInUse = 0;
+static const char *DEFAULT_CHIP = "gpiochip0";
 
-static mutex dispatchLocks[32];
-static mutex queueLocks[32];
-static mutex signalLocks[32];
+const int64_t ARTHSM::holdWindow = MESSAGE_HOLD_TIME;
+
+bool ARTHSM::initialSetupDone = false;
+map<string, pair<string, int>> ARTHSM::lineLookupCache;
+mutex ARTHSM::lineLookupLock;
+set<string> ARTHSM::linesInUse;
+atomic<int> ARTHSM::nextClientCallbackIndex { 0 };
 
 static int mod(int x, int y) {
   int m = x % y;
@@ -130,41 +136,78 @@ static int mod(int x, int y) {
   return m;
 }
 
-ARTHSM::ArTemperatureHumiditySignalMonitor() {
+// The state file, in native byte order: a header, then one ChannelState for each of channels A-C.
+// Times are wall clock microseconds.
+static const uint32_t STATE_MAGIC = 0x53575241; // "ARWS"
+static const uint32_t STATE_VERSION = 1;
+
+struct StateHeader {
+  uint32_t magic;
+  uint32_t version;
+  int64_t savedAt;
+};
+
+struct ChannelState {
+  uint32_t hasReading;
+  uint32_t qualityCount;
+  ArPackedReading reading;
+  int64_t qualityTimes[64];
+  int32_t qualityRanks[64];
+};
+
+ARTHSM::ArTemperatureHumiditySignalMonitor() :
+    clientCallbacks(make_shared<const vector<ClientCallback>>()), readingTable(make_shared<ArReadingTable>()) {
+  signalHealth.setRange(ArSignalHealth::SHORT_PULSE_WIDTH, SHORT_PULSE, TOLERANCE);
+  signalHealth.setRange(ArSignalHealth::LONG_PULSE_WIDTH, LONG_PULSE, TOLERANCE);
+  signalHealth.setRange(ArSignalHealth::SYNC_PULSE_WIDTH, SHORT_SYNC_PULSE, TOLERANCE);
+  signalHealth.setRange(ArSignalHealth::FRAME_JITTER, 0, LONG_SYNC_TOL);
 #ifdef GPIOD_FAKE
   fakeGpiodInit();
 #endif
 }
 
 ARTHSM::~ArTemperatureHumiditySignalMonitor() {
+  stopQualityCheck();
+
   if (dataPin >= 0) {
     int oldPin = dataPin;
 
     dataPin = -1;
-    dispatchLocks[oldPin].lock();
-    heldDataExitSignal.set_value();
-    qualityCheckExitSignal.set_value();
-    dispatchLocks[oldPin].unlock();
 
-    queueLocks[oldPin].lock();
-    bool locked = true;
+    if (captureThread) {
+      captureThread->join();
+      delete captureThread;
+    }
 
-    if (holdThread) {
-      if (holdingRecentData) {
-        queueLocks[oldPin].unlock();
-        locked = false;
-        heldDataExitSignal.set_value();
-      }
+    if (eventChip) {
+      gpiod_chip_close(eventChip);
+      eventChip = nullptr;
+      eventLine = nullptr;
+      eventFd = -1;
+    }
+
+#ifdef GPIOD_FAKE
+    gpiod_ctxless_event_monitor(chipName.c_str(), GPIOD_CTXLESS_EVENT_BOTH_EDGES, oldPin, false, "",
+      &TIME_OUT, nullptr, nullptr, nullptr);
+#endif
 
+    // Any data still being held is sent before the hold thread exits.
+    if (externalEventLoop)
+      releaseDueData(true);
+    else if (holdThread) {
+      queueLock.lock();
+      holdThreadExit = true;
+      holdSignal.notify_one();
+      queueLock.unlock();
       holdThread->join();
       delete holdThread;
     }
 
-    if (locked)
-      queueLocks[oldPin].unlock();
-
-    pinInUse[oldPin] = false;
+    releaseLine(lineKey(chipName, oldPin));
   }
+
+  if (!stateFile.empty())
+    saveState();
 }
 
 void ARTHSM::init(int dataPin) {
@@ -172,13 +215,40 @@ void ARTHSM::init(int dataPin) {
 }
 
 void ARTHSM::init(int dataPin, PinSystem pinSys) {
-  dataPin = convertPinToGpio(dataPin, pinSys);
+  string chipName;
+  int lineOffset;
+
+  if (!lookUpGpioLine(convertPinToGpio(dataPin, pinSys), chipName, lineOffset))
+    throw "Invalid pin number";
+
+  init(chipName, lineOffset);
+}
+
+void ARTHSM::init(const string &lineName) {
+  string chipName;
+  int lineOffset;
 
-  if (dataPin < 0)
+  if (!lookUpLine(lineName, chipName, lineOffset))
+    throw "GPIO line not found";
+
+  init(chipName, lineOffset);
+}
+
+void ARTHSM::init(const string &chipName, int dataPin) {
+  if (dataPin < 0 || chipName.empty())
     throw "Invalid pin number";
 
-  if (pinInUse[dataPin])
+  string key = lineKey(chipName, dataPin);
+
+  lineLookupLock.lock();
+
+  if (linesInUse.count(key) > 0) {
+    lineLookupLock.unlock();
     throw "Pin already in use";
+  }
+
+  linesInUse.insert(key);
+  lineLookupLock.unlock();
 
   if (!initialSetupDone) {
 #if defined(WIN32) || defined(WINDOWS)
@@ -192,54 +262,512 @@ void ARTHSM::init(int dataPin, PinSystem pinSys) {
     initialSetupDone = true;
   }
 
-  ++pinsInUse;
-  pinInUse[dataPin] = true;
+#ifdef __linux__
+  if (threadOptions.lockMemory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+#else
+  if (threadOptions.lockMemory) {
+#endif
+    releaseLine(key);
+    throw "Unable to lock memory";
+  }
+
+  this->chipName = chipName;
   this->dataPin = dataPin;
 
   lastConnectionCheck = micros();
   lastSignalChange = -1;
-  establishQualityCheck();
+  restoreState();
+
+  if (externalEventLoop) {
+    eventChip = gpiod_chip_open_by_name(chipName.c_str());
+    eventLine = (eventChip ? gpiod_chip_get_line(eventChip, dataPin) : nullptr);
+
+    if (eventLine && gpiod_line_request_both_edges_events(eventLine, "") == 0)
+      eventFd = gpiod_line_event_get_fd(eventLine);
 
-  thread([this]() {
-    while (this->dataPin > 0) {
-      gpiod_ctxless_event_monitor("gpiochip0", GPIOD_CTXLESS_EVENT_BOTH_EDGES, this->dataPin, false, "",
+#if !defined(WIN32) && !defined(WINDOWS)
+    // Events are read until none are left, without waiting for more.
+    if (eventFd >= 0 && fcntl(eventFd, F_SETFL, fcntl(eventFd, F_GETFL) | O_NONBLOCK) != 0)
+      eventFd = -1;
+#endif
+
+    if (eventFd < 0) {
+      if (eventChip)
+        gpiod_chip_close(eventChip);
+
+      eventChip = nullptr;
+      eventLine = nullptr;
+      this->dataPin = -1;
+      releaseLine(key);
+      throw "Unable to request GPIO line events";
+    }
+
+    nextQualityCheck = micros() + SIGNAL_QUALITY_CHECK_RATE / SIGNAL_QUALITY_CHECK_DIVS;
+    return;
+  }
+
+  // Thread options are applied by the capture thread itself, so that any failure can be reported here.
+  promise<const char*> captureStarted;
+  auto captureResult = captureStarted.get_future();
+
+  captureThread = new thread([this, started = move(captureStarted)]() mutable {
+    const char *error = applyThreadOptions(threadOptions);
+
+    started.set_value(error);
+
+    if (error)
+      return;
+
+    while (this->dataPin >= 0) {
+      gpiod_ctxless_event_monitor(this->chipName.c_str(), GPIOD_CTXLESS_EVENT_BOTH_EDGES, this->dataPin, false, "",
         &TIME_OUT, nullptr, signalHasChanged, this);
 #ifdef GPIOD_FAKE
       break; // Simulated gpiod_ctxless_event_monitor isn't a blocking call
 #endif
     }
-  }).detach();
+  });
+
+  const char *error = captureResult.get();
+
+  if (error) {
+    this->dataPin = -1;
+    captureThread->join();
+    delete captureThread;
+    captureThread = nullptr;
+    releaseLine(key);
+    throw error;
+  }
+
+  establishQualityCheck();
+}
+
+void ARTHSM::releaseLine(const string &key) {
+  lineLookupLock.lock();
+  linesInUse.erase(key);
+  lineLookupLock.unlock();
+}
+
+void ARTHSM::setThreadOptions(const ThreadOptions &options) {
+  threadOptions = options;
+}
+
+void ARTHSM::setExternalEventLoop(bool state) {
+  if (dataPin >= 0)
+    throw "External event loop mode must be set before init()";
+
+  externalEventLoop = state;
+}
+
+int64_t ARTHSM::getTimerDeadline() {
+  lock_guard<mutex> lock(queueLock);
+
+  return holdingRecentData ? min(holdDeadline, nextQualityCheck) : nextQualityCheck;
+}
+
+int ARTHSM::getTimerTimeout() {
+  int64_t remaining = getTimerDeadline() - micros();
+
+  return remaining <= 0 ? 0 : (int) ((remaining + 999) / 1000);
+}
+
+// The same decoding the capture thread does, for edges read from the line's event fd rather than a callback.
+int ARTHSM::processEvents() {
+  gpiod_line_event event;
+  int count = 0;
+
+  while (eventFd >= 0 && gpiod_line_event_read_fd(eventFd, &event) == 0) {
+    ++count;
+    signalLock.lock();
+    signalHasChangedAux(micros(&event.ts), event.event_type == GPIOD_LINE_EVENT_RISING_EDGE ? PI_HIGH : PI_LOW);
+  }
+
+  return count;
+}
+
+// The work of the hold thread and the quality check thread, done when due.
+void ARTHSM::processTimers() {
+  int64_t now = micros();
+
+  releaseDueData(false);
+
+  if (now >= nextQualityCheck) {
+    nextQualityCheck = now + SIGNAL_QUALITY_CHECK_RATE / SIGNAL_QUALITY_CHECK_DIVS;
+    checkSignalQuality(now);
+  }
+}
+
+// Applies the given options to the calling thread. Returns nullptr on success, otherwise an error message.
+const char *ARTHSM::applyThreadOptions(const ThreadOptions &options) {
+#ifdef __linux__
+  if (options.cpu >= 0) {
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(options.cpu, &cpus);
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+      return "Unable to set CPU affinity";
+  }
+
+  if (options.realtimePriority > 0) {
+    sched_param param;
+
+    param.sched_priority = min(options.realtimePriority, sched_get_priority_max(SCHED_FIFO));
+
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+      return "Unable to set real-time priority";
+  }
+#else
+  if (options.cpu >= 0 || options.realtimePriority > 0)
+    return "Real-time priority and CPU affinity are not supported on this platform";
+#endif
+
+  return nullptr;
+}
+
+uint64_t ARTHSM::getOverrunCount() {
+  return overrunCount;
+}
+
+ARTHSM::Stats ARTHSM::getStats() {
+  Stats stats;
+  auto counter = [this](StatCounter c) { return statCounters[c].load(memory_order_relaxed); };
+
+  stats.edges = edgeCount.load(memory_order_relaxed);
+  stats.noiseEdges = counter(NOISE_EDGES);
+  stats.syncs = counter(SYNCS);
+  stats.candidateFrames = counter(CANDIDATE_FRAMES);
+  stats.badBitFrames = counter(BAD_BIT_FRAMES);
+  stats.badParityFrames = counter(BAD_PARITY_FRAMES);
+  stats.badChecksumFrames = counter(BAD_CHECKSUM_FRAMES);
+  stats.goodFrames = counter(GOOD_FRAMES);
+  stats.bitRepairs = counter(BIT_REPAIRS);
+  stats.cleanUps = counter(CLEAN_UPS);
+  stats.suppressedRepeats = counter(SUPPRESSED_REPEATS);
+  stats.dispatches = counter(DISPATCHES);
+  stats.overruns = overrunCount.load(memory_order_relaxed);
+
+  return stats;
+}
+
+ArLatencyHistogram::Snapshot ARTHSM::getLatency(LatencyStage stage) {
+  return latencies[stage].snapshot();
+}
+
+vector<ArTraceRing::Record> ARTHSM::getTrace() {
+  return trace.snapshot();
+}
+
+string ARTHSM::dumpTrace() {
+  return ArTraceRing::serialize(getTrace());
+}
+
+bool ARTHSM::getSignalHealth(char channel, ArSignalHealth::Channel &health) {
+  return signalHealth.getChannel(channel, health);
+}
+
+shared_ptr<ArReadingTable> ARTHSM::getReadingTable() {
+  lock_guard<mutex> lock(dispatchLock);
+
+  return readingTable;
+}
+
+string ARTHSM::getChipName() {
+  return chipName;
 }
 
 int ARTHSM::getDataPin() {
   return dataPin;
 }
 
+string ARTHSM::getLineKey() {
+  return lineKey(chipName, dataPin);
+}
+
+string ARTHSM::lineKey(const string &chipName, int lineOffset) {
+  return chipName + ":" + to_string(lineOffset);
+}
+
+// Raspberry Pi kernels name header lines GPIO0, GPIO1, etc., which finds the right chip on a Pi 5
+// (gpiochip4 on older kernels) as well as on earlier models. Fall back on gpiochip0 if no name is found.
+bool ARTHSM::lookUpGpioLine(int gpio, string &chipName, int &lineOffset) {
+  if (gpio < 0)
+    return false;
+  else if (!lookUpLine("GPIO" + to_string(gpio), chipName, lineOffset)) {
+    chipName = DEFAULT_CHIP;
+    lineOffset = gpio;
+  }
+
+  return true;
+}
+
+bool ARTHSM::lookUpLine(const string &lineName, string &chipName, int &lineOffset) {
+  lock_guard<mutex> lock(lineLookupLock);
+
+  if (lineLookupCache.count(lineName) == 0) {
+    char chip[32];
+    unsigned int offset;
+
+    if (gpiod_ctxless_find_line(lineName.c_str(), chip, sizeof(chip), &offset) <= 0)
+      return false;
+
+    lineLookupCache[lineName] = make_pair(string(chip), (int) offset);
+  }
+
+  auto &line = lineLookupCache[lineName];
+
+  chipName = line.first;
+  lineOffset = line.second;
+
+  return true;
+}
+
 int ARTHSM::addListener(VoidFunctionPtr callback) {
   return addListener(callback, nullptr);
 }
 
 int ARTHSM::addListener(VoidFunctionPtr callback, void *data) {
-  clientCallbacks[++nextClientCallbackIndex] = make_pair(callback, data);
+  return addListener(callback, data, ListenerFilter());
+}
+
+int ARTHSM::addListener(VoidFunctionPtr callback, void *data, const ListenerFilter &filter) {
+  return addListener([callback, data](const SensorData &sd) { callback(sd, data); }, filter);
+}
+
+int ARTHSM::addListener(const Listener &callback) {
+  return addListener(callback, ListenerFilter());
+}
+
+int ARTHSM::addListener(const Listener &callback, const ListenerFilter &filter) {
+  lock_guard<mutex> lock(listenerLock);
+  auto listeners = make_shared<vector<ClientCallback>>(*atomic_load(&clientCallbacks));
+  int id = ++nextClientCallbackIndex;
 
-  return nextClientCallbackIndex;
+  listeners->push_back(ClientCallback { id, callback, filter, make_shared<ListenerState>() });
+  atomic_store(&clientCallbacks, shared_ptr<const vector<ClientCallback>>(listeners));
+
+  return id;
 }
 
 void ARTHSM::removeListener(int listenerId) {
-  clientCallbacks.erase(listenerId);
+  listenerLock.lock();
+
+  auto listeners = make_shared<vector<ClientCallback>>(*atomic_load(&clientCallbacks));
+
+  listeners->erase(remove_if(listeners->begin(), listeners->end(),
+    [listenerId](const ClientCallback &cc) { return cc.id == listenerId; }), listeners->end());
+  atomic_store(&clientCallbacks, shared_ptr<const vector<ClientCallback>>(listeners));
+  listenerLock.unlock();
+
+  // A dispatch already in progress might still be using the old list. Unless this is being called from
+  // within that dispatch, wait for it to finish, so that the listener is never called after this returns.
+  if (dispatchThread.load() != this_thread::get_id()) {
+    dispatchLock.lock();
+    dispatchLock.unlock();
+  }
 }
 
 void ARTHSM::enableDebugOutput(bool state) {
+  lock_guard<mutex> lock(dispatchLock);
+
+  if (state && !debugLog)
+    debugLog = ArLog::defaultLog();
+
   debugOutput = state;
 }
 
+shared_ptr<ArLog> ARTHSM::getDebugLog() {
+  lock_guard<mutex> lock(dispatchLock);
+
+  return debugLog;
+}
+
+void ARTHSM::setDebugLog(const shared_ptr<ArLog> &log) {
+  lock_guard<mutex> lock(dispatchLock);
+
+  debugLog = log;
+}
+
+shared_ptr<ArHistoryStore> ARTHSM::getHistoryStore() {
+  lock_guard<mutex> lock(dispatchLock);
+
+  return historyStore;
+}
+
+void ARTHSM::setHistoryStore(const shared_ptr<ArHistoryStore> &store) {
+  lock_guard<mutex> lock(dispatchLock);
+
+  historyStore = store;
+}
+
+// The new table picks up the latest readings from the old one, which stays valid for anyone still holding it.
+void ARTHSM::setReadingTable(const shared_ptr<ArReadingTable> &table) {
+  lock_guard<mutex> lock(dispatchLock);
+  SensorData sd;
+
+  for (char channel : { 'A', 'B', 'C' }) {
+    if (readingTable->read(channel, sd))
+      table->publish(sd);
+  }
+
+  readingTable = table;
+}
+
+void ARTHSM::setStateFile(const string &path, int64_t saveInterval) {
+  lock_guard<mutex> lock(dispatchLock);
+
+  stateFile = path;
+  stateSaveInterval = saveInterval;
+}
+
+// Written to a temporary file first, then renamed, so that a crash while saving can't leave a torn file.
+bool ARTHSM::saveState() {
+  StateHeader header = { STATE_MAGIC, STATE_VERSION, wallClockMicros(micros()) };
+  ChannelState channels[3] = {};
+  string path;
+
+  static_assert(sizeof(channels[0].qualityTimes) / sizeof(int64_t) == QUALITY_HISTORY_SIZE, "ChannelState size mismatch");
+
+  dispatchLock.lock();
+  path = stateFile;
+  lastStateSave = micros();
+
+  for (int i = 0; i < 3; ++i) {
+    auto it = lastSensorData.find('A' + i);
+    QualityHistory &history = qualityTracking[i];
+
+    if (it != lastSensorData.end()) {
+      SensorData sd = it->second;
+
+      sd.collectionTime = wallClockMicros(sd.collectionTime);
+      channels[i].hasReading = 1;
+      channels[i].reading = ArPackedReading::encode(sd);
+    }
+
+    if (history.active) {
+      channels[i].qualityCount = history.count;
+
+      for (int j = 0; j < history.count; ++j) {
+        channels[i].qualityTimes[j] = wallClockMicros(history.entries[j].first);
+        channels[i].qualityRanks[j] = history.entries[j].second;
+      }
+    }
+  }
+
+  dispatchLock.unlock();
+
+  if (path.empty())
+    return false;
+
+  string tempPath = path + ".tmp";
+  FILE *file = fopen(tempPath.c_str(), "wb");
+
+  if (!file)
+    return false;
+
+  bool written = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(channels, sizeof(channels), 1, file) == 1;
+
+  written = (fclose(file) == 0 && written);
+
+#if defined(WIN32) || defined(WINDOWS)
+  remove(path.c_str());
+#endif
+
+  if (!written || rename(tempPath.c_str(), path.c_str()) != 0) {
+    remove(tempPath.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+// Readings older than REUSE_OLD_DATA_LIMIT aren't worth restoring, but quality history is kept for as
+// long as it still falls within the signal quality window.
+void ARTHSM::restoreState() {
+  StateHeader header;
+  ChannelState channels[3];
+  string path;
+
+  dispatchLock.lock();
+  path = stateFile;
+  dispatchLock.unlock();
+
+  FILE *file = (path.empty() ? nullptr : fopen(path.c_str(), "rb"));
+
+  if (!file)
+    return;
+
+  bool valid = fread(&header, sizeof(header), 1, file) == 1 && fread(channels, sizeof(channels), 1, file) == 1 &&
+    header.magic == STATE_MAGIC && header.version == STATE_VERSION;
+
+  fclose(file);
+
+  if (!valid)
+    return;
+
+  lock_guard<mutex> lock(dispatchLock);
+  int64_t now = micros();
+
+  for (int i = 0; i < 3; ++i) {
+    char channel = 'A' + i;
+    QualityHistory &history = qualityTracking[i];
+
+    if (!history.active && channels[i].qualityCount > 0) {
+      history.active = true;
+      history.count = min((int) channels[i].qualityCount, QUALITY_HISTORY_SIZE);
+
+      for (int j = 0; j < history.count; ++j)
+        history.entries[j] = { monotonicMicros(channels[i].qualityTimes[j]), channels[i].qualityRanks[j] };
+    }
+
+    if (!channels[i].hasReading || lastSensorData.count(channel) > 0)
+      continue;
+
+    SensorData sd = ArPackedReading::decode(channels[i].reading);
+
+    sd.collectionTime = monotonicMicros(sd.collectionTime);
+
+    if (sd.channel != channel || sd.collectionTime + REUSE_OLD_DATA_LIMIT < now)
+      continue;
+
+    sd.restored = true;
+    sd.signalQuality = updateSignalQuality(channel, now, RANK_CHECK);
+    lastSensorData[channel] = sd;
+    sendData(sd);
+  }
+}
+
+void ARTHSM::sendRestoredData(int listenerId) {
+  lock_guard<mutex> lock(dispatchLock);
+
+  for (auto &entry : lastSensorData) {
+    if (entry.second.restored)
+      sendData(entry.second, false, listenerId);
+  }
+}
+
+// Internal timing uses the monotonic clock, so that wall clock adjustments can't disrupt it.
 int64_t ARTHSM::micros() {
   struct timespec ts;
 
-  clock_gettime(CLOCK_REALTIME, &ts);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
   return micros(&ts);
 }
 
+int64_t ARTHSM::wallClockMicros(int64_t monotonicMicros) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return micros(&ts) - (micros() - monotonicMicros);
+}
+
+int64_t ARTHSM::monotonicMicros(int64_t wallClockMicros) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return micros() - (micros(&ts) - wallClockMicros);
+}
+
 int64_t ARTHSM::micros(const timespec* ts) {
   return (int64_t) ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
 }
@@ -303,11 +831,42 @@ int ARTHSM::getBit(int offset) {
   return -1;
 }
 
-int ARTHSM::getInt(int firstBit, int lastBit) {
+ARTHSM::Frame ARTHSM::getFrame() {
+  Frame frame;
+
+  for (int i = 0; i < MESSAGE_BITS; ++i) {
+    int bit = getBit(i);
+
+    frame.bits <<= 1;
+    frame.validBits <<= 1;
+
+    if (bit >= 0) {
+      frame.bits |= bit;
+      frame.validBits |= 1;
+    }
+  }
+
+  return frame;
+}
+
+int ARTHSM::Frame::getBit(int bit) const {
+  uint64_t mask = (uint64_t) 1 << (MESSAGE_BITS - 1 - bit);
+
+  if ((validBits & mask) == 0)
+    return -1;
+
+  return (bits & mask) != 0 ? 1 : 0;
+}
+
+char ARTHSM::Frame::getChannel() const {
+  return "?C?BA"[getInt(CHANNEL_FIRST_BIT, CHANNEL_LAST_BIT) + 1];
+}
+
+int ARTHSM::Frame::getInt(int firstBit, int lastBit) const {
   return getInt(firstBit, lastBit, false);
 }
 
-int ARTHSM::getInt(int firstBit, int lastBit, bool skipParity) {
+int ARTHSM::Frame::getInt(int firstBit, int lastBit, bool skipParity) const {
   int result = 0;
 
   for (int i = firstBit; i <= lastBit; ++i) {
@@ -324,27 +883,57 @@ int ARTHSM::getInt(int firstBit, int lastBit, bool skipParity) {
   return result;
 }
 
-int ARTHSM::signalHasChanged(int eventType, unsigned int dataPin, const timespec* tick, void *userData) {
-  if ((eventType != PI_LOW && eventType != PI_HIGH) || !pinInUse[dataPin])
-    return 0;
+int ARTHSM::Frame::validBitCount() const {
+  int count = 0;
 
-  if (userData != nullptr) {
-    if (((ARTHSM*) userData)->dataPin >= 0) {
-      signalLocks[dataPin].lock();
-      ((ARTHSM*) userData)->signalHasChangedAux(micros(tick), eventType);
-    }
+  for (uint64_t v = validBits; v != 0; v &= v - 1)
+    ++count;
+
+  return count;
+}
+
+string ARTHSM::Frame::toString() const {
+  string s;
+
+  for (int i = 0; i < MESSAGE_BITS; ++i) {
+    if (i > 0 && i % 8 == 0)
+      s += ' ';
+
+    int bit = getBit(i);
+
+    if (bit == 0)
+      s += '0';
+    else if (bit == 1)
+      s += '1';
     else
-      return GPIOD_CTXLESS_EVENT_CB_RET_STOP;
+      s += '~';
   }
 
+  return s;
+}
+
+int ARTHSM::signalHasChanged(int eventType, unsigned int dataPin, const timespec* tick, void *userData) {
+  ARTHSM *sm = (ARTHSM*) userData;
+
+  if (sm == nullptr)
+    return 0;
+  else if (sm->dataPin < 0)
+    return GPIOD_CTXLESS_EVENT_CB_RET_STOP;
+  else if (eventType != PI_LOW && eventType != PI_HIGH)
+    return 0;
+
+  sm->signalLock.lock();
+  sm->signalHasChangedAux(micros(tick), eventType);
+
   return 0;
 }
 
 void ARTHSM::signalHasChangedAux(int64_t tick, int pinState) {
-  lastConnectionCheck = micros();
-
+  // Edges always alternate, so two in a row in the same direction means one was lost.
   if (pinState == lastPinState) {
-    signalLocks[dataPin].unlock();
+    ++overrunCount;
+    trace.record(ArTraceRing::OVERRUN, micros(), 0, 0);
+    signalLock.unlock();
     return;
   }
 
@@ -358,16 +947,26 @@ void ARTHSM::signalHasChangedAux(int64_t tick, int pinState) {
   lastSignalChange = tick;
   timingIndex = (timingIndex + 1) % RING_BUFFER_SIZE;
   timings[timingIndex] = duration;
+  edgeCount.store(edgeCount.load(memory_order_relaxed) + 1, memory_order_relaxed);
 
   if (pinState == PI_HIGH) {
     int currentIndex = (timingIndex + 1) % RING_BUFFER_SIZE;
 
+    // The start of a triplet of messages can be overwritten by a burst of noise before the triplet is processed.
+    if (syncTime2 >= 0 && edgeCount.load(memory_order_relaxed) - syncEdgeCount1 + MAX_TRANSITIONS >= RING_BUFFER_SIZE) {
+      ++overrunCount;
+      trace.record(ArTraceRing::OVERRUN, micros(), 0, 1);
+      syncTime1 = syncTime2 = -1;
+    }
+
     if (syncTime2 >= 0 && tick > syncTime2 + SYNC_TO_SYNC_TIME + LONG_SYNC_TOL &&
         findStartOfTriplet() && combineMessages())
     {
       dataIndex = syncIndex2;
       dataEndIndex = currentIndex;
-      processMessage(tick, lastConnectionCheck);
+      combinedTimings = true;
+      processMessage(tick, micros());
+      combinedTimings = false;
       syncTime1 = syncTime2 = -1;
     }
 
@@ -385,7 +984,7 @@ void ARTHSM::signalHasChangedAux(int64_t tick, int pinState) {
       else if (sequentialBits == MESSAGE_BITS) {
         dataIndex = potentialDataIndex;
         dataEndIndex = mod(timingIndex + 1, RING_BUFFER_SIZE);
-        processMessage(tick, lastConnectionCheck);
+        processMessage(tick, micros());
 
         if (sequentialBits != 0) { // Failed as good data?
           --sequentialBits;
@@ -399,20 +998,27 @@ void ARTHSM::signalHasChangedAux(int64_t tick, int pinState) {
     else {
       sequentialBits = 0;
 
-      if (!isShortSync(t0, t1) && !isLongSync(t0, t1))
+      if (!isShortSync(t0, t1) && !isLongSync(t0, t1)) {
         ++badBits;
+        countStat(NOISE_EDGES);
+      }
     }
 
     int messageTime = (int) (tick - frameStartTime);
 
     if (!gotBit && isSyncAcquired()) {
+      countStat(SYNCS);
+
       if (syncTime1 < 0 || abs(tick - syncTime1 - SYNC_TO_SYNC_TIME) < LONG_SYNC_TOL) {
         syncTime1 = tick;
         syncIndex1 = currentIndex;
+        syncEdgeCount1 = edgeCount.load(memory_order_relaxed);
+        trace.record(ArTraceRing::SYNC, micros(), 0, 1, 0, tick);
       }
       else {
         syncTime2 = tick;
         syncIndex2 = currentIndex;
+        trace.record(ArTraceRing::SYNC, micros(), 0, 2, 0, tick);
       }
 
       int changeCount = mod(currentIndex - dataIndex, RING_BUFFER_SIZE);
@@ -421,7 +1027,7 @@ void ARTHSM::signalHasChangedAux(int64_t tick, int pinState) {
           MIN_TRANSITIONS <= changeCount && changeCount <= MAX_TRANSITIONS &&
           MIN_MESSAGE_LENGTH <= messageTime && messageTime <= MAX_MESSAGE_LENGTH) {
         dataEndIndex = currentIndex;
-        processMessage(tick, lastConnectionCheck);
+        processMessage(tick, micros());
       }
 
       dataIndex = currentIndex;
@@ -432,32 +1038,12 @@ void ARTHSM::signalHasChangedAux(int64_t tick, int pinState) {
              messageTime > MIN_MESSAGE_LENGTH + SHORT_SYNC_PULSE &&
              messageTime < MAX_MESSAGE_LENGTH) {
       dataEndIndex = timingIndex;
-      processMessage(tick, lastConnectionCheck);
+      processMessage(tick, micros());
       dataIndex = -1;
     }
   }
 
-  signalLocks[dataPin].unlock();
-}
-
-string ARTHSM::getBitsAsString() {
-  string s;
-
-  for (int i = 0; i < 56; ++i) {
-    if (i > 0 && i % 8 == 0)
-      s += ' ';
-
-    int bit = getBit(i);
-
-    if (bit == 0)
-      s += '0';
-    else if (bit == 1)
-      s += '1';
-    else
-      s += '~';
-  }
-
-  return s;
+  signalLock.unlock();
 }
 
 string getTimestamp() {
@@ -479,227 +1065,353 @@ void ARTHSM::processMessage(int64_t frameEndTime, int64_t clockTime) {
 }
 
 void ARTHSM::processMessage(int64_t frameEndTime, int64_t clockTime, int attempt) {
-  auto integrity = checkDataIntegrity();
-  char channel = "?C?BA"[getInt(CHANNEL_FIRST_BIT, CHANNEL_LAST_BIT) + 1];
-  string allBits = (debugOutput ? getBitsAsString() + " (" + to_string(frameEndTime - frameStartTime) + u8"µs)" : "");
-#if defined(SHOW_RAW_DATA) || defined(SHOW_MARGINAL_DATA)
-#define TIMES_ARRAY_ARG , changeCount, times
-  int changeCount = mod(dataEndIndex - dataIndex, RING_BUFFER_SIZE);
-  int times[changeCount];
-
-  for (int i = 0; i < changeCount; ++i)
-    times[i] = timings[(dataIndex + i) % RING_BUFFER_SIZE];
-#else
-#define TIMES_ARRAY_ARG /* empty */
-#endif
+  Frame frame = getFrame();
+  auto integrity = checkDataIntegrity(frame);
+  char channel = frame.getChannel();
+  DebugFrame debugFrame;
+
+  debugFrame.frame = frame;
+  debugFrame.duration = frameEndTime - frameStartTime;
+  debugFrame.cleanedUp = (attempt > 0);
+
+  if (attempt == 0)
+    countStat(CANDIDATE_FRAMES);
 
   if (integrity > BAD_PARITY) {
     sequentialBits = 0;
+    countStat((StatCounter) (BAD_BIT_FRAMES + integrity));
+    trace.record(ArTraceRing::FRAME, clockTime, channel, integrity, attempt, frame.bits);
+
+    if (attempt > 0)
+      countStat(CLEAN_UPS);
+    else if (integrity == GOOD && !combinedTimings)
+      recordSignalHealth(channel, frameEndTime);
 
-    SensorData sd;
+    SensorData sd = decodeFrame(frame, integrity);
 
-    sd.channel = channel;
-    sd.validChecksum = (integrity == GOOD);
-    sd.batteryLow = getBit(BATTERY_LOW_BIT);
-    sd.miscData1 = getInt(MISC_DATA_1_FIRST_BIT, MISC_DATA_1_LAST_BIT);
-    sd.miscData2 = getInt(MISC_DATA_2_FIRST_BIT, MISC_DATA_2_LAST_BIT);
-    sd.miscData3 = getInt(MISC_DATA_3_FIRST_BIT, MISC_DATA_3_LAST_BIT);
     sd.collectionTime = clockTime;
-    sd.repeatsCaptured = 1;
 
-    int rawHumidity = getInt(HUMIDITY_FIRST_BIT, HUMIDITY_LAST_BIT);
-    sd.humidity = rawHumidity > 100 ? -999 : rawHumidity;
+    if (frameSink)
+      frameSink->receiveCandidateFrame(frame, integrity, clockTime);
+
+    enqueueSensorData(sd, debugFrame);
+    dataIndex = -1;
+    badBits = 0;
+  }
+  else if (attempt == 0 && tryToCleanUpSignal())
+    processMessage(frameEndTime, clockTime, 1);
+  else {
+    countStat((StatCounter) (BAD_BIT_FRAMES + integrity));
+    trace.record(ArTraceRing::FRAME, clockTime, channel, integrity, attempt, frame.bits);
+
+    // Even a damaged frame can contribute to a bit-by-bit vote across multiple receivers.
+    if (frameSink && frame.validBitCount() >= MESSAGE_BITS - MAX_BAD_BITS)
+      frameSink->receiveCandidateFrame(frame, integrity, clockTime);
 
-    sd.rawTemp = getInt(TEMPERATURE_FIRST_BIT, TEMPERATURE_LAST_BIT, true);
-    sd.tempCelsius = (sd.rawTemp - 1000) / 10.0;
+    if (debugOutput) {
+      if (debugLog)
+        debugLog->logCorruptFrame(debugFrame.frame, debugFrame.duration, debugFrame.candidates, debugFrame.cleanedUp);
+    }
+    else if (integrity == BAD_PARITY) {
+      SensorData sd;
 
-    if (abs(sd.tempCelsius) > 60)
-      sd.tempCelsius = -999;
+      sd.channel = channel;
+      sd.rank = RANK_LOW;
+      sd.collectionTime = clockTime;
+      enqueueSensorData(sd, debugFrame);
+    }
+  }
+}
 
-    sd.tempFahrenheit = (sd.tempCelsius == -999 ? -999 :
-      round((sd.tempCelsius * 1.8 + 32.0) * 10.0) / 10.0);
+// Must be called with signalLock held, for a frame decoded from measured (not cleaned up) timings.
+void ARTHSM::recordSignalHealth(char channel, int64_t frameEndTime) {
+  int channelIndex = channel - 'A';
+  int dataTimings[MESSAGE_BITS * 2];
+  int syncTimings[8];
+  bool syncFound = true;
+  ArSignalHealth::FrameTimings frameTimings;
 
-    sd.rank = sd.validChecksum && sd.humidity != -999 && sd.rawTemp != -999 ? RANK_HIGH : RANK_MID;
+  if (channelIndex < 0 || channelIndex >= 3)
+    return;
 
-    if (attempt > 1)
-      allBits += "*";
+  for (int i = 0; i < MESSAGE_BITS * 2; ++i)
+    dataTimings[i] = timings[mod(dataIndex + i, RING_BUFFER_SIZE)];
 
-    enqueueSensorData(sd, allBits);
-    dataIndex = -1;
-    badBits = 0;
+  frameTimings.dataTimings = dataTimings;
+  frameTimings.dataTimingCount = MESSAGE_BITS * 2;
 
-#ifdef SHOW_RAW_DATA
-    if (debugOutput) {
-      thread([this, channel TIMES_ARRAY_ARG] {
-        cout << channel << " - raw timing data:" << endl;
-        for (int i = 0; i < changeCount; i += 2) {
-          printf("%*d:%*d,%*d", 2, i / 2, 4, times[i], 4, times[i + 1]);
-          printf(i == 120 || (i + 2) % 8 == 0 ? "\n" : "   ");
-        }
-      }.detach();
-    }
-#endif
+  // Frames can also be found without a sync, so sync widths only count when all eight are there.
+  for (int i = 0; i < 8; ++i) {
+    syncTimings[i] = timings[mod(dataIndex - 8 + i, RING_BUFFER_SIZE)];
+    syncFound &= (abs(syncTimings[i] - SHORT_SYNC_PULSE) < TOLERANCE);
   }
-  else if (attempt == 0 && tryToCleanUpSignal())
-    processMessage(frameEndTime, clockTime, 1);
-  else if (debugOutput) {
-    thread([allBits TIMES_ARRAY_ARG] {
-#ifdef SHOW_MARGINAL_DATA
-      int b = 0;
-      int tt = 0;
-      for (int i = 0; i < changeCount; ++i) {
-        int t = times[i];
-        if (tt == 0)
-          printf("%*d:", 2, b);
-        printf(" %d", t);
-        tt += t;
-        if (tt > 550) {
-          ++b;
-          tt = 0;
-          printf("\n");
-        }
-        else if (i == changeCount - 1)
-          printf("\n");
-      }
-#endif
-#ifdef SHOW_CORRUPT_DATA
-      cout << allBits << endl << getTimestamp() << ": Corrupted data\n";
-#endif
-    }).detach();
+
+  if (syncFound) {
+    frameTimings.syncTimings = syncTimings;
+    frameTimings.syncTimingCount = 8;
   }
-  else if (integrity == BAD_PARITY) {
-    SensorData sd;
 
-    sd.channel = channel;
+  int64_t dataStart = frameEndTime;
+
+  for (int i = dataIndex; i != mod(timingIndex + 1, RING_BUFFER_SIZE); i = (i + 1) % RING_BUFFER_SIZE)
+    dataStart -= timings[i];
+
+  int64_t interval = dataStart - lastFrameStart[channelIndex];
+
+  if (lastFrameStart[channelIndex] >= 0 && abs(interval - SYNC_TO_SYNC_TIME) < LONG_SYNC_TOL) {
+    frameTimings.hasJitter = true;
+    frameTimings.jitter = (int) (interval - SYNC_TO_SYNC_TIME);
+  }
+
+  lastFrameStart[channelIndex] = dataStart;
+  signalHealth.recordFrame(channel, frameTimings);
+}
+
+void ARTHSM::receiveCandidateFrame(const Frame &frame, DataIntegrity integrity, int64_t clockTime) {
+}
+
+int64_t ARTHSM::lastActivityTime() {
+  return lastConnectionCheck;
+}
+
+ARTHSM::SensorData ARTHSM::decodeFrame(const Frame &frame, DataIntegrity integrity) {
+  SensorData sd;
+
+  sd.channel = frame.getChannel();
+
+  if (integrity < BAD_CHECKSUM) {
     sd.rank = RANK_LOW;
-    sd.collectionTime = clockTime;
-    enqueueSensorData(sd, allBits);
+    return sd;
   }
+
+  sd.validChecksum = (integrity == GOOD);
+  sd.batteryLow = frame.getBit(BATTERY_LOW_BIT);
+  sd.miscData1 = frame.getInt(MISC_DATA_1_FIRST_BIT, MISC_DATA_1_LAST_BIT);
+  sd.miscData2 = frame.getInt(MISC_DATA_2_FIRST_BIT, MISC_DATA_2_LAST_BIT);
+  sd.miscData3 = frame.getInt(MISC_DATA_3_FIRST_BIT, MISC_DATA_3_LAST_BIT);
+  sd.repeatsCaptured = 1;
+
+  int rawHumidity = frame.getInt(HUMIDITY_FIRST_BIT, HUMIDITY_LAST_BIT);
+  sd.humidity = rawHumidity > 100 ? -999 : rawHumidity;
+
+  sd.rawTemp = frame.getInt(TEMPERATURE_FIRST_BIT, TEMPERATURE_LAST_BIT, true);
+  sd.tempCelsius = (sd.rawTemp - 1000) / 10.0;
+
+  if (abs(sd.tempCelsius) > 60)
+    sd.tempCelsius = -999;
+
+  sd.tempFahrenheit = (sd.tempCelsius == -999 ? -999 :
+    round((sd.tempCelsius * 1.8 + 32.0) * 10.0) / 10.0);
+
+  sd.rank = sd.validChecksum && sd.humidity != -999 && sd.rawTemp != -999 ? RANK_HIGH : RANK_MID;
+
+  return sd;
 }
 
-void ARTHSM::enqueueSensorData(SensorData sd, string bitString) {
+void ARTHSM::enqueueSensorData(const SensorData &sd, const DebugFrame &debugFrame) {
   if (sd.channel == '?')
     return;
 
-  queueLocks[dataPin].lock();
+  queueLock.lock();
 
-  bool holdNewData = false;
+  // Data for a different channel means the data being held is complete, so send it on right away.
+  if (holdingRecentData && sd.channel != heldData.channel) {
+    SensorData sdOut;
+    DebugFrame debugFrameOut;
+    bool send = releaseHeldData(sdOut, debugFrameOut);
 
-  if (holdingRecentData) {
-    if (sd.channel != heldData.channel) {
-      heldDataExitSignal.set_value();
-      queueLocks[dataPin].unlock();
+    queueLock.unlock();
 
-      if (holdThread->joinable())
-        holdThread->join();
+    if (send)
+      dispatchData(sdOut, debugFrameOut);
 
-      queueLocks[dataPin].lock();
-      delete holdThread;
-      holdThread = nullptr;
-      holdNewData = true;
-    }
-    else {
-      if (sd.rank > heldData.rank) {
-        sd.repeatsCaptured = heldData.repeatsCaptured;
-        heldData = sd;
-        heldBits = bitString;
-      }
-      else if (sd.rank >= RANK_HIGH && heldData.rank >= RANK_HIGH && sd.hasSameValues(heldData))
-        heldData.rank = RANK_BEST;
-
-      ++heldData.repeatsCaptured;
-    }
+    queueLock.lock();
   }
-  else
-    holdNewData = true;
 
-  if (holdNewData) {
-    if (holdThread) {
-      if (holdThread->joinable())
-        holdThread->join();
+  if (holdingRecentData) {
+    if (sd.rank > heldData.rank) {
+      int repeatsCaptured = heldData.repeatsCaptured;
 
-      delete holdThread;
+      heldData = sd;
+      heldData.repeatsCaptured = repeatsCaptured;
+      heldFrame = debugFrame;
     }
+    else if (sd.rank >= RANK_HIGH && heldData.rank >= RANK_HIGH && sd.hasSameValues(heldData))
+      heldData.rank = RANK_BEST;
 
+    ++heldData.repeatsCaptured;
+    trace.record(ArTraceRing::HOLD_UPDATE, sd.collectionTime, sd.channel, heldData.rank, heldData.repeatsCaptured);
+  }
+  else {
     heldData = sd;
-    heldBits = bitString;
+    heldFrame = debugFrame;
     holdingRecentData = true;
-
-    heldDataExitSignal = promise<void>();
-    heldDataControl = heldDataExitSignal.get_future();
-    holdThread = new thread([this]() {
-      heldDataControl.wait_for(chrono::microseconds(MESSAGE_HOLD_TIME));
-      queueLocks[dataPin].lock();
-      holdingRecentData = false;
-      heldData.signalQuality = updateSignalQuality(heldData.channel, heldData.collectionTime,
-        heldData.rank);
-
-      if (heldData.rank >= RANK_MID && heldData.repeatsCaptured > 0) {
-        SensorData sdCopy = heldData;
-        string bitsCopy = heldBits;
-
-        queueLocks[dataPin].unlock();
-        dispatchData(sdCopy, bitsCopy);
-      }
-      else
-        queueLocks[dataPin].unlock();
-    });
+    holdDeadline = micros() + MESSAGE_HOLD_TIME;
+    trace.record(ArTraceRing::HOLD_START, sd.collectionTime, sd.channel, sd.rank, sd.repeatsCaptured);
+
+    // One hold thread lives as long as the monitor, rather than a new thread for every message.
+    // An external event loop releases it with processTimers() instead.
+    if (holdThread)
+      holdSignal.notify_one();
+    else if (!externalEventLoop)
+      holdThread = new thread([this]() { holdLoop(); });
   }
 
-  queueLocks[dataPin].unlock();
+  queueLock.unlock();
 }
 
-void ARTHSM::dispatchData(SensorData sd, string allBits) {
-  dispatchLocks[dataPin].lock();
+void ARTHSM::holdLoop() {
+  applyThreadOptions(threadOptions);
 
-  if (debugOutput) {
-    cout << allBits << endl << getTimestamp();
-    printf("%c ch. %c, %d%%, %.1fC (%d raw), %.1fF, battery %s, %d/%d\n",
-      sd.validChecksum ? ':' : '~', sd.channel,
-      sd.humidity, sd.tempCelsius, sd.rawTemp, sd.tempFahrenheit,
-      sd.batteryLow ? "LOW" : "good",
-      sd.repeatsCaptured,
-      sd.signalQuality);
+  unique_lock<mutex> lock(queueLock);
+
+  while (!holdThreadExit || holdingRecentData) {
+    int64_t now = micros();
+
+    if (!holdingRecentData)
+      holdSignal.wait(lock);
+    else if (now < holdDeadline && !holdThreadExit)
+      holdSignal.wait_for(lock, chrono::microseconds(holdDeadline - now));
+    else {
+      SensorData sd;
+      DebugFrame debugFrame;
+      bool send = releaseHeldData(sd, debugFrame);
+
+      lock.unlock();
+
+      if (send)
+        dispatchData(sd, debugFrame);
+
+      lock.lock();
+    }
   }
+}
+
+// Sends on the data being held, if its hold time is up, or regardless if forced.
+void ARTHSM::releaseDueData(bool force) {
+  SensorData sd;
+  DebugFrame debugFrame;
+  bool send = false;
+
+  queueLock.lock();
+
+  if (holdingRecentData && (force || micros() >= holdDeadline))
+    send = releaseHeldData(sd, debugFrame);
+
+  queueLock.unlock();
+
+  if (send)
+    dispatchData(sd, debugFrame);
+}
+
+// Must be called with queueLock held.
+bool ARTHSM::releaseHeldData(SensorData &sd, DebugFrame &debugFrame) {
+  holdingRecentData = false;
+  heldData.signalQuality = updateSignalQuality(heldData.channel, heldData.collectionTime, heldData.rank);
+  sd = heldData;
+  debugFrame = heldFrame;
+
+  bool send = heldData.rank >= RANK_MID && heldData.repeatsCaptured > 0;
+
+  trace.record(ArTraceRing::HOLD_RELEASE, micros(), sd.channel, sd.rank, sd.repeatsCaptured, send);
+
+  return send;
+}
+
+void ARTHSM::dispatchData(const SensorData &sd, const DebugFrame &debugFrame) {
+  int64_t lockRequested = micros();
+
+  recordLatency(HOLD_WAIT, lockRequested - sd.collectionTime);
+  dispatchLock.lock();
+  recordLatency(DISPATCH_LOCK_WAIT, micros() - lockRequested);
+
+  // Only raw fields are copied here. Formatting and output happen on the log's own thread.
+  if (debugOutput && debugLog)
+    debugLog->logReading(sd, debugFrame.frame, debugFrame.duration, debugFrame.candidates, debugFrame.cleanedUp);
 
   int channelActive = lastSensorData.count(sd.channel) > 0;
   bool doCallback = channelActive || sd.validChecksum;
   bool cacheNewData = doCallback;
+  ArTraceRing::DispatchOutcome outcome = ArTraceRing::SENT;
 
   if (channelActive) {
-    const SensorData lastData = lastSensorData[sd.channel];
+    const SensorData &lastData = lastSensorData[sd.channel];
 
-    if (sd.collectionTime < lastData.collectionTime + REPEAT_SUPPRESSION &&
-        sd.hasSameValues(lastData))
+    if (!lastData.restored && sd.collectionTime < lastData.collectionTime + REPEAT_SUPPRESSION &&
+        sd.hasSameValues(lastData)) {
       doCallback = cacheNewData = false;
+      countStat(SUPPRESSED_REPEATS);
+      outcome = ArTraceRing::SUPPRESSED_REPEAT;
+    }
 
     if (!sd.validChecksum && lastData.validChecksum) {
       cacheNewData = false;
 
       if (sd.collectionTime < lastData.collectionTime + REUSE_OLD_DATA_LIMIT &&
-          sd.hasCloseValues(lastData))
+          sd.hasCloseValues(lastData)) {
         doCallback = false;
+        outcome = ArTraceRing::SUPPRESSED_INVALID;
+      }
     }
-    else if (sd.validChecksum && !lastData.validChecksum)
+    else if (sd.validChecksum && !lastData.validChecksum) {
       doCallback = cacheNewData = true;
+      outcome = ArTraceRing::SENT;
+    }
   }
 
-  if (doCallback)
+  if (!doCallback && outcome == ArTraceRing::SENT)
+    outcome = ArTraceRing::SUPPRESSED_INVALID;
+
+  trace.record(ArTraceRing::DISPATCH, lockRequested, sd.channel, outcome, sd.signalQuality);
+
+  if (doCallback) {
+    countStat(DISPATCHES);
     sendData(sd);
+  }
 
   if (cacheNewData)
     lastSensorData[sd.channel] = sd;
 
-  dispatchLocks[dataPin].unlock();
+  dispatchLock.unlock();
 }
 
-void ARTHSM::sendData(const SensorData &sd) {
-  auto iterator = clientCallbacks.begin();
+// Until this point collectionTime is monotonic, and is only converted to wall clock time when data is sent out.
+// A listenerId sends to that listener alone, for catching it up on readings other listeners already have.
+void ARTHSM::sendData(const SensorData &sd, bool qualityOnly, int listenerId) {
+  SensorData sdOut = sd;
+  auto listeners = atomic_load(&clientCallbacks);
+  int channelIndex = sd.channel - 'A';
+  bool trackChannel = (channelIndex >= 0 && channelIndex < 3);
+
+  sdOut.collectionTime = wallClockMicros(sd.collectionTime);
+
+  if (listenerId == 0)
+    readingTable->publish(sdOut);
+
+  if (historyStore && !qualityOnly && !sd.restored && listenerId == 0)
+    historyStore->append(sdOut);
+
+  // Filters are applied here, on the dispatching thread, so rejected readings never cross to another thread.
+  dispatchThread = this_thread::get_id();
+
+  for (auto &cc : *listeners) {
+    if (listenerId != 0 && cc.id != listenerId)
+      continue;
+
+    SensorData *lastPassed = (trackChannel ? &cc.state->lastPassed[channelIndex] : nullptr);
+
+    if (cc.filter.passes(sd, qualityOnly, lastPassed)) {
+      if (lastPassed && !qualityOnly)
+        *lastPassed = sd;
 
-  while (iterator != clientCallbacks.end()) {
-    iterator->second.first(sd, iterator->second.second);
-    ++iterator;
+      int64_t callStart = micros();
+
+      cc.callback(sdOut);
+      recordLatency(LISTENER_EXECUTION, micros() - callStart);
+    }
   }
+
+  dispatchThread = thread::id();
 }
 
 bool ARTHSM::tryToCleanUpSignal() {
@@ -716,6 +1428,7 @@ bool ARTHSM::combineMessages(int count, int *msgIndices) {
   const int totalSubBits = MESSAGE_BITS * 3;
   double subBits[totalSubBits];
   int badBit = -1;
+  int repairedBit = 0;
   int checksum1 = 0;
   int checksum2 = 0;
 
@@ -808,8 +1521,14 @@ bool ARTHSM::combineMessages(int count, int *msgIndices) {
       if (checksum1 == checksum2) { // bad bit is 1
         setTiming(badBit * 2, LONG_PULSE);
         setTiming(badBit * 2 + 1, SHORT_PULSE);
+        repairedBit = 1;
       }
     }
+
+    if (checksum1 == checksum2) {
+      countStat(BIT_REPAIRS);
+      trace.record(ArTraceRing::BIT_REPAIR, micros(), 0, badBit, 0, repairedBit);
+    }
   }
 
   return (checksum1 == checksum2 && badBit >= -1);
@@ -839,59 +1558,60 @@ bool ARTHSM::findStartOfTriplet() {
 }
 
 int ARTHSM::updateSignalQuality(char channel, int64_t time, int rank) {
-  if (channel == '?')
-    return 0;
-
-  vector<TimeAndQuality> recents;
-  bool channelActive = false;
+  int channelIndex = channel - 'A';
 
-  if (qualityTracking.count(channel) > 0) {
-    channelActive = true;
-    recents = qualityTracking[channel];
+  if (channelIndex < 0 || channelIndex >= 3)
+    return 0;
 
-    // Purge old data
-    auto it = recents.begin();
+  QualityHistory &history = qualityTracking[channelIndex];
+  TimeAndQuality recents[QUALITY_HISTORY_SIZE];
+  int count = 0;
 
-    while (it != recents.end()) {
-      if (it->first + SIGNAL_QUALITY_WINDOW < time)
-        it = recents.erase(it);
-      else
-        ++it;
+  // Purge old data
+  if (history.active) {
+    for (int i = 0; i < history.count; ++i) {
+      if (history.entries[i].first + SIGNAL_QUALITY_WINDOW >= time)
+        recents[count++] = history.entries[i];
     }
   }
 
-  if (rank != RANK_CHECK)
-    recents.push_back({ time, rank });
+  if (rank != RANK_CHECK) {
+    // If the history is somehow full, the oldest entry makes room.
+    if (count == QUALITY_HISTORY_SIZE) {
+      copy(recents + 1, recents + count, recents);
+      --count;
+    }
 
-  if (channelActive || rank >= RANK_HIGH) // Only track low-quality data for an active channel
-    qualityTracking[channel] = recents;
+    recents[count++] = { time, rank };
+  }
+
+  if (history.active || rank >= RANK_HIGH) { // Only track low-quality data for an active channel
+    history.active = true;
+    history.count = count;
+    copy(recents, recents + count, history.entries);
+  }
 
-  auto it = recents.begin();
   int total = 0;
 
-  while (it != recents.end()) {
-    total += it->second;
-    ++it;
-  }
+  for (int i = 0; i < count; ++i)
+    total += recents[i].second;
 
-  int desiredTotal = max((int) (SIGNAL_QUALITY_WINDOW / DESIRED_SIGNAL_RATE), (int) recents.size()) * RANK_BEST;
+  int desiredTotal = max((int) (SIGNAL_QUALITY_WINDOW / DESIRED_SIGNAL_RATE), count) * RANK_BEST;
 
   return min((int) round(total * 100.0 / desiredTotal), 100);
 }
 
-ARTHSM::DataIntegrity ARTHSM::checkDataIntegrity() {
-  for (int bit = 0; bit < 56; ++bit) {
-    if (getBit(bit) < 0)
-      return BAD_BITS;
-  }
+ARTHSM::DataIntegrity ARTHSM::checkDataIntegrity(const Frame &frame) {
+  if (frame.validBitCount() < MESSAGE_BITS)
+    return BAD_BITS;
 
   // Check parity on the middle three bytes
   for (int byte = 3; byte <= 5; ++byte) {
-    int parity = getBit(byte * 8);
+    int parity = frame.getBit(byte * 8);
     int sum = 0;
 
     for (int bitIndex = 1; bitIndex <= 7; ++bitIndex)
-      sum += getBit(byte * 8 + bitIndex);
+      sum += frame.getBit(byte * 8 + bitIndex);
 
     if (sum % 2 != parity)
       return BAD_PARITY;
@@ -901,75 +1621,111 @@ ARTHSM::DataIntegrity ARTHSM::checkDataIntegrity() {
   int checksum = 0;
 
   for (int byte = 0; byte <= 5; ++ byte)
-    checksum += getInt(byte * 8, byte * 8 + 7);
+    checksum += frame.getInt(byte * 8, byte * 8 + 7);
 
-  return (checksum & 0xFF) == getInt(CHECKSUM_FIRST_BIT, CHECKSUM_LAST_BIT) ? GOOD : BAD_CHECKSUM;
+  return (checksum & 0xFF) == frame.getInt(CHECKSUM_FIRST_BIT, CHECKSUM_LAST_BIT) ? GOOD : BAD_CHECKSUM;
 }
 
 void ARTHSM::establishQualityCheck() {
   qualityCheckLoopControl = qualityCheckExitSignal.get_future();
 
-  thread([this]() {
-    int divCount = 0;
-
+  qualityCheckThread = new thread([this]() {
     while (qualityCheckLoopControl.wait_for(
            chrono::microseconds(SIGNAL_QUALITY_CHECK_RATE / SIGNAL_QUALITY_CHECK_DIVS)) ==
-           future_status::timeout) {
-      int64_t now = micros();
-
-      if (lastConnectionCheck + DEAD_AIR_LIMIT < now) {
-        ARTHSM *sm = this;
-
-        lastConnectionCheck = now;
-        thread([sm]() {
-          dispatchLocks[sm->dataPin].lock();
-          SensorData sd;
-          sd.channel = '-';
-          sm->sendData(sd);
-          dispatchLocks[sm->dataPin].unlock();
-        }).detach();
-      }
+           future_status::timeout)
+      checkSignalQuality(micros());
+  });
+}
 
-      if (++divCount < SIGNAL_QUALITY_CHECK_DIVS)
-        continue;
+// Called by destructors, before the state file, the listeners, or anything a subclass overrides is gone.
+void ARTHSM::stopQualityCheck() {
+  if (qualityCheckThread) {
+    qualityCheckExitSignal.set_value();
+    qualityCheckThread->join();
+    delete qualityCheckThread;
+    qualityCheckThread = nullptr;
+  }
+}
 
-      divCount = 0;
-      dispatchLocks[dataPin].lock();
+// Readings found here are sent from threads of their own, except in external event loop mode, where they're
+// sent right away, from the caller's thread.
+void ARTHSM::checkSignalQuality(int64_t now) {
+  uint64_t edges = edgeCount.load(memory_order_relaxed);
 
-      auto it = lastSensorData.begin();
+  // Edges are only counted as they arrive, with the time of the last activity noted here at a coarser scale.
+  if (edges != lastEdgeCount) {
+    lastEdgeCount = edges;
+    lastConnectionCheck = now;
+  }
 
-      while (it != lastSensorData.end()) {
-        auto sd = it->second;
+  if (max(lastActivityTime(), lastDeadAirReport) + DEAD_AIR_LIMIT < now) {
+    ARTHSM *sm = this;
+    auto sendDeadAir = [sm, now]() {
+      sm->dispatchLock.lock();
+      SensorData sd;
+      sd.channel = '-';
+      sd.collectionTime = now;
+      sm->sendData(sd);
+      sm->dispatchLock.unlock();
+    };
+
+    lastDeadAirReport = now;
+
+    if (externalEventLoop)
+      sendDeadAir();
+    else
+      thread(sendDeadAir).detach();
+  }
 
-        if (sd.collectionTime + SIGNAL_QUALITY_CHECK_RATE < now) {
-          int prevQuality = sd.signalQuality;
-          sd.signalQuality = updateSignalQuality(sd.channel, now, RANK_CHECK);
+  dispatchLock.lock();
+  bool saveDue = !stateFile.empty() && now - lastStateSave >= stateSaveInterval;
+  dispatchLock.unlock();
 
-          if (sd.signalQuality != prevQuality) {
-            ARTHSM *sm = this;
-            SensorData sdCopy = sd;
+  if (saveDue)
+    saveState();
 
-            thread([sm, sdCopy]() {
-              dispatchLocks[sm->dataPin].lock();
-              sm->sendData(sdCopy);
-              dispatchLocks[sm->dataPin].unlock();
-            }).detach();
-          }
-        }
+  if (++qualityCheckDivCount < SIGNAL_QUALITY_CHECK_DIVS)
+    return;
+
+  qualityCheckDivCount = 0;
+  dispatchLock.lock();
+
+  auto it = lastSensorData.begin();
+
+  while (it != lastSensorData.end()) {
+    auto sd = it->second;
 
-        // Only send quality 0 once, then act as if the channel doesn't exist until signal is received again.
-        if (sd.signalQuality == 0) {
-          it = lastSensorData.erase(it);
-          lastSensorData.erase(sd.channel);
-          qualityTracking.erase(sd.channel);
+    if (sd.collectionTime + SIGNAL_QUALITY_CHECK_RATE < now) {
+      int prevQuality = sd.signalQuality;
+      sd.signalQuality = updateSignalQuality(sd.channel, now, RANK_CHECK);
+
+      if (sd.signalQuality != prevQuality) {
+        if (externalEventLoop)
+          sendData(sd, true);
+        else {
+          ARTHSM *sm = this;
+          SensorData sdCopy = sd;
+
+          thread([sm, sdCopy]() {
+            sm->dispatchLock.lock();
+            sm->sendData(sdCopy, true);
+            sm->dispatchLock.unlock();
+          }).detach();
         }
-        else
-          ++it;
       }
+    }
 
-      dispatchLocks[dataPin].unlock();
+    // Only send quality 0 once, then act as if the channel doesn't exist until signal is received again.
+    if (sd.signalQuality == 0) {
+      it = lastSensorData.erase(it);
+      lastSensorData.erase(sd.channel);
+      qualityTracking[sd.channel - 'A'] = QualityHistory();
     }
-  }).detach();
+    else
+      ++it;
+  }
+
+  dispatchLock.unlock();
 }
 
 bool ARTHSM::SensorData::hasSameValues(const SensorData &sd) const {
@@ -987,3 +1743,45 @@ bool ARTHSM::SensorData::hasCloseValues(const SensorData &sd) const {
          abs(humidity - sd.humidity) < 3 &&
          abs(rawTemp - sd.rawTemp) < 30;
 }
+
+bool ARTHSM::ListenerFilter::passes(const SensorData &sd, bool qualityOnly, const SensorData *lastPassed) const {
+  if (sd.channel == '-')
+    return includeDeadAir;
+  else if (qualityOnly && !includeQualityOnly)
+    return false;
+  else if (!channels.empty() && channels.find(sd.channel) == string::npos)
+    return false;
+  else if (!sensorIds.empty() && find(sensorIds.begin(), sensorIds.end(), sd.miscData1) == sensorIds.end())
+    return false;
+  else if (qualityOnly || !lastPassed || lastPassed->channel != sd.channel)
+    return true;
+
+  if (sd.collectionTime < lastPassed->collectionTime + minInterval)
+    return false;
+
+  if (minTempDelta <= 0 && minHumidityDelta <= 0)
+    return true;
+
+  // Any change in a value which was previously unknown counts as a big enough change.
+  bool tempChanged = minTempDelta > 0 && (sd.tempCelsius == -999 || lastPassed->tempCelsius == -999 ?
+    sd.tempCelsius != lastPassed->tempCelsius : abs(sd.tempCelsius - lastPassed->tempCelsius) >= minTempDelta - 1E-9);
+  bool humidityChanged = minHumidityDelta > 0 && (sd.humidity == -999 || lastPassed->humidity == -999 ?
+    sd.humidity != lastPassed->humidity : abs(sd.humidity - lastPassed->humidity) >= minHumidityDelta);
+
+  return tempChanged || humidityChanged || sd.batteryLow != lastPassed->batteryLow;
+}
+
+string ARTHSM::DebugFrame::toString() const {
+  string s = frame.toString();
+
+  if (duration >= 0)
+    s += " (" + to_string(duration) + u8"µs)";
+
+  if (cleanedUp)
+    s += "*";
+
+  if (candidates > 0)
+    s += " (" + to_string(candidates) + " candidates)";
+
+  return s;
+}
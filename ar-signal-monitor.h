@@ -1,13 +1,23 @@
 #ifndef AR_TEMPERATURE_HUMIDITY_SIGNAL_MONITOR
 #define AR_TEMPERATURE_HUMIDITY_SIGNAL_MONITOR
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <future>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include "ar-latency-histogram.h"
+#include "ar-signal-health.h"
+#include "ar-trace-ring.h"
+
 #if defined(USE_FAKE_GPIOD) || defined(__APPLE__) || defined(WIN32) || defined(WINDOWS)
 #include "gpiod-fake.h"
 #else
@@ -19,26 +29,30 @@ namespace std { // No, I don't want to indent everything inside this.
 
 static const int RING_BUFFER_SIZE = 512;
 
-#undef SHOW_RAW_DATA
-#undef SHOW_MARGINAL_DATA
-#undef SHOW_CORRUPT_DATA
-
 #define PI_LOW  GPIOD_CTXLESS_EVENT_CB_FALLING_EDGE
 #define PI_HIGH GPIOD_CTXLESS_EVENT_CB_RISING_EDGE
 
+class ArHistoryStore;
+class ArLog;
+class ArReadingTable;
+class ArSignalCombiner;
+
 class ArTemperatureHumiditySignalMonitor {
+  friend class ArSignalCombiner;
+
   public:
     class SensorData {
       public:
         bool batteryLow = false;
         char channel = '?';
-        int64_t collectionTime = 0;
+        int64_t collectionTime = 0; // Wall clock microseconds
         int humidity = -999;
         int miscData1 = 0;
         int miscData2 = 0;
         int miscData3 = 0;
         int rawTemp = -999;
         int rank = 0;
+        bool restored = false; // Reloaded from the state file after a restart, rather than newly received
         int repeatsCaptured = 0;
         int signalQuality = 0;
         double tempCelsius = -999;
@@ -49,93 +63,298 @@ class ArTemperatureHumiditySignalMonitor {
         bool hasCloseValues(const SensorData &sd) const;
     };
 
-  private:
+    class Stats {
+      public:
+        uint64_t edges = 0;             // Signal edges received
+        uint64_t noiseEdges = 0;        // Edges which were neither part of a data bit nor a sync pulse
+        uint64_t syncs = 0;             // Sync pulses detected
+        uint64_t candidateFrames = 0;   // Possible frames checked by the decoder
+        uint64_t badBitFrames = 0;      // ...which had missing or unreadable bits
+        uint64_t badParityFrames = 0;   // ...which failed a parity check
+        uint64_t badChecksumFrames = 0; // ...which failed the checksum
+        uint64_t goodFrames = 0;        // ...which were fully valid
+        uint64_t bitRepairs = 0;        // Single bad bits repaired when combining repeated messages
+        uint64_t cleanUps = 0;          // Frames recovered by cleaning up a noisy signal
+        uint64_t suppressedRepeats = 0; // Readings not sent because they repeated a recent reading
+        uint64_t dispatches = 0;        // Readings sent to listeners
+        uint64_t overruns = 0;          // See getOverrunCount()
+    };
+
+    // Stages of the trip a reading takes from the decoder to a listener, each timed in microseconds.
+    enum LatencyStage {
+      HOLD_WAIT,          // Decoding until release from the hold for repeated messages
+      DISPATCH_LOCK_WAIT, // Waiting to acquire the dispatch lock
+      LISTENER_EXECUTION, // Running each listener
+      TSFN_QUEUEING,      // Waiting in a Node listener's queue for the JavaScript thread
+      LATENCY_STAGE_COUNT
+    };
+
+    class ThreadOptions {
+      public:
+        int cpu = -1;              // CPU to pin the capture and decode threads to, if >= 0
+        bool lockMemory = false;   // Lock all process memory with mlockall
+        int realtimePriority = 0;  // SCHED_FIFO priority for the capture and decode threads, if > 0
+    };
+
+    // Restricts the readings passed to a listener. By default, everything is passed.
+    class ListenerFilter {
+      public:
+        string channels;                 // Channels to pass, such as "AB", or empty for all channels
+        vector<int> sensorIds;           // Sensor IDs (miscData1) to pass, or empty for all sensors
+        double minTempDelta = 0;         // Minimum change in °C since the last reading passed for a channel
+        int minHumidityDelta = 0;        // Minimum change in humidity since the last reading passed for a channel
+        int64_t minInterval = 0;         // Minimum microseconds between readings passed for a channel
+        bool includeDeadAir = true;      // Pass dead air reports (channel '-')
+        bool includeQualityOnly = true;  // Pass updates where only signal quality has changed
+
+        bool passes(const SensorData &sd, bool qualityOnly, const SensorData *lastPassed) const;
+    };
+
+    // The 56 bits of a transmission, with bit 0 of the transmission as the most significant bit.
+    class Frame {
+      public:
+        static const int BIT_COUNT = 56;
+
+        uint64_t bits = 0;
+        uint64_t validBits = 0; // Bits which were cleanly decoded
+
+        int getBit(int bit) const;
+        char getChannel() const;
+        int getInt(int firstBit, int lastBit) const;
+        int getInt(int firstBit, int lastBit, bool skipParity) const;
+        int validBitCount() const;
+        string toString() const;
+    };
+
+    typedef function<void(const SensorData &sensorData)> Listener;
+
+    static const int DEFAULT_STATE_SAVE_INTERVAL = 60'000'000; // 1 minute, in microseconds
+
+  protected:
+    static const int QUALITY_HISTORY_SIZE = 64;
+    static const int RANK_BEST  = 10;
+    static const int RANK_HIGH  =  9;
+    static const int RANK_MID   =  5;
+    static const int RANK_LOW   =  2;
+    static const int RANK_CHECK =  0;
+
     static bool initialSetupDone;
-    static int nextClientCallbackIndex;
-    static bool pinInUse[];
-    static int pinsInUse;
+    static map<string, pair<string, int>> lineLookupCache;
+    static mutex lineLookupLock;
+    static set<string> linesInUse;
+    static atomic<int> nextClientCallbackIndex;
 
     enum DataIntegrity { BAD_BITS, BAD_PARITY, BAD_CHECKSUM, GOOD };
 
+    // Frame outcomes must stay in DataIntegrity order.
+    enum StatCounter { NOISE_EDGES, SYNCS, CANDIDATE_FRAMES, BAD_BIT_FRAMES, BAD_PARITY_FRAMES, BAD_CHECKSUM_FRAMES,
+                       GOOD_FRAMES, BIT_REPAIRS, CLEAN_UPS, SUPPRESSED_REPEATS, DISPATCHES, STAT_COUNTER_COUNT };
+
     typedef void (*VoidFunctionPtr)(SensorData sensorData, void *miscData);
     typedef void *VoidPtr;
-    typedef pair<VoidFunctionPtr, VoidPtr> ClientCallback;
+
+    // Everything needed to describe a frame in debug output, so that the description is only built when it's shown.
+    class DebugFrame {
+      public:
+        Frame frame;
+        int64_t duration = -1;  // Microseconds, if known
+        int candidates = 0;     // Number of frames combined, if any
+        bool cleanedUp = false; // Decoded after cleaning up the signal
+
+        string toString() const;
+    };
+
+    // Only touched by the thread holding dispatchLock.
+    class ListenerState {
+      public:
+        SensorData lastPassed[3]; // Channels A-C
+    };
+
+    class ClientCallback {
+      public:
+        int id;
+        Listener callback;
+        ListenerFilter filter;
+        shared_ptr<ListenerState> state;
+    };
+
     typedef pair<int64_t, int> TimeAndQuality;
 
+    class QualityHistory {
+      public:
+        bool active = false;
+        int count = 0;
+        TimeAndQuality entries[QUALITY_HISTORY_SIZE];
+    };
+
     int badBits = 0;
     int baseIndex = 0;
     int64_t baseTime = -1;
-    map<int, ClientCallback> clientCallbacks;
+    thread *captureThread = nullptr;
+    string chipName;
+    bool combinedTimings = false; // Timings have been rebuilt from several messages, so aren't measurements
+    // Never modified once published. Listener changes swap in a new copy, so dispatch never waits on them.
+    shared_ptr<const vector<ClientCallback>> clientCallbacks;
+    int64_t lastDeadAirReport = 0;
     int dataEndIndex = 0;
     int dataIndex = -1;
     int dataPin = -1;
+    shared_ptr<ArLog> debugLog;
     bool debugOutput = false;
+    mutex dispatchLock;
+    atomic<thread::id> dispatchThread;
+    atomic<uint64_t> edgeCount { 0 };
+    gpiod_chip *eventChip = nullptr; // Only in external event loop mode, as are the event line and fd
+    int eventFd = -1;
+    gpiod_line *eventLine = nullptr;
+    bool externalEventLoop = false;
+    ArTemperatureHumiditySignalMonitor *frameSink = nullptr;
     int64_t frameStartTime = 0;
     SensorData heldData;
-    string heldBits;
-    future<void> heldDataControl;
-    promise<void> heldDataExitSignal;
+    DebugFrame heldFrame;
+    int64_t holdDeadline = 0;
     bool holdingRecentData = false;
+    condition_variable holdSignal;
     thread *holdThread = nullptr;
+    bool holdThreadExit = false;
     int64_t lastConnectionCheck = 0;
+    uint64_t lastEdgeCount = 0;
     map<char, SensorData> lastSensorData;
     int lastPinState = -1;
 
+    shared_ptr<ArHistoryStore> historyStore;
+    int64_t lastFrameStart[3] = { -1, -1, -1 }; // Edge time of the start of the last good frame's data, A-C
     int64_t lastSignalChange = 0;
+    ArLatencyHistogram latencies[LATENCY_STAGE_COUNT];
+    mutex listenerLock;
+    int64_t lastStateSave = 0;
+    int64_t nextQualityCheck = 0;
     int potentialDataIndex = 0;
+    int qualityCheckDivCount = 0;
     promise<void> qualityCheckExitSignal;
     future<void> qualityCheckLoopControl;
-    map<char, vector<TimeAndQuality>> qualityTracking;
+    thread *qualityCheckThread = nullptr;
+    atomic<uint64_t> overrunCount { 0 };
+    atomic<uint64_t> statCounters[STAT_COUNTER_COUNT] = {};
+    QualityHistory qualityTracking[3]; // Channels A-C
+    mutex queueLock;
+    shared_ptr<ArReadingTable> readingTable;
     int sequentialBits = 0;
+    string stateFile;
+    int64_t stateSaveInterval = DEFAULT_STATE_SAVE_INTERVAL;
+    ArSignalHealth signalHealth;
+    mutex signalLock;
     int syncIndex1 = 0;
     int syncIndex2 = 0;
+    uint64_t syncEdgeCount1 = 0;
     int64_t syncTime1 = -1;
     int64_t syncTime2 = -1;
+    ThreadOptions threadOptions;
     int timingIndex = -1;
     int timings[RING_BUFFER_SIZE] = {0};
+    ArTraceRing trace;
 
   public:
     ArTemperatureHumiditySignalMonitor();
-    ~ArTemperatureHumiditySignalMonitor();
+    virtual ~ArTemperatureHumiditySignalMonitor();
     void init(int dataPin);
     void init(int dataPin, PinSystem pinSys);
+    void init(const string &lineName);
+    void init(const string &chipName, int lineOffset);
 
     int addListener(VoidFunctionPtr callback);
     int addListener(VoidFunctionPtr callback, void *data);
+    int addListener(VoidFunctionPtr callback, void *data, const ListenerFilter &filter);
+    int addListener(const Listener &callback);
+    int addListener(const Listener &callback, const ListenerFilter &filter);
+    string getChipName();
     int getDataPin();
-    void enableDebugOutput(bool state);
+    string getLineKey();
+    virtual uint64_t getOverrunCount();
+    virtual Stats getStats();
+    shared_ptr<ArHistoryStore> getHistoryStore();
+    ArLatencyHistogram::Snapshot getLatency(LatencyStage stage);
+    shared_ptr<ArReadingTable> getReadingTable();
+    virtual bool getSignalHealth(char channel, ArSignalHealth::Channel &health);
+    virtual vector<ArTraceRing::Record> getTrace();
+    string dumpTrace(); // Binary, in the format described in ar-trace-ring.h
+    void enableDebugOutput(bool state); // Uses ArLog::defaultLog() unless another log has been set
+    shared_ptr<ArLog> getDebugLog();
+    void setDebugLog(const shared_ptr<ArLog> &log);
+    void setHistoryStore(const shared_ptr<ArHistoryStore> &store); // Dispatched readings are appended, if set
+    void setReadingTable(const shared_ptr<ArReadingTable> &table); // Such as one in shared memory
+    void recordLatency(LatencyStage stage, int64_t micros) { latencies[stage].record(micros); }
     void removeListener(int listenerId);
+    // Reloads the state file, if any, and sends its readings, flagged as restored, to listeners. init() calls
+    // this, so a state file should be set before init(). A combiner, having no init(), needs it called directly.
+    void restoreState();
+    bool saveState(); // The latest reading and signal quality history of each channel
+    void sendRestoredData(int listenerId); // Restored readings not yet replaced by new ones, to one listener
+    void setStateFile(const string &path, int64_t saveInterval = DEFAULT_STATE_SAVE_INTERVAL);
+    void setThreadOptions(const ThreadOptions &options);
+
+    // Rather than starting threads of its own, a monitor can be driven by the caller's event loop. Call
+    // setExternalEventLoop(true) before init(), then, all from one thread, call processEvents() whenever
+    // getEventFd() is readable, and processTimers() whenever getTimerDeadline() has passed. The kernel only
+    // queues a few edges, so the fd should be serviced promptly. Thread options other than lockMemory don't
+    // apply, and listeners are called from the caller's thread.
+    void setExternalEventLoop(bool state);
+    int getEventFd() const { return eventFd; }
+    int64_t getTimerDeadline(); // CLOCK_MONOTONIC microseconds
+    int getTimerTimeout();      // Milliseconds until getTimerDeadline(), rounded up, as a poll() timeout
+    int processEvents();        // Decodes every signal edge waiting to be read, returning how many there were
+    void processTimers();       // Releases readings held for repeated messages, and checks signal quality
+
+    static string lineKey(const string &chipName, int lineOffset);
+    static bool lookUpGpioLine(int gpio, string &chipName, int &lineOffset);
+    static bool lookUpLine(const string &lineName, string &chipName, int &lineOffset);
     int static signalHasChanged(int eventType, unsigned int dataPin, const timespec* tick, void *userData);
 
-  private:
-    DataIntegrity checkDataIntegrity();
+  protected:
+    static const int64_t holdWindow;
+
     bool combineMessages();
     bool combineMessages(int count, int *msgIndices);
-    void dispatchData(SensorData sd, std::string allBits);
-    void enqueueSensorData(SensorData sd, std::string bitString);
+    void dispatchData(const SensorData &sd, const DebugFrame &debugFrame);
+    void enqueueSensorData(const SensorData &sd, const DebugFrame &debugFrame);
+    void checkSignalQuality(int64_t now);
     void establishQualityCheck();
     bool findStartOfTriplet();
     int getBit(int offset);
-    string getBitsAsString();
-    int getInt(int firstBit, int lastBit);
-    int getInt(int firstBit, int lastBit, bool skipParity);
+    Frame getFrame();
     int getTiming(int offset);
     bool isSyncAcquired();
+    virtual int64_t lastActivityTime();
+    void holdLoop();
+    void countStat(StatCounter counter) { statCounters[counter].fetch_add(1, memory_order_relaxed); }
     void processMessage(int64_t frameEndTime, int64_t clockTime);
     void processMessage(int64_t frameEndTime, int64_t clockTime, int attempt);
-    void sendData(const SensorData &sd);
+    void recordSignalHealth(char channel, int64_t frameEndTime);
+    virtual void receiveCandidateFrame(const Frame &frame, DataIntegrity integrity, int64_t clockTime);
+    void sendData(const SensorData &sd, bool qualityOnly = false, int listenerId = 0);
     void setTiming(int offset, int value);
     void signalHasChangedAux(int64_t now, int pinState);
+    void stopQualityCheck();
     bool tryToCleanUpSignal();
     int updateSignalQuality(char channel, int64_t time, int rank);
 
+    bool releaseHeldData(SensorData &sd, DebugFrame &debugFrame);
+    void releaseDueData(bool force);
+    void releaseLine(const string &key);
+
+    static const char *applyThreadOptions(const ThreadOptions &options);
+    static DataIntegrity checkDataIntegrity(const Frame &frame);
+    static SensorData decodeFrame(const Frame &frame, DataIntegrity integrity);
     static int64_t micros();
     static int64_t micros(const timespec* ts);
+    static int64_t monotonicMicros(int64_t wallClockMicros);
+    static int64_t wallClockMicros(int64_t monotonicMicros);
     static bool isZeroBit(int t0, int t1);
     static bool isOneBit(int t0, int t1);
     static bool isShortSync(int t0, int t1);
     static bool isLongSync(int t0, int t1);
 };
 
-#endif
 }
+
+#endif
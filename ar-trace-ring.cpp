@@ -0,0 +1,158 @@
+/*
+ * ar-trace-ring.cpp
+ *
+ * Copyright 2020-2025 Kerry Shetline <kerry@shetline.com>
+ *
+ * MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "ar-trace-ring.h"
+
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+static_assert(sizeof(ArTraceRing::Record) == 24, "Trace records must stay 24 bytes");
+
+static const char *EVENT_NAMES[] = { "sync", "frame", "bit repair", "hold start", "hold update", "hold release",
+  "dispatch", "combine", "overrun" };
+static const char *INTEGRITY_NAMES[] = { "bad bits", "bad parity", "bad checksum", "good" }; // DataIntegrity order
+static const char *DISPATCH_NAMES[] = { "sent", "suppressed repeat", "suppressed invalid" };
+
+void ArTraceRing::record(Event event, int64_t time, char channel, int detail, int count, uint64_t value) {
+  uint64_t index = head.fetch_add(1, memory_order_relaxed);
+  Slot &slot = slots[index % CAPACITY];
+
+  slot.sequence.store(index * 2 + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  slot.time.store(time, memory_order_relaxed);
+  slot.value.store(value, memory_order_relaxed);
+  slot.packed.store((uint64_t) event | (uint64_t) (uint8_t) channel << 8 | (uint64_t) (uint8_t) detail << 16 |
+    (uint64_t) (uint32_t) count << 32, memory_order_relaxed);
+  slot.sequence.store(index * 2 + 2, memory_order_release);
+}
+
+// Events being written while the snapshot is taken, or overwritten during it, are left out.
+vector<ArTraceRing::Record> ArTraceRing::snapshot() const {
+  vector<Record> records;
+  uint64_t end = head.load(memory_order_acquire);
+  uint64_t start = (end > CAPACITY ? end - CAPACITY : 0);
+
+  records.reserve(end - start);
+
+  for (uint64_t index = start; index < end; ++index) {
+    const Slot &slot = slots[index % CAPACITY];
+    uint64_t sequence = slot.sequence.load(memory_order_acquire);
+    Record record;
+
+    record.time = slot.time.load(memory_order_relaxed);
+    record.value = slot.value.load(memory_order_relaxed);
+
+    uint64_t packed = slot.packed.load(memory_order_relaxed);
+
+    atomic_thread_fence(memory_order_acquire);
+
+    if (sequence != index * 2 + 2 || slot.sequence.load(memory_order_relaxed) != sequence)
+      continue;
+
+    record.event = (uint8_t) packed;
+    record.source = 0;
+    record.channel = (char) (packed >> 8);
+    record.detail = (uint8_t) (packed >> 16);
+    record.count = (int32_t) (packed >> 32);
+    records.push_back(record);
+  }
+
+  return records;
+}
+
+const char *ArTraceRing::eventName(int event) {
+  return (event >= 0 && event < EVENT_COUNT ? EVENT_NAMES[event] : "unknown");
+}
+
+string ArTraceRing::describe(const Record &record) {
+  char buf[128];
+  char channel = (record.channel ? record.channel : '?');
+  int detail = record.detail;
+
+  switch (record.event) {
+    case SYNC:
+      snprintf(buf, sizeof(buf), "sync %d at edge time %llu", detail, (unsigned long long) record.value);
+      break;
+    case FRAME:
+    case COMBINE:
+      snprintf(buf, sizeof(buf), "%s %c: %s, %s %d, bits %014llX", eventName(record.event), channel,
+        detail < 4 ? INTEGRITY_NAMES[detail] : "?", record.event == FRAME ? "attempt" : "candidates", record.count,
+        (unsigned long long) record.value);
+      break;
+    case BIT_REPAIR:
+      snprintf(buf, sizeof(buf), "bit repair: bit %d set to %d", detail, (int) record.value);
+      break;
+    case HOLD_START:
+    case HOLD_UPDATE:
+    case HOLD_RELEASE:
+      snprintf(buf, sizeof(buf), "%s %c: rank %d, repeats %d%s", eventName(record.event), channel,
+        detail, record.count, record.event != HOLD_RELEASE ? "" : record.value ? ", sent" : ", dropped");
+      break;
+    case DISPATCH:
+      snprintf(buf, sizeof(buf), "dispatch %c: %s, quality %d", channel,
+        detail < 3 ? DISPATCH_NAMES[detail] : "?", record.count);
+      break;
+    case OVERRUN:
+      snprintf(buf, sizeof(buf), "overrun: %s", detail == 0 ? "lost edge" : "timing buffer wrapped");
+      break;
+    default:
+      snprintf(buf, sizeof(buf), "event %d, channel %c, detail %d, count %d, value %llu", record.event, channel,
+        detail, record.count, (unsigned long long) record.value);
+  }
+
+  return buf;
+}
+
+string ArTraceRing::serialize(const vector<Record> &records) {
+  uint32_t header[] = { MAGIC, VERSION, RECORD_SIZE, (uint32_t) records.size() };
+  string dump(sizeof(header) + records.size() * RECORD_SIZE, '\0');
+
+  memcpy(&dump[0], header, sizeof(header));
+
+  if (!records.empty())
+    memcpy(&dump[sizeof(header)], records.data(), records.size() * RECORD_SIZE);
+
+  return dump;
+}
+
+bool ArTraceRing::parse(const string &dump, vector<Record> &records) {
+  uint32_t header[4];
+
+  if (dump.size() < sizeof(header))
+    return false;
+
+  memcpy(header, dump.data(), sizeof(header));
+
+  if (header[0] != MAGIC || header[1] != VERSION || header[2] != RECORD_SIZE ||
+      dump.size() < sizeof(header) + (size_t) header[3] * RECORD_SIZE)
+    return false;
+
+  records.resize(header[3]);
+
+  if (header[3] > 0)
+    memcpy(records.data(), dump.data() + sizeof(header), header[3] * RECORD_SIZE);
+
+  return true;
+}
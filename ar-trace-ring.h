@@ -0,0 +1,75 @@
+#ifndef AR_TRACE_RING
+#define AR_TRACE_RING
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace std {
+
+// An always-on, fixed-size record of decoder decisions, for diagnosing field problems without a debug
+// build. Recording an event is a handful of relaxed atomic stores, and any number of threads may record
+// at once. When the ring is full the oldest events are overwritten.
+//
+// A dump, as produced by serialize(), is a 16-byte header (MAGIC, VERSION, RECORD_SIZE, record count,
+// as 32-bit words in host byte order) followed by the records, oldest first. ar-trace-tool prints dumps.
+class ArTraceRing {
+  public:
+    static const int CAPACITY = 2048;
+    static const uint32_t MAGIC = 0x52545241; // "ARTR"
+    static const uint32_t VERSION = 1;
+
+    enum Event : uint8_t {
+      SYNC,         // detail: 1 for the first sync of a message pair, 2 for the second; value: edge time
+      FRAME,        // detail: data integrity; count: clean-up attempt; value: frame bits
+      BIT_REPAIR,   // detail: bit position; value: repaired bit
+      HOLD_START,   // detail: rank; count: repeats captured
+      HOLD_UPDATE,  // detail: rank; count: repeats captured
+      HOLD_RELEASE, // detail: rank; count: repeats captured; value: 1 if sent on for dispatch
+      DISPATCH,     // detail: DispatchOutcome; count: signal quality
+      COMBINE,      // detail: data integrity; count: candidates; value: voted frame bits
+      OVERRUN,      // detail: 0 for a lost edge, 1 for a timing buffer wrap
+      EVENT_COUNT
+    };
+
+    enum DispatchOutcome { SENT, SUPPRESSED_REPEAT, SUPPRESSED_INVALID };
+
+    class Record {
+      public:
+        int64_t time;    // Monotonic microseconds
+        uint64_t value;
+        uint8_t event;
+        uint8_t source;  // 0 for the monitor itself, otherwise a combiner source, counting from 1
+        char channel;    // 0 if not applicable
+        uint8_t detail;
+        int32_t count;
+    };
+
+    static const uint32_t RECORD_SIZE = sizeof(Record);
+
+  private:
+    class Slot {
+      public:
+        atomic<uint64_t> sequence { 0 }; // Odd while being written
+        atomic<int64_t> time { 0 };
+        atomic<uint64_t> value { 0 };
+        atomic<uint64_t> packed { 0 };   // event, channel, detail, and count
+    };
+
+    atomic<uint64_t> head { 0 };
+    Slot slots[CAPACITY];
+
+  public:
+    void record(Event event, int64_t time, char channel = 0, int detail = 0, int count = 0, uint64_t value = 0);
+    vector<Record> snapshot() const;
+
+    static string describe(const Record &record);
+    static const char *eventName(int event);
+    static bool parse(const string &dump, vector<Record> &records);
+    static string serialize(const vector<Record> &records);
+};
+
+}
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * ar-trace-tool.cpp
+ *
+ * Copyright 2020-2025 Kerry Shetline <kerry@shetline.com>
+ *
+ * MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Prints a decoder trace dump, as saved from dumpTrace(). Build with:
+//
+//   g++ -std=c++14 -O2 ar-trace-tool.cpp ar-trace-ring.cpp -o ar-trace-tool
+
+#include "ar-trace-ring.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    cerr << "Usage: ar-trace-tool <trace-dump-file>\n";
+    return 1;
+  }
+
+  ifstream file(argv[1], ios::binary);
+  stringstream contents;
+  vector<ArTraceRing::Record> records;
+
+  contents << file.rdbuf();
+
+  if (!file || !ArTraceRing::parse(contents.str(), records)) {
+    cerr << "Not a valid trace dump: " << argv[1] << endl;
+    return 1;
+  }
+
+  int64_t start = (records.empty() ? 0 : records.front().time);
+
+  for (auto &record : records) {
+    printf("%12.3f ms  ", (record.time - start) / 1000.0);
+
+    if (record.source > 0)
+      printf("[%d] ", record.source);
+
+    printf("%s\n", ArTraceRing::describe(record).c_str());
+  }
+
+  printf("%d events\n", (int) records.size());
+
+  return 0;
+}
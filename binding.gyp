@@ -7,9 +7,29 @@
       'cflags': ['-Wall', '-Wno-psabi', '-std=c++14', '-pthread'],
       'cflags_cc': ['-Wall', '-Wno-psabi', '-pthread'],
       'sources': [
+        'ar-archive.cpp',
+        'ar-archive.h',
+        'ar-history-store.cpp',
+        'ar-history-store.h',
+        'ar-latency-histogram.cpp',
+        'ar-latency-histogram.h',
+        'ar-log.cpp',
+        'ar-log.h',
+        'ar-packed-reading.cpp',
+        'ar-packed-reading.h',
+        'ar-reading-table.cpp',
+        'ar-reading-table.h',
+        'ar-shared-ring.cpp',
+        'ar-shared-ring.h',
+        'ar-signal-combiner.cpp',
+        'ar-signal-combiner.h',
+        'ar-signal-health.cpp',
+        'ar-signal-health.h',
         'ar-signal-monitor-node.cpp',
         'ar-signal-monitor.cpp',
         'ar-signal-monitor.h',
+        'ar-trace-ring.cpp',
+        'ar-trace-ring.h',
         'gpiod-fake.cpp',
         'gpiod-fake.h',
         'pin-conversions.cpp',
@@ -28,7 +48,7 @@
       'libraries': [
         '-lgpiod'
       ],
-      'defines': ['NAPI_CPP_EXCEPTIONS'],
+      'defines': ['NAPI_CPP_EXCEPTIONS', 'NAPI_VERSION=6'],
       'conditions': [
         ['OS=="mac"', {
           'defines': ['USE_FAKE_GPIOD'],
@@ -47,6 +67,7 @@
         }],
         ['OS=="linux"', {
           'defines': ['<!(node fake-gpiod-check.js)'],
+          'libraries': ['-lrt'],
           'libraries!': ['<!(node fake-gpiod-check.js -l)']
         }]
       ],
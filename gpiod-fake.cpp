@@ -2,7 +2,11 @@
 
 #include <algorithm>
 #include <chrono>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <mutex>
+#include <string>
 #include <thread>
 #include <vector>
 #include <iostream>
@@ -11,6 +15,9 @@
 #include <Windows.h>
 #include <sync hapi.h>
 static int pgfPendingMicros = 0;
+#else
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
 #ifndef PI_LOW
@@ -36,12 +43,28 @@ static int pgfLastHumidity[] = { 50, 40, 30 };
 static int pgfLastTemp[] = { 1020, 1120, 1220 };
 
 typedef struct {
+  string device;
   unsigned int pin;
   gpiod_ctxless_event_handle_cb callback;
   void *miscData;
 } PGF_PinAlert;
 
+// Lines requested for events are fed through a pipe, standing in for the kernel's line event file.
+struct gpiod_line {
+  struct gpiod_chip *chip;
+  unsigned int offset;
+  int readFd;
+  int writeFd;
+};
+
+struct gpiod_chip {
+  string name;
+  vector<gpiod_line*> lines;
+};
+
 static vector<PGF_PinAlert> pgfCallbacks;
+static mutex pgfCallbacksLock;
+static vector<gpiod_line*> pgfRequestedLines;
 
 static void pgfMicroSleep(int micros) {
 #if defined(WIN32) || defined(WINDOWS)
@@ -78,10 +101,22 @@ static void pgfSendPulse(int duration) {
   ts.tv_sec = pgfCurrMicros / 1000000;
   ts.tv_nsec = pgfCurrMicros * 1000 % 1000000000;
 
-  for (auto pcb : pgfCallbacks) {
+  lock_guard<mutex> lock(pgfCallbacksLock);
+
+  for (auto &pcb : pgfCallbacks) {
     if (pcb.pin != 0)
       pcb.callback(pgfPinHigh ? PI_LOW : PI_HIGH, pcb.pin, &ts, pcb.miscData);
   }
+
+#if !defined(WIN32) && !defined(WINDOWS)
+  gpiod_line_event event { ts, pgfPinHigh ? GPIOD_LINE_EVENT_FALLING_EDGE : GPIOD_LINE_EVENT_RISING_EDGE };
+
+  // Like the kernel, events are dropped if the reader falls too far behind.
+  for (auto line : pgfRequestedLines) {
+    if (line->offset != 0 && write(line->writeFd, &event, sizeof(event)) < 0)
+      continue;
+  }
+#endif
 }
 
 static void pgfSendByte(int b) {
@@ -160,12 +195,39 @@ static void pgfSendSignals() {
   }).detach();
 }
 
+// Must be called with pgfCallbacksLock held.
+static void pgfUpdateRunning() {
+  bool active = !pgfCallbacks.empty() || !pgfRequestedLines.empty();
+
+  if (!pgfRunning && active) {
+    pgfRunning = true;
+    pgfSendSignals();
+  }
+  else if (pgfRunning && !active)
+    pgfRunning = false;
+}
+
+
+// Simulates a Raspberry Pi header chip, where lines are named GPIO0, GPIO1, etc.
+int gpiod_ctxless_find_line(const char *name, char *chipname, size_t chipname_size, unsigned int *offset) {
+  unsigned int gpio;
+  char extra;
+
+  if (sscanf(name, "GPIO%u%c", &gpio, &extra) != 1)
+    return 0;
+
+  snprintf(chipname, chipname_size, "gpiochip0");
+  *offset = gpio;
+
+  return 1;
+}
 
 int gpiod_ctxless_event_monitor(const char* device, int event_type, unsigned int dataPin, bool active_low,
     const char* consumer, const timespec* timeout, gpiod_ctxless_event_poll_cb poll_cb,
     gpiod_ctxless_event_handle_cb event_cb, void* miscData) {
+  lock_guard<mutex> lock(pgfCallbacksLock);
   auto match = find_if(pgfCallbacks.begin(), pgfCallbacks.end(),
-    [dataPin](PGF_PinAlert pcb) { return pcb.pin == dataPin; });
+    [device, dataPin](const PGF_PinAlert &pcb) { return pcb.pin == dataPin && pcb.device == device; });
 
   if (event_cb == nullptr) {
     if (match != pgfCallbacks.end())
@@ -175,16 +237,82 @@ int gpiod_ctxless_event_monitor(const char* device, int event_type, unsigned int
     throw "Pin callback already in use";
 
   if (event_cb != nullptr)
-    pgfCallbacks.push_back(PGF_PinAlert { dataPin, event_cb, miscData });
+    pgfCallbacks.push_back(PGF_PinAlert { device, dataPin, event_cb, miscData });
 
-  if (!pgfRunning && pgfCallbacks.size() > 0) {
-    pgfRunning = true;
-    pgfSendSignals();
+  pgfUpdateRunning();
+
+  return 0;
+}
+
+struct gpiod_chip *gpiod_chip_open_by_name(const char *name) {
+  return new gpiod_chip { name, {} };
+}
+
+void gpiod_chip_close(struct gpiod_chip *chip) {
+  for (auto line : chip->lines) {
+    gpiod_line_release(line);
+    delete line;
   }
-  else if (pgfRunning && pgfCallbacks.size() == 0)
-    pgfRunning = false;
+
+  delete chip;
+}
+
+struct gpiod_line *gpiod_chip_get_line(struct gpiod_chip *chip, unsigned int offset) {
+  for (auto line : chip->lines) {
+    if (line->offset == offset)
+      return line;
+  }
+
+  chip->lines.push_back(new gpiod_line { chip, offset, -1, -1 });
+
+  return chip->lines.back();
+}
+
+int gpiod_line_request_both_edges_events(struct gpiod_line *line, const char *consumer) {
+#if defined(WIN32) || defined(WINDOWS)
+  return -1;
+#else
+  lock_guard<mutex> lock(pgfCallbacksLock);
+  int fds[2];
+
+  if (line->readFd >= 0 || pipe(fds) != 0)
+    return -1;
+
+  fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+  line->readFd = fds[0];
+  line->writeFd = fds[1];
+  pgfRequestedLines.push_back(line);
+  pgfUpdateRunning();
 
   return 0;
+#endif
+}
+
+void gpiod_line_release(struct gpiod_line *line) {
+#if !defined(WIN32) && !defined(WINDOWS)
+  lock_guard<mutex> lock(pgfCallbacksLock);
+
+  if (line->readFd < 0)
+    return;
+
+  close(line->readFd);
+  close(line->writeFd);
+  line->readFd = line->writeFd = -1;
+  pgfRequestedLines.erase(remove(pgfRequestedLines.begin(), pgfRequestedLines.end(), line), pgfRequestedLines.end());
+  pgfUpdateRunning();
+#endif
+}
+
+int gpiod_line_event_get_fd(struct gpiod_line *line) {
+  return line->readFd;
+}
+
+int gpiod_line_event_read_fd(int fd, struct gpiod_line_event *event) {
+#if defined(WIN32) || defined(WINDOWS)
+  return -1;
+#else
+  return read(fd, event, sizeof(*event)) == (ssize_t) sizeof(*event) ? 0 : -1;
+#endif
 }
 
 void fakeGpiodInit() {
@@ -1,6 +1,7 @@
 #ifndef GPIOD_FAKE
 #define GPIOD_FAKE
 
+#include <stddef.h>
 #include <stdint.h>
 #include <time.h>
 
@@ -13,6 +14,17 @@
 
 #define GPIOD_CTXLESS_EVENT_CB_RET_STOP 1
 
+#define GPIOD_LINE_EVENT_RISING_EDGE  1
+#define GPIOD_LINE_EVENT_FALLING_EDGE 2
+
+struct gpiod_chip;
+struct gpiod_line;
+
+struct gpiod_line_event {
+  struct timespec ts;
+  int event_type;
+};
+
 struct gpiod_ctxless_event_poll_fd {
   int fd;
   bool event;
@@ -25,10 +37,20 @@ typedef int (*gpiod_ctxless_event_poll_cb)(unsigned int,
   struct gpiod_ctxless_event_poll_fd *,
   const struct timespec *, void *);
 
+int gpiod_ctxless_find_line(const char *name, char *chipname, size_t chipname_size, unsigned int *offset);
+
 int gpiod_ctxless_event_monitor(const char* device, int event_type, unsigned int dataPin, bool active_low,
       const char* consumer, const timespec* timeout, gpiod_ctxless_event_poll_cb poll_cb,
       gpiod_ctxless_event_handle_cb event_cb, void* miscData);
 
+struct gpiod_chip *gpiod_chip_open_by_name(const char *name);
+void gpiod_chip_close(struct gpiod_chip *chip);
+struct gpiod_line *gpiod_chip_get_line(struct gpiod_chip *chip, unsigned int offset);
+int gpiod_line_request_both_edges_events(struct gpiod_line *line, const char *consumer);
+void gpiod_line_release(struct gpiod_line *line);
+int gpiod_line_event_get_fd(struct gpiod_line *line);
+int gpiod_line_event_read_fd(int fd, struct gpiod_line_event *event);
+
 void fakeGpiodInit();
 
 #endif
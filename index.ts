@@ -1,3 +1,5 @@
+import { Readable } from 'stream';
+
 const ArSignalMonitor = require('bindings')('ar_signal_monitor');
 
 export interface HtSensorData {
@@ -8,6 +10,7 @@ export interface HtSensorData {
   miscData2: number;     // Bits 17-23 of the transmission.
   miscData3: number;     // Bits 33-35 of the transmission.
   rawTemp: number;       // Integer tenths of a degree Celsius plus 1000 (original transmission data format)
+  restored: boolean;     // Reloaded from the state file after a restart, rather than newly received
   signalQuality: number; // Integer 0-100
   tempCelsius: number;
   tempFahrenheit: number;
@@ -16,39 +19,453 @@ export interface HtSensorData {
 
 export enum PinSystem { GPIO, PHYS, WIRING_PI, VIRTUAL = 2 /* Alias for WIRING_PI */ }
 
+export interface GpioLine {
+  chip?: string;         // gpiochip name, such as 'gpiochip4'. If omitted, a numeric line is a GPIO number.
+  line: number | string; // Line offset within the chip, or a line name such as 'GPIO27'
+}
+
 export type HtSensorDataCallback = (data: HtSensorData) => void;
 
-export function addSensorDataListener(pin: number | string, callback: HtSensorDataCallback): number;
-export function addSensorDataListener(pin: number, pinSystem: PinSystem, callback: HtSensorDataCallback): number;
-export function addSensorDataListener(pin: number | string, pinSysOrCallback: PinSystem | HtSensorDataCallback,
-                                      callback?: HtSensorDataCallback): number {
-  let pinNumber: number;
+export type HtSensorDataBatchCallback = (data: HtSensorData[]) => void;
+
+export type SensorPin = number | string | GpioLine;
+
+function parsePin(pin: string): [number, PinSystem] {
+  let pinNumber = parseFloat(pin);
+
+  pinNumber = (isNaN(pinNumber) ? 27 : pinNumber);
+  const pinSystemIndex = 'pwv'.indexOf(pin.substr(-1).toLowerCase()) + 1;
+
+  return [pinNumber, [PinSystem.GPIO, PinSystem.PHYS, PinSystem.WIRING_PI, PinSystem.VIRTUAL][pinSystemIndex]];
+}
+
+export interface SensorDataListenerOptions {
+  cpu?: number;              // CPU to pin the capture and decode threads to
+  lockMemory?: boolean;      // Lock all process memory (mlockall) to avoid paging delays
+  realtimePriority?: number; // SCHED_FIFO priority (1-99) for the capture and decode threads
+
+  // Filters, applied natively before readings are passed to JavaScript.
+  channels?: string;            // Channels to receive, such as 'AB'. Default: all
+  sensorIds?: number[];         // Sensor IDs (miscData1) to receive. Default: all
+  minTempDelta?: number;        // Minimum change in °C since the last reading received for a channel
+  minHumidityDelta?: number;    // Minimum change in humidity since the last reading received for a channel
+  minInterval?: number;         // Minimum milliseconds between readings received for a channel
+  includeDeadAir?: boolean;     // Receive dead air reports (channel '-'). Default: true
+  includeQualityOnly?: boolean; // Receive updates where only signalQuality has changed. Default: true
+
+  // Readings waiting to be delivered to JavaScript are held in a bounded queue.
+  queueSize?: number;           // 1-64, else a RangeError is thrown. Default: 64
+  // What to do when the queue is full. 'block' waits up to 100 ms, then drops the oldest. Default: 'dropOldest'
+  overflow?: 'dropOldest' | 'coalesce' | 'block';
+
+  // Keep a history of readings on disk, one memory-mapped ring file per channel. See getHistory().
+  history?: HistoryOptions;
+
+  // Save the latest readings and signal quality of the pin(s) to this file every minute and on shutdown, and
+  // reload them on startup, so that readings, flagged as restored, are available at once after a restart.
+  stateFile?: string;
+
+  // Append the readings this listener receives, less dead air and quality updates, to a compact archive file.
+  archive?: ArchiveOptions;
+
+  // Keep the pin(s)' table of latest readings in POSIX shared memory under this name, such as
+  // '/ar-signal-monitor-latest', for other processes to poll. The first listener on a pin to ask decides the
+  // name. See openReadingTable().
+  sharedTable?: string;
+}
+
+export interface ArchiveOptions {
+  path: string;
+  blockSize?: number;      // Bytes per block. Default: 4096
+  commitInterval?: number; // Longest time, in milliseconds, readings are buffered before being written. Default: 10 minutes
+  syncInterval?: number;   // Milliseconds between syncs to storage. Default: 1 hour
+}
+
+export interface HistoryOptions {
+  directory: string;
+  prefix?: string;   // Files are named <directory>/<prefix>-A.hist, etc. Default: 'history'
+  capacity?: number; // Readings kept per channel. Default: 8192
+}
+
+export interface HtHistoryReading extends HtSensorData {
+  time: number; // Milliseconds since the epoch
+}
+
+export interface QueueStats {
+  capacity: number;
+  coalesced: number; // Readings replaced by a newer reading for the same channel
+  depth: number;     // Readings currently waiting
+  dropped: number;   // Readings dropped because the queue was full
+}
+
+export function addSensorDataListener(pin: SensorPin | SensorPin[], callback: HtSensorDataCallback,
+                                      options?: SensorDataListenerOptions): number;
+export function addSensorDataListener(pin: number | number[], pinSystem: PinSystem, callback: HtSensorDataCallback,
+                                      options?: SensorDataListenerOptions): number;
+export function addSensorDataListener(pin: SensorPin | SensorPin[], pinSysOrCallback: PinSystem | HtSensorDataCallback,
+                                      callbackOrOptions?: HtSensorDataCallback | SensorDataListenerOptions,
+                                      options?: SensorDataListenerOptions): number {
+  let pinNumber: number | GpioLine | (number | GpioLine)[];
   let pinSystem = PinSystem.GPIO;
+  let callback: HtSensorDataCallback;
 
-  if (typeof pin === 'string') {
-    pinNumber = parseFloat(pin);
-    pinNumber = (isNaN(pinNumber) ? 27 : pinNumber);
-    const pinSystemIndex = 'pwv'.indexOf(pin.substr(-1).toLowerCase()) + 1;
-    pinSystem = [PinSystem.GPIO, PinSystem.PHYS, PinSystem.WIRING_PI, PinSystem.VIRTUAL][pinSystemIndex];
+  if (typeof pinSysOrCallback === 'function') {
+    callback = pinSysOrCallback;
+    options = callbackOrOptions as SensorDataListenerOptions;
   }
+  else {
+    pinSystem = pinSysOrCallback;
+    callback = callbackOrOptions as HtSensorDataCallback;
+  }
+
+  if (typeof pin === 'string')
+    [pinNumber, pinSystem] = parsePin(pin);
   else
-    pinNumber = pin;
+    pinNumber = toNativePin(pin);
 
-  if (typeof pinSysOrCallback === 'function')
-    callback = pinSysOrCallback;
+  if (typeof callback !== 'function')
+    throw new Error('callback function must be specified');
+
+  return ArSignalMonitor.addSensorDataListener(pinNumber, pinSystem, callback, options || {});
+}
+
+// Readings which arrive while JavaScript is busy are delivered together, in order, in a single call.
+export function addSensorDataBatchListener(pin: SensorPin | SensorPin[], callback: HtSensorDataBatchCallback,
+                                           options?: SensorDataListenerOptions): number {
+  let pinNumber: number | GpioLine | (number | GpioLine)[];
+  let pinSystem = PinSystem.GPIO;
+
+  if (typeof pin === 'string')
+    [pinNumber, pinSystem] = parsePin(pin);
   else
-    pinSystem = pinSysOrCallback;
+    pinNumber = toNativePin(pin);
 
   if (typeof callback !== 'function')
     throw new Error('callback function must be specified');
 
-  return ArSignalMonitor.addSensorDataListener(pinNumber, pinSystem, callback);
+  return ArSignalMonitor.addSensorDataListener(pinNumber, pinSystem, callback, Object.assign({}, options, { batch: true }));
+}
+
+// An object-mode Readable stream of readings, which only takes readings from the native queue as fast as they're
+// consumed. Streams are async iterable, so `for await (const data of stream)` works as well.
+export class SensorDataStream extends Readable {
+  readonly callbackId: number;
+  private wanted = false;
+
+  constructor(pin: SensorPin | SensorPin[], options?: SensorDataListenerOptions) {
+    super({ objectMode: true, highWaterMark: 1 });
+
+    let pinNumber: number | GpioLine | (number | GpioLine)[];
+    let pinSystem = PinSystem.GPIO;
+
+    if (typeof pin === 'string')
+      [pinNumber, pinSystem] = parsePin(pin);
+    else
+      pinNumber = toNativePin(pin);
+
+    this.callbackId = ArSignalMonitor.addSensorDataListener(pinNumber, pinSystem, () => this.pull(),
+      Object.assign({}, options, { pull: true }));
+  }
+
+  getQueueStats(): QueueStats {
+    return getQueueStats(this.callbackId);
+  }
+
+  _read(): void {
+    this.wanted = true;
+    this.pull();
+  }
+
+  _destroy(err: Error | null, callback: (error?: Error | null) => void): void {
+    removeSensorDataListener(this.callbackId);
+    callback(err);
+  }
+
+  private pull(): void {
+    while (this.wanted) {
+      const data = ArSignalMonitor.takeSensorData(this.callbackId);
+
+      if (!data)
+        break;
+
+      this.wanted = this.push(data);
+    }
+  }
+}
+
+export function createSensorDataStream(pin: SensorPin | SensorPin[], options?: SensorDataListenerOptions): SensorDataStream {
+  return new SensorDataStream(pin, options);
+}
+
+function toNativePin(pin: number | GpioLine | SensorPin[]): number | GpioLine | (number | GpioLine)[] {
+  // With multiple receivers, string pins are converted to GPIO numbers, so that each can have its own pin system.
+  if (Array.isArray(pin))
+    return pin.map(p => typeof p === 'string' ? { line: convertPin(p, PinSystem.GPIO) } : p);
+  else
+    return pin;
 }
 
 export function removeSensorDataListener(callbackId: number): void {
   ArSignalMonitor.removeSensorDataListener(callbackId);
 }
 
+// Number of times edges were lost, or the timing buffer wrapped, before signal data could be processed.
+export function getOverrunCount(callbackId: number): number {
+  return ArSignalMonitor.getOverrunCount(callbackId);
+}
+
+export interface MonitorStats {
+  edges: number;
+  noiseEdges: number;
+  syncs: number;
+  candidateFrames: number;
+  badBitFrames: number;
+  badParityFrames: number;
+  badChecksumFrames: number;
+  goodFrames: number;
+  bitRepairs: number;
+  cleanUps: number;
+  suppressedRepeats: number;
+  dispatches: number;
+  overruns: number;
+}
+
+// Running totals of decoder activity, for telling a weak signal from a noisy one.
+export function getStats(callbackId: number): MonitorStats | undefined {
+  return ArSignalMonitor.getStats(callbackId);
+}
+
+// Latencies are in microseconds. Percentiles are accurate to within 12.5%.
+export interface LatencySummary {
+  count: number;
+  mean: number;
+  p50: number;
+  p90: number;
+  p99: number;
+  p999: number;
+  max: number;
+}
+
+export interface MonitorLatencies {
+  holdWait: LatencySummary;          // Decoding until release from the hold for repeated messages
+  dispatchLockWait: LatencySummary;  // Waiting for the dispatch lock
+  listenerExecution: LatencySummary; // Running each listener
+  tsfnQueueing: LatencySummary;      // Waiting in a listener's queue for the JavaScript thread
+}
+
+export function getLatencies(callbackId: number): MonitorLatencies | undefined {
+  return ArSignalMonitor.getLatencies(callbackId);
+}
+
+// Widths are in microseconds. bins[i] counts values from binStart + i * binWidth, up to the next bin.
+export interface SignalHistogram {
+  nominal: number;
+  tolerance: number; // The decoder only accepts values within nominal ± tolerance
+  binStart: number;
+  binWidth: number;
+  bins: number[];
+  below: number;
+  above: number;
+  count: number;
+  mean: number;
+  standardDeviation: number;
+  min: number;
+  max: number;
+  p1: number;
+  p50: number;
+  p99: number;
+}
+
+export interface ChannelSignalHealth {
+  frames: number;
+  shortPulse: SignalHistogram;
+  longPulse: SignalHistogram;
+  syncPulse: SignalHistogram;
+  frameJitter: SignalHistogram; // Deviation from the nominal spacing of repeated frames
+}
+
+export function getSignalHealth(callbackId: number): Record<string, ChannelSignalHealth> | undefined {
+  return ArSignalMonitor.getSignalHealth(callbackId);
+}
+
+// Readings from a listener's history, oldest first, collected from fromTime (inclusive) until toTime (exclusive).
+export function getHistory(callbackId: number, channel: string, fromTime?: number | Date,
+                           toTime?: number | Date): HtHistoryReading[] | undefined {
+  return ArSignalMonitor.getHistory(callbackId, channel, fromTime == null ? undefined : +fromTime,
+    toTime == null ? undefined : +toTime);
+}
+
+// Every reading in an archive file written using the archive option, oldest first.
+export function readArchive(path: string): HtHistoryReading[] {
+  return ArSignalMonitor.readArchive(path);
+}
+
+// Recent decoder decisions, in the binary format described in ar-trace-ring.h. Save to a file and print with ar-trace-tool.
+export function dumpTrace(callbackId: number): Buffer | undefined {
+  const trace = ArSignalMonitor.dumpTrace(callbackId);
+
+  return trace && Buffer.from(trace);
+}
+
+// Layout of the table of latest readings, as documented in ar-reading-table.h.
+const TABLE_MAGIC = 0x41525254;
+const TABLE_VERSION = 1;
+const TABLE_HEADER_WORDS = 16;
+const TABLE_SLOT_COUNT = 3;
+const TABLE_MAX_READ_ATTEMPTS = 1000;
+
+enum SlotWord {
+  SEQUENCE, CHANNEL, FLAGS, RAW_TEMP, TEMP_CELSIUS_TENTHS, TEMP_FAHRENHEIT_TENTHS, HUMIDITY,
+  SIGNAL_QUALITY, MISC_DATA_1, MISC_DATA_2, MISC_DATA_3, REPEATS_CAPTURED,
+  COLLECTION_TIME_LOW, COLLECTION_TIME_HIGH // Wall clock microseconds
+}
+
+const BATTERY_LOW = 1;
+const VALID_CHECKSUM = 2;
+const RESTORED = 4;
+
+function fromTenths(value: number): number {
+  return value === -9990 ? undefined as any as number : value / 10;
+}
+
+// The latest reading for each channel. A table in this process is read directly from memory shared with the
+// native monitor. A table published by another process is mapped read-only by the addon, and read through it.
+export class HtReadingTable {
+  private readonly handle: object | undefined;
+  private readonly scratch: Int32Array;
+  private readonly slotCount: number = TABLE_SLOT_COUNT;
+  private readonly slotWords: number = 0;
+  private readonly words: Int32Array;
+
+  constructor(source: ArrayBuffer | SharedArrayBuffer | object) {
+    if (!(source instanceof ArrayBuffer) && !(source instanceof SharedArrayBuffer)) {
+      this.handle = source;
+      this.words = this.scratch = new Int32Array(0);
+
+      return;
+    }
+
+    this.words = new Int32Array(source as ArrayBuffer);
+
+    if (this.words[0] !== TABLE_MAGIC || this.words[1] !== TABLE_VERSION)
+      throw new Error('Unrecognized reading table format');
+
+    this.slotCount = this.words[2];
+    this.slotWords = this.words[3];
+    this.scratch = new Int32Array(this.slotWords);
+  }
+
+  // Undefined if the channel has no reading, or if its slot is stuck mid-write.
+  read(channel: string): HtHistoryReading | undefined {
+    if (this.handle)
+      return ArSignalMonitor.readSharedTable(this.handle, channel);
+
+    const index = channel.charCodeAt(0) - 65;
+
+    if (index < 0 || index >= this.slotCount)
+      return undefined;
+
+    const base = TABLE_HEADER_WORDS + index * this.slotWords;
+    const values = this.scratch;
+
+    for (let attempt = 0; ; ++attempt) {
+      // A slot which stays busy this long has a publisher which stalled or died while writing it.
+      if (attempt >= TABLE_MAX_READ_ATTEMPTS)
+        return undefined;
+
+      const sequence = Atomics.load(this.words, base);
+
+      if (sequence === 0)
+        return undefined;
+      else if (sequence & 1)
+        continue;
+
+      for (let i = 1; i < this.slotWords; ++i)
+        values[i] = this.words[base + i];
+
+      if (Atomics.load(this.words, base) === sequence)
+        break;
+    }
+
+    return {
+      batteryLow: (values[SlotWord.FLAGS] & BATTERY_LOW) !== 0,
+      channel: String.fromCharCode(values[SlotWord.CHANNEL]),
+      humidity: values[SlotWord.HUMIDITY] === -999 ? undefined as any as number : values[SlotWord.HUMIDITY],
+      miscData1: values[SlotWord.MISC_DATA_1],
+      miscData2: values[SlotWord.MISC_DATA_2],
+      miscData3: values[SlotWord.MISC_DATA_3],
+      rawTemp: values[SlotWord.RAW_TEMP],
+      restored: (values[SlotWord.FLAGS] & RESTORED) !== 0,
+      signalQuality: values[SlotWord.SIGNAL_QUALITY],
+      tempCelsius: fromTenths(values[SlotWord.TEMP_CELSIUS_TENTHS]),
+      tempFahrenheit: fromTenths(values[SlotWord.TEMP_FAHRENHEIT_TENTHS]),
+      time: (values[SlotWord.COLLECTION_TIME_HIGH] * 0x100000000 + (values[SlotWord.COLLECTION_TIME_LOW] >>> 0)) / 1000,
+      validChecksum: (values[SlotWord.FLAGS] & VALID_CHECKSUM) !== 0
+    };
+  }
+
+  readAll(): HtHistoryReading[] {
+    const results: HtHistoryReading[] = [];
+
+    for (let i = 0; i < this.slotCount; ++i) {
+      const data = this.read(String.fromCharCode(65 + i));
+
+      if (data)
+        results.push(data);
+    }
+
+    return results;
+  }
+}
+
+// The table for the monitor behind a listener. Reading it never calls into the addon.
+export function getReadingTable(callbackId: number): HtReadingTable | undefined {
+  const buffer = ArSignalMonitor.getReadingTable(callbackId);
+
+  return buffer ? new HtReadingTable(buffer) : undefined;
+}
+
+// A table published to shared memory by another process, by default the one published by `ar-signal-monitor-test -S`.
+export function openReadingTable(name?: string): HtReadingTable {
+  return new HtReadingTable(ArSignalMonitor.attachReadingTable(name));
+}
+
+// Reads the readings published by another process, such as `ar-signal-monitor-test -S`, to a shared memory
+// ring, in order and with its own cursor. The addon maps the ring read-only, and reads it without system calls.
+export class SharedRingReader {
+  private readonly handle: object;
+
+  constructor(name?: string, fromOldest = false) {
+    this.handle = ArSignalMonitor.attachSharedRing(name, fromOldest);
+  }
+
+  // Readings skipped because this reader fell too far behind
+  get lost(): number {
+    return ArSignalMonitor.getSharedRingStatus(this.handle).lost;
+  }
+
+  // Times the publisher started the ring over, or replaced it with one of a different size
+  get resets(): number {
+    return ArSignalMonitor.getSharedRingStatus(this.handle).resets;
+  }
+
+  available(): number {
+    return ArSignalMonitor.getSharedRingStatus(this.handle).available;
+  }
+
+  next(): HtHistoryReading | undefined {
+    return ArSignalMonitor.readSharedRing(this.handle, 1)[0];
+  }
+
+  readAll(): HtHistoryReading[] {
+    return ArSignalMonitor.readSharedRing(this.handle);
+  }
+}
+
+export function getQueueStats(callbackId: number): QueueStats {
+  return ArSignalMonitor.getQueueStats(callbackId);
+}
+
 export function convertPin(pin: number, pinSystemFrom: PinSystem, pinSystemTo: PinSystem): number;
 export function convertPin(gpioPin: number, pinSystemTo: PinSystem): number;
 export function convertPin(pin: string, pinSystemTo: PinSystem): number;
@@ -58,10 +475,7 @@ export function convertPin(pin: number | string, pinSystem0: PinSystem, pinSyste
   let pinSystemTo: number;
 
   if (typeof pin === 'string') {
-    pinNumber = parseFloat(pin);
-    pinNumber = (isNaN(pinNumber) ? 27 : pinNumber);
-    const pinSystemIndex = 'pwv'.indexOf(pin.substr(-1).toLowerCase()) + 1;
-    pinSystemFrom = [PinSystem.GPIO, PinSystem.PHYS, PinSystem.WIRING_PI, PinSystem.VIRTUAL][pinSystemIndex];
+    [pinNumber, pinSystemFrom] = parsePin(pin);
     pinSystemTo = pinSystem0;
   }
   else {
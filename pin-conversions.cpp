@@ -206,7 +206,10 @@ static void getConversions() {
 int convertPin(int pinNumber, PinSystem pinSysFrom, PinSystem pinSysTo) {
   getConversions();
 
-  if (!supportPhysPins && (pinSysFrom == PHYS || pinSysTo == PHYS))
+  // GPIO numbers beyond 31 (CM4 banks, expanders, etc.) have no conversions, but are still valid as-is.
+  if (pinSysFrom == GPIO && pinSysTo == GPIO)
+    return pinNumber < 0 ? -1 : pinNumber;
+  else if (!supportPhysPins && (pinSysFrom == PHYS || pinSysTo == PHYS))
     throw "Unknown hardware - physical pin numbering not supported";
   else if (pinNumber < 0 || pinNumber > 63 || (pinSysFrom != PHYS && pinNumber > 31))
     return -1;
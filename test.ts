@@ -1,11 +1,17 @@
-import { addSensorDataListener, convertPin, PinSystem, removeSensorDataListener } from './index';
+import { addSensorDataListener, convertPin, HtSensorData, PinSystem, removeSensorDataListener } from './index';
 
+let churnSeconds = 0;
 let pin = '';
 let pinouts = false;
+let rateCount = 0;
 
-for (let i = 0; i < process.argv.length && !pin; ++i) {
-  pin = process.argv[i] === '-p' ? process.argv[i + 1]?.toLowerCase().trim() : '';
+const RATE_TIMEOUT = 60000;
+
+for (let i = 0; i < process.argv.length; ++i) {
+  pin = pin || (process.argv[i] === '-p' ? process.argv[i + 1]?.toLowerCase().trim() : '');
   pinouts = pinouts || process.argv[i] === '--pinouts';
+  churnSeconds = churnSeconds || (process.argv[i] === '--churn' ? Number(process.argv[i + 1]) || 10 : 0);
+  rateCount = rateCount || (process.argv[i] === '--rate' ? Number(process.argv[i + 1]) || 1000000 : 0);
 }
 
 if (pinouts) {
@@ -40,9 +46,19 @@ if (pinouts) {
 }
 
 pin = pin || '27';
-console.log(`Awaiting humidity/temperature data on pin ${pin}...`);
 
-const id = addSensorDataListener(pin, data => {
+let id = -1;
+
+if (churnSeconds)
+  churnBenchmark(churnSeconds);
+else if (rateCount)
+  rateBenchmark(rateCount);
+else {
+  console.log(`Awaiting humidity/temperature data on pin ${pin}...`);
+  id = addSensorDataListener(pin, showData);
+}
+
+function showData(data: HtSensorData): void {
   const date = new Date();
   const timeStamp = new Date(date.getTime() -
     date.getTimezoneOffset() * 60000).toISOString().substr(11, 19).replace('T', ' ') + ':';
@@ -64,10 +80,84 @@ const id = addSensorDataListener(pin, data => {
     data.miscData3.toString(16).toUpperCase());
 
   console.log(timeStamp, formatted);
-});
+}
+
+// Adds and removes listeners as fast as possible, reporting the rate and memory use once a second.
+// One listener is kept throughout, so that the pin's monitor stays running.
+function churnBenchmark(seconds: number): void {
+  const keeper = addSensorDataListener(pin, () => {});
+  const start = Date.now();
+  let changes = 0;
+  let lastChanges = 0;
+  let lastReport = start;
+
+  const churn = (): void => {
+    for (let i = 0; i < 100; ++i) {
+      removeSensorDataListener(addSensorDataListener(pin, () => {}));
+      changes += 2;
+    }
+
+    const now = Date.now();
+
+    if (now >= lastReport + 1000) {
+      const memory = process.memoryUsage();
+
+      console.log('%s listener changes/s, rss %s KB, heap %s KB',
+        Math.round((changes - lastChanges) * 1000 / (now - lastReport)),
+        Math.round(memory.rss / 1024), Math.round(memory.heapUsed / 1024));
+      lastChanges = changes;
+      lastReport = now;
+    }
+
+    if (now < start + seconds * 1000)
+      setImmediate(churn); // Lets the finalizers for removed listeners run between rounds
+    else {
+      removeSensorDataListener(keeper);
+      process.exit(0);
+    }
+  };
+
+  churn();
+}
+
+// Measures how many readings per second can be delivered to JavaScript, using a synthetic source which
+// produces readings as fast as they can be consumed. Only addons built with the fake gpiod have the source,
+// and its readings, on channel '?' with sensor ID 16383, are counted apart from the fake receiver's.
+function rateBenchmark(count: number): void {
+  const simulateReadings = require('bindings')('ar_signal_monitor').simulateReadings;
+
+  if (!simulateReadings) {
+    console.error('The rate benchmark needs an addon built with the fake gpiod');
+    process.exit(1);
+  }
+
+  const start = Date.now();
+  let received = 0;
+
+  const rateId = addSensorDataListener(pin, (data: HtSensorData) => {
+    if (data.channel === '?' && data.miscData1 === 16383 && ++received === count) {
+      const elapsed = Date.now() - start;
+
+      console.log('%s readings in %s ms, %s readings/s', count, elapsed, Math.round(count * 1000 / elapsed));
+      removeSensorDataListener(rateId);
+      process.exit(0);
+    }
+  }, { overflow: 'block' });
+
+  // Readings dropped after the bounded wait of the 'block' overflow policy never arrive, so don't wait forever.
+  setTimeout(() => {
+    console.error('Only %s of %s readings received after %s seconds', received, count, RATE_TIMEOUT / 1000);
+    removeSensorDataListener(rateId);
+    process.exit(1);
+  }, RATE_TIMEOUT);
+
+  simulateReadings(rateId, count);
+}
 
 function cleanUp() {
-  removeSensorDataListener(id);
+  if (id >= 0)
+    removeSensorDataListener(id);
+
   console.log();
   process.exit(0);
 }